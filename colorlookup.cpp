@@ -0,0 +1,27 @@
+#include "colorlookup.h"
+#include <limits>
+
+Lookup::RangeTable::RangeTable(const std::map<double, Color> &colorValues, bool useGradient) : useGradient(useGradient)
+{
+    keys.reserve(colorValues.size()+1);
+    colors.reserve(colorValues.size()+1);
+    intervals.reserve(colorValues.size()+1);
+    const std::pair<const double, Color>* previous = nullptr;
+    for (const auto& value : colorValues) {
+        keys.push_back(value.first);
+        colors.push_back(value.second);
+        Interval interval = {0, {0,0,0,0}, {0,0,0,0}};
+        if (previous) {
+            interval.origin = previous->first;
+            for (auto k = 0; k < 4; ++k) {
+                interval.base[k] = previous->second[k];
+                interval.slope[k] = ((double)value.second[k]-previous->second[k])/(value.first-previous->first);
+            }
+        }
+        intervals.push_back(interval);
+        previous = &value;
+    }
+    keys.push_back(std::numeric_limits<double>::infinity());
+    colors.push_back({0,0,0,0});
+    intervals.push_back({0, {0,0,0,0}, {0,0,0,0}});
+}
@@ -0,0 +1,89 @@
+#ifndef COLORLOOKUP_H
+#define COLORLOOKUP_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace Lookup {
+using Color = std::array<std::uint8_t,4>;
+
+// the breakpoints of RGB_UserRanges compiled into flat arrays.
+// a cell takes the color of the first breakpoint not below it, or with a gradient, the color interpolated
+// between that breakpoint and the one before it. cells above the last breakpoint are transparent
+class RangeTable {
+public:
+    RangeTable(const std::map<double,Color>& colorValues, bool useGradient);
+
+    Color operator()(double cell) const {
+        // branchless lower bound; keys end with +inf, so the search never runs past them.
+        // NaN compares false everywhere and lands on the first breakpoint
+        const double* base = keys.data();
+        size_t n = keys.size();
+        while (n > 1) {
+            size_t half = n/2;
+            base = base[half] < cell ? base+half : base;
+            n -= half;
+        }
+        base += *base < cell;
+        size_t index = base-keys.data();
+        if (!useGradient || cell == *base || index == 0) return colors[index];
+        const auto& interval = intervals[index];
+        double t = cell-interval.origin;
+        return {(std::uint8_t)(interval.base[0]+t*interval.slope[0]),
+                (std::uint8_t)(interval.base[1]+t*interval.slope[1]),
+                (std::uint8_t)(interval.base[2]+t*interval.slope[2]),
+                (std::uint8_t)(interval.base[3]+t*interval.slope[3])};
+    }
+
+private:
+    // the colors of the line that ends at keys[i], starting at the breakpoint before it.
+    // the first one is never used, cells below the first breakpoint take its color
+    struct Interval {
+        double origin;
+        double base[4];
+        double slope[4];
+    };
+
+    bool useGradient;
+    std::vector<double> keys;
+    std::vector<Color> colors;
+    std::vector<Interval> intervals;
+};
+
+// the converted value of every value an 8 or 16 bit integer raster can hold
+template <typename V>
+class DenseTable {
+public:
+    DenseTable(bool isSigned, unsigned int bitsPerSample) : first(isSigned ? -(1 << (bitsPerSample-1)) : 0), values((size_t)1 << bitsPerSample) {}
+
+    size_t size() const { return values.size(); }
+    // the raster value of the index-th entry
+    std::int32_t value(size_t index) const { return first+(std::int32_t)index; }
+    template <typename F>
+    void fill(size_t begin, size_t end, F&& transform) {
+        for (auto i = begin; i < end; ++i) values[i] = transform((double)value(i));
+    }
+    // for converters that take a whole array of cells at once
+    template <typename F>
+    void fillRows(size_t begin, size_t end, F&& convert) {
+        std::vector<double> cells(end-begin);
+        for (auto i = begin; i < end; ++i) cells[i-begin] = value(i);
+        convert(cells.data(), cells.size(), values.data()+begin);
+    }
+
+    // whole cells in the range of the raster's type; others, like averages of a downscaled image, aren't in the table
+    bool contains(double cell) const {
+        return cell >= first && cell < first+(double)values.size() && cell == (double)(std::int32_t)cell;
+    }
+    const V& operator[](std::int32_t cell) const { return values[cell-first]; }
+
+private:
+    std::int32_t first;
+    std::vector<V> values;
+};
+}
+
+#endif // COLORLOOKUP_H
@@ -1,6 +1,14 @@
 #include "commonfunctions.h"
 #include "qtfunctions.h"
 #include <rapidcsv.h>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <algorithm>
 #include <sstream>
 
 Color Color::fromString(const QString &str, bool& ok)
@@ -158,3 +166,61 @@ std::vector<std::string> Util::getAllCsvColumns(const std::string& path)
     return rv;
 }
 
+QString Util::getFileCacheKey(const QString &path)
+{
+    // a file that is replaced or modified gets a new key, so stale cache entries are never read.
+    // the key starts with a hash of the path alone, so the entries of the file's older versions can be found
+    QFileInfo info(path);
+    auto version = QString::number(info.size())+"|"+QString::number(info.lastModified().toMSecsSinceEpoch());
+    return QCryptographicHash::hash(info.absoluteFilePath().toUtf8(), QCryptographicHash::Sha1).toHex()+"_"+
+           QCryptographicHash::hash(version.toUtf8(), QCryptographicHash::Sha1).toHex().left(16);
+}
+
+QString Util::getCacheDirectory(const QString &name)
+{
+    auto path = QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+name;
+    QDir().mkpath(path);
+    return path;
+}
+
+void Util::trimCacheDirectory(const QString &name, const QString &path, std::uint64_t maxBytes)
+{
+    // entries are the files and directories named after a file's cache key. the ones of older versions of path are
+    // removed, then the least recently modified ones until the rest fits in maxBytes
+    QDir cache(getCacheDirectory(name));
+    auto key = getFileCacheKey(path);
+    auto pathKey = key.left(key.indexOf('_')+1);
+    struct Entry {
+        QFileInfo info;
+        std::uint64_t bytes = 0;
+        QDateTime modified;
+    };
+    std::vector<Entry> entries;
+    std::uint64_t total = 0;
+    for (const auto& info : cache.entryInfoList(QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot)) {
+        bool stale = info.fileName().startsWith(pathKey) && !info.fileName().startsWith(key);
+        if (stale) {
+            if (info.isDir()) QDir(info.absoluteFilePath()).removeRecursively();
+            else QFile::remove(info.absoluteFilePath());
+            continue;
+        }
+        Entry entry{info, info.isDir() ? 0 : (std::uint64_t)info.size(), info.lastModified()};
+        if (info.isDir()) {
+            QDirIterator it(info.absoluteFilePath(), QDir::Files, QDirIterator::Subdirectories);
+            while (it.hasNext()) {
+                it.next();
+                entry.bytes += it.fileInfo().size();
+                entry.modified = std::max(entry.modified, it.fileInfo().lastModified());
+            }
+        }
+        total += entry.bytes;
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.modified < b.modified; });
+    for (const auto& entry : entries) {
+        if (total <= maxBytes) break;
+        if (entry.info.isDir()) QDir(entry.info.absoluteFilePath()).removeRecursively();
+        else QFile::remove(entry.info.absoluteFilePath());
+        total -= entry.bytes;
+    }
+}
@@ -2,6 +2,7 @@
 #define COMMONFUNCTIONS_H
 
 #include "boost/endian/detail/endian_load.hpp"
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <map>
@@ -56,7 +57,23 @@ enum class OutputMode {
 enum class TileMode {
     No,
     DefineByNumber,
-    DefineBySize
+    DefineBySize,
+    XyzPyramid
+};
+
+// png compression, in the order of the compression combo boxes
+enum class Compression {
+    Fastest,
+    Balanced,
+    Smallest
+};
+
+// the file an export is written to, in the order of the format combo boxes
+enum class OutputFormat {
+    Png,
+    Raw,
+    Qoi,
+    Pgm
 };
 
 enum class PixelSize {
@@ -100,6 +117,9 @@ void displayProgressBar(QProgressBar* bar, QLabel* label, QString desc);
 void hideProgressBar(QProgressBar* bar, QLabel* label);
 GpkgLayerType gpkgLayerTypeFromString(const std::string& str);
 std::vector<std::string> getAllCsvColumns(const std::string& path);
+QString getFileCacheKey(const QString& path);
+QString getCacheDirectory(const QString& name);
+void trimCacheDirectory(const QString& name, const QString& path, std::uint64_t maxBytes);
 
 struct Boundaries {
     double minX, maxX, minY, maxY;
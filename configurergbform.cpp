@@ -6,6 +6,7 @@
 #include "ui_configurergbform.h"
 #include "qtfunctions.h"
 #include "imageconverter.h"
+#include "consts.h"
 #include <QFile>
 #include <rapidcsv.h>
 
@@ -378,6 +379,8 @@ void ConfigureRGBForm::on_pushButton_2_clicked()
     auto io = ImageConverter();
     connect(&io, &ImageConverter::sendProgress, this, &ConfigureRGBForm::receiveProgressUpdate, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressError, this, &ConfigureRGBForm::receiveProgressError, Qt::DirectConnection);
+    // the preview of the same file usually follows, and finds its strips or tiles decoded already
+    io.setTileCache(&Tiff::TileCache::session());
 
     if (mode == Util::OutputMode::RGB_UserRanges) {
         double min, max;
@@ -391,7 +394,9 @@ void ConfigureRGBForm::on_pushButton_2_clicked()
     }
     else if (mode == Util::OutputMode::RGB_UserValues) {
         displayProgressBar("Finding all distinct values...");
-        auto distinctValues = io.GetDistinctValues(path);
+        bool tooManyValues;
+        auto distinctValues = io.GetDistinctValues(path, Distinct::maxValues, tooManyValues);
+        if (tooManyValues) Gui::ThrowError("The image has more than " + QString::number(Distinct::maxValues) + " distinct values. Use ranges instead.");
         if (distinctValues.empty()) return;
         for (auto value : distinctValues) addNewRowToTable(QString::number(value,'g',17),"0,0,0,255",false);
         hideProgressBar();
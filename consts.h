@@ -1,6 +1,7 @@
 #ifndef CONSTS_H
 #define CONSTS_H
 
+#include <cstddef>
 #include <cstdint>
 
 namespace Gpkg {
@@ -54,4 +55,70 @@ namespace Gpkg {
 
 }
 
+namespace Pyramid {
+    // images smaller than this are decreased fast enough without a pyramid
+    constexpr uint64_t minPixels = 8192ull*8192;
+    // a window smaller than this share of the image is read faster directly than the whole image is read for a build
+    constexpr double minWindowShare = 0.25;
+    // levels are added until the image fits in this size
+    constexpr uint32_t minLevelSize = 512;
+    constexpr uint32_t rowsPerStrip = 64;
+    constexpr uint32_t minBandRows = 256;
+    constexpr uint64_t maxBandBytes = 512ull*1024*1024;
+    // the pyramids of all files together; the least recently used ones are removed to make room for a new one
+    constexpr uint64_t maxCacheBytes = 8ull*1024*1024*1024;
+}
+
+namespace Distinct {
+    // a raster with more distinct values than this is continuous and should be colored by ranges
+    constexpr size_t maxValues = 1024;
+}
+
+namespace TileCacheSize {
+    // decoded strips or tiles kept across previews and scans
+    constexpr size_t sessionBytes = 1024ull*1024*1024;
+    // decoded strips or tiles kept by one export
+    constexpr size_t exportBytes = 512ull*1024*1024;
+}
+
+namespace Stream {
+    // memory used by one band of a streamed conversion
+    constexpr uint64_t bandBytes = 128ull*1024*1024;
+    // converted bands waiting for the writer, on top of the one being converted
+    constexpr size_t pendingBands = 2;
+}
+
+namespace ParallelPng {
+    // images with less data than this are written by libpng alone
+    constexpr uint64_t minBytes = 16ull*1024*1024;
+    // data deflated as one group, made of whole rows
+    constexpr size_t groupBytes = 256*1024;
+    // the window a group is primed with
+    constexpr size_t dictionaryBytes = 32*1024;
+}
+
+namespace XyzTiles {
+    // the width and height of a tile, the usual size of web map tiles
+    constexpr uint32_t tileSize = 256;
+    // tiles waiting to be written per thread of the pool, the reading waits once there are more
+    constexpr size_t pendingPerThread = 4;
+}
+
+namespace LuaMemo {
+    // results of a pure Lua script kept per thread, as a power of two
+    constexpr unsigned int entriesLog2 = 16;
+}
+
+namespace LuaPool {
+    // scripts whose compiled code and idle states are kept for the session
+    constexpr size_t maxScripts = 8;
+}
+
+namespace LuaExpression {
+    // cells a compiled script is run over at once
+    constexpr size_t blockSize = 256;
+    // scripts needing more registers than this are left to the interpreter
+    constexpr size_t maxRegisters = 1024;
+}
+
 #endif // CONSTS_H
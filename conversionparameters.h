@@ -19,6 +19,7 @@ struct TiffConvertParams {
     std::optional<std::map<double,color>> colorValues;
     std::optional<bool> gradient;
     std::optional<std::string> luaFunction;
+    std::optional<bool> luaPure;
 };
 
 struct CsvConvertParams {
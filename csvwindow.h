@@ -28,6 +28,8 @@ private slots:
 
     void on_pushButton_configure_clicked();
 
+    void on_comboBox_format_currentIndexChanged(int index);
+
     void on_pushButton_preview_clicked();
 
     void on_pushButton_reset_clicked();
@@ -92,6 +92,8 @@ void GeoJsonWindow::on_pushButton_reset_clicked()
     ui->doubleSpinBox_endX->setValue(0);
     ui->doubleSpinBox_endY->setValue(0);
     parameters.reset();
+    ui->comboBox_format->setCurrentIndex(static_cast<int>(Util::OutputFormat::Png));
+    ui->comboBox_compression->setCurrentIndex(static_cast<int>(Util::Compression::Balanced));
     Util::changeSuccessState(ui->label_success, Util::SuccessStateColor::Red);
 }
 
@@ -99,10 +101,13 @@ void GeoJsonWindow::on_pushButton_reset_clicked()
 void GeoJsonWindow::on_pushButton_save_clicked()
 {
     if (!checkInput()) return;
+    const auto format = static_cast<Util::OutputFormat>(ui->comboBox_format->currentIndex());
+    const auto compression = static_cast<Util::Compression>(ui->comboBox_compression->currentIndex());
     auto savePath = Gui::GetSavePath();
     if (savePath.isEmpty()) return;
-    if (savePath.right(4) != ".png") savePath += ".png";
+    if (savePath.right(4) != Png::FileExtension(format)) savePath += Png::FileExtension(format);
     setParameters();
+    const auto start = std::chrono::steady_clock::now();
 
     displayProgressBar("Reading JSON...");
     auto io = ImageConverter();
@@ -110,8 +115,10 @@ void GeoJsonWindow::on_pushButton_save_clicked()
     connect(&io, &ImageConverter::sendProgressError, this, &GeoJsonWindow::receiveProgressError, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressReset, this, &GeoJsonWindow::receiveProgressReset, Qt::DirectConnection);
     auto img = io.CreateRGB_VectorShapes(parameters.value());
-    Png::SavePng(img, savePath);
+    auto saved = !img.is_empty() && Png::SaveImage(img, savePath, format, compression);
     hideProgressBar();
+    if (saved) Gui::PrintExportSummary({savePath}, start, Png::DescribeOutput(format, compression));
+    else if (!img.is_empty()) Gui::ThrowError("Error creating the image.");
 }
 
 void GeoJsonWindow::receiveProgressUpdate(uint32_t progress)
@@ -181,3 +188,8 @@ void GeoJsonWindow::previewImage()
     hideProgressBar();
 }
 
+void GeoJsonWindow::on_comboBox_format_currentIndexChanged(int index)
+{
+    // only PNG is compressed
+    ui->comboBox_compression->setEnabled(static_cast<Util::OutputFormat>(index) == Util::OutputFormat::Png);
+}
@@ -5,11 +5,22 @@
 #include "pngfunctions.h"
 #include "previewtask.h"
 #include "imageconverter.h"
+#include "consts.h"
 #include "luacodewindow.h"
 
 #include <QDir>
 #include <QThreadPool>
 
+namespace {
+// a line for the export summary, once a pure Lua script's cache was used
+QString LuaCacheDetails(const ImageConverter& io)
+{
+    auto [hits, misses] = io.GetLuaCacheHitsAndMisses();
+    if (hits+misses == 0) return {};
+    return "Lua cache: "+QString::number(hits)+" hits, "+QString::number(misses)+" misses.";
+}
+}
+
 GeotiffWindow::GeotiffWindow(QWidget *parent) :
     QWidget(parent),
     ui(new Ui::GeotiffWindow)
@@ -98,6 +109,7 @@ void GeotiffWindow::on_comboBox_outputMode_activated(int index)
         default: break; // unreachable
     }
     parameters.luaFunction.reset();
+    parameters.luaPure.reset();
 }
 
 
@@ -137,7 +149,9 @@ void GeotiffWindow::on_pushButton_outputModeConfigure_clicked()
         case Util::OutputMode::Grayscale16_Lua : case Util::OutputMode::RGB_Lua:
             {
                 luaCodeWindow = new LuaCodeWindow(index, parameters.luaFunction.value_or(""));
+                luaCodeWindow->setPure(parameters.luaPure.value_or(false));
                 connect(luaCodeWindow, &LuaCodeWindow::sendCode, this, &GeotiffWindow::receiveLuaScript);
+                connect(luaCodeWindow, &LuaCodeWindow::sendPure, this, &GeotiffWindow::receiveLuaPure);
                 connect(luaCodeWindow, SIGNAL(sendPreviewRequest(const std::string&)), this, SLOT(receivePreviewRequest(const std::string&)));
                 luaCodeWindow->show();
             }
@@ -155,6 +169,11 @@ void GeotiffWindow::on_comboBox_splitIntoTiles_activated(int index)
     else {
         ui->comboBox_scaleImage->setEnabled(false);
     }
+    // the zoom levels of a pyramid are its scales, the most detailed one has the resolution of the image
+    bool xyz = static_cast<Util::TileMode>(index) == Util::TileMode::XyzPyramid;
+    if (xyz) ui->comboBox_scaleImage->setCurrentIndex(0);
+    ui->spinBox_scale->setEnabled(!xyz);
+    ui->comboBox_scaleImage->setToolTip(xyz ? "XYZ tile pyramids are made at the resolution of the image, every zoom level halves the one below." : QString());
 }
 
 void GeotiffWindow::on_comboBox_scaleImage_activated(int index)
@@ -184,6 +203,7 @@ void GeotiffWindow::on_pushButton_reset_clicked()
     parameters.gradient.reset();
     parameters.offset.reset();
     parameters.luaFunction.reset();
+    parameters.luaPure.reset();
     ui->lineEdit_inputFile->clear();
     ui->pushButton_inputFile->setEnabled(true);
     ui->comboBox_outputMode->setCurrentIndex(0);
@@ -194,11 +214,17 @@ void GeotiffWindow::on_pushButton_reset_clicked()
     ui->lineEdit_cropEndY->setValue(0);
     ui->comboBox_splitIntoTiles->setCurrentIndex(0);
     ui->comboBox_splitIntoTiles->setEnabled(true);
+    ui->comboBox_format->setCurrentIndex(static_cast<int>(Util::OutputFormat::Png));
+    ui->comboBox_compression->setCurrentIndex(static_cast<int>(Util::Compression::Balanced));
     ui->lineEdit_tilesX->setValue(1);
     ui->lineEdit_tilesY->setValue(1);
     ui->comboBox_scaleImage->setCurrentIndex(0);
+    ui->comboBox_scaleImage->setEnabled(true);
+    ui->comboBox_scaleImage->setToolTip(QString());
     ui->comboBox_splitIntoTiles->setEnabled(true);
     ui->spinBox_scale->setValue(1);
+    ui->spinBox_scale->setEnabled(true);
+    ui->checkBox_commonMinAndMax->setChecked(false);
     ui->progressBar->setVisible(false);
 }
 
@@ -250,6 +276,16 @@ Util::TileMode GeotiffWindow::getTileModeSelected()
     return static_cast<Util::TileMode>(ui->comboBox_splitIntoTiles->currentIndex());
 }
 
+Util::OutputFormat GeotiffWindow::getFormatSelected()
+{
+    return static_cast<Util::OutputFormat>(ui->comboBox_format->currentIndex());
+}
+
+Util::Compression GeotiffWindow::getCompressionSelected()
+{
+    return static_cast<Util::Compression>(ui->comboBox_compression->currentIndex());
+}
+
 Util::OutputMode GeotiffWindow::getOutputModeSelected()
 {
     return outputModes[ui->comboBox_outputMode->currentIndex()];
@@ -296,6 +332,11 @@ void GeotiffWindow::receiveLuaScript(const std::string &code)
     Util::changeSuccessState(ui->label_outputModeSuccess, Util::SuccessStateColor::Green);
 }
 
+void GeotiffWindow::receiveLuaPure(bool pure)
+{
+    parameters.luaPure = pure;
+}
+
 bool GeotiffWindow::checkInput()
 {
     try {
@@ -372,29 +413,45 @@ void GeotiffWindow::previewImage() {
     connect(&io, &ImageConverter::sendProgress, this, &GeotiffWindow::receiveProgressUpdate, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressError, this, &GeotiffWindow::receiveProgressError, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressReset, this, &GeotiffWindow::receiveProgressReset, Qt::DirectConnection);
+    // previewing the same window again, or a part of it, doesn't decode it again
+    io.setTileCache(&Tiff::TileCache::session());
 
     if (params.scaleMode != Util::ScaleMode::No || params.outputMode == Util::OutputMode::Grayscale16_Lua || params.outputMode == Util::OutputMode::RGB_Lua) {
+        auto rgbTable = io.CreateTable_RGB(params);
+        auto g16Table = io.CreateTable_G16(params);
+        // the first scaled preview of a large file builds its pyramid in the background; this preview reads the file,
+        // later previews and exports read the pyramid once it's done
+        auto windowPixels = (std::uint64_t)widthAndHeight.first*widthAndHeight.second;
+        if (params.scaleMode == Util::ScaleMode::Decrease && params.scale > 1 && (!pyramidBuilder || pyramidBuilder->path() != params.inputPath) &&
+            Pyramid::ShouldBuild(params.inputPath, windowPixels)) {
+            pyramidBuilder = std::make_unique<Pyramid::Builder>(params.inputPath);
+        }
         displayProgressBar("Reading raw image values...");
-        auto rawValues = io.GetRawImageValues(params.inputPath, params.startX, params.endX, params.startY, params.endY);
+        std::uint16_t directory;
+        auto source = io.GetRawValueSource(params, directory);
+        auto rawValues = io.GetRawImageValues(source, params.startX, params.endX, params.startY, params.endY, directory);
         displayProgressBar("Creating the image...");
         if (params.outputMode == Util::OutputMode::RGB_UserValues ||
             params.outputMode == Util::OutputMode::RGB_UserRanges ||
             params.outputMode == Util::OutputMode::RGB_Formula ||
             params.outputMode == Util::OutputMode::RGB_Lua) {
-            auto buf = io.CreateImageData_RGB(rawValues.get(), params, widthAndHeight);
-            auto img = Png::CreatePngData(buf.get(), widthAndHeight, Util::PixelSize::ThirtyTwoBit);
+            auto buf = io.CreateImageData_RGB(rawValues.get(), params, widthAndHeight, rgbTable ? &*rgbTable : nullptr);
+            auto img = Png::CreatePngData(buf);
             auto task = new PreviewTask<uint8_t>(img);
             QThreadPool::globalInstance()->start(task);
         }
 
         else {
+            // the same range as the export's, which leaves out cells without data
             if (params.outputMode == Util::OutputMode::Grayscale16_MinToMax) {
-                params.minAndMax = std::pair<double,double>{};
-                params.minAndMax.value().first = *std::min_element(rawValues.get(), rawValues.get()+(widthAndHeight.first*widthAndHeight.second));
-                params.minAndMax.value().second = *std::max_element(rawValues.get(), rawValues.get()+(widthAndHeight.first*widthAndHeight.second));
+                displayProgressBar("Finding min and max values...");
+                Stats::RasterStats stats;
+                if (!io.GetStatistics(source, stats, params.startX, params.endX, params.startY, params.endY, directory)) return;
+                params.minAndMax = std::pair<double,double>{stats.min, stats.max};
+                displayProgressBar("Creating the image...");
             }
-            auto buf = io.CreateImageData_G16(rawValues.get(), params, widthAndHeight);
-            auto img = Png::CreatePngData(buf.get(), widthAndHeight, Util::PixelSize::SixteenBit);
+            auto buf = io.CreateImageData_G16(rawValues.get(), params, widthAndHeight, g16Table ? &*g16Table : nullptr);
+            auto img = Png::CreatePngData(buf);
             auto task = new PreviewTask<uint16_t>(img);
             QThreadPool::globalInstance()->start(task);
         }
@@ -418,7 +475,7 @@ void GeotiffWindow::previewImage() {
                 if (!ok) return;
                 displayProgressBar("Creating the image...");
                 auto buf = io.CreateG16_MinToMax(params.inputPath, params.minAndMax.value(), startX, startY, endX, endY);
-                auto img = Png::CreatePngData(buf.get(), widthAndHeight, Util::PixelSize::SixteenBit);
+                auto img = Png::CreatePngData(buf);
                 auto task = new PreviewTask<uint16_t>(img);
                 QThreadPool::globalInstance()->start(task);
             }
@@ -426,7 +483,7 @@ void GeotiffWindow::previewImage() {
         case Util::OutputMode::Grayscale16_TrueValue:
             {
                 auto buf = io.CreateG16_TrueValue(params.inputPath, params.offset.value(), startX, startY, endX, endY);
-                auto img = Png::CreatePngData(buf.get(), widthAndHeight, Util::PixelSize::SixteenBit);
+                auto img = Png::CreatePngData(buf);
                 auto task = new PreviewTask<uint16_t>(img);
                 QThreadPool::globalInstance()->start(task);
             }
@@ -434,7 +491,7 @@ void GeotiffWindow::previewImage() {
         case Util::OutputMode::RGB_UserValues:
             {
                 auto buf = io.CreateRGB_UserValues(params.inputPath, params.colorValues.value(), startX, startY, endX, endY);
-                auto img = Png::CreatePngData(buf.get(), widthAndHeight, Util::PixelSize::ThirtyTwoBit);
+                auto img = Png::CreatePngData(buf);
                 auto task = new PreviewTask<uint8_t>(img);
                 QThreadPool::globalInstance()->start(task);
             }
@@ -442,7 +499,7 @@ void GeotiffWindow::previewImage() {
         case Util::OutputMode::RGB_UserRanges:
             {
                 auto buf = io.CreateRGB_UserRanges(params.inputPath, params.colorValues.value(), params.gradient.value(), startX, startY, endX, endY);
-                auto img = Png::CreatePngData(buf.get(), widthAndHeight, Util::PixelSize::ThirtyTwoBit);
+                auto img = Png::CreatePngData(buf);
                 auto task = new PreviewTask<uint8_t>(img);
                 QThreadPool::globalInstance()->start(task);
             }
@@ -450,7 +507,7 @@ void GeotiffWindow::previewImage() {
         case Util::OutputMode::RGB_Formula:
             {
                 auto buf = io.CreateRGB_Formula(params.inputPath, startX, startY, endX, endY);
-                auto img = Png::CreatePngData(buf.get(), widthAndHeight, Util::PixelSize::ThirtyTwoBit);
+                auto img = Png::CreatePngData(buf);
                 auto task = new PreviewTask<uint8_t>(img);
                 QThreadPool::globalInstance()->start(task);
             }
@@ -464,11 +521,22 @@ void GeotiffWindow::previewImage() {
 void GeotiffWindow::exportImage() {
     if (!checkInput()) return;
     setParameters();
+    const auto format = getFormatSelected();
+    const auto compression = getCompressionSelected();
+    const bool rgb = parameters.outputMode == Util::OutputMode::RGB_UserValues ||
+                     parameters.outputMode == Util::OutputMode::RGB_UserRanges ||
+                     parameters.outputMode == Util::OutputMode::RGB_Formula ||
+                     parameters.outputMode == Util::OutputMode::RGB_Lua;
+    if (!Png::CanHold(format, rgb ? Util::PixelSize::ThirtyTwoBit : Util::PixelSize::SixteenBit)) {
+        Gui::ThrowError(rgb ? "PGM images can only hold 16-bit grayscale." : "QOI images can only hold RGBA.");
+        return;
+    }
 
     auto path = Gui::GetSavePath();
     if (path.isEmpty()) return;
     auto outputPath = QFileInfo(path).absolutePath()+QDir::separator()+QFileInfo(path).completeBaseName();
-    if (path.right(4) != ".png") path.append(".png");
+    if (path.right(4) != Png::FileExtension(format)) path.append(Png::FileExtension(format));
+    const auto start = std::chrono::steady_clock::now();
 
     auto io = ImageConverter();
     connect(&io, &ImageConverter::sendProgress, this, &GeotiffWindow::receiveProgressUpdate, Qt::DirectConnection);
@@ -482,41 +550,53 @@ void GeotiffWindow::exportImage() {
     auto absoluteWidthAndHeight = std::pair<unsigned int, unsigned int>(absoluteEndX-absoluteStartX+1, absoluteEndY-absoluteStartY+1);
     auto params = parameters;
 
-    if (params.scaleMode != Util::ScaleMode::No || params.outputMode == Util::OutputMode::Grayscale16_Lua || params.outputMode == Util::OutputMode::RGB_Lua) {
-        displayProgressBar("Reading raw image values...");
-        auto rawValues = io.GetRawImageValues(params.inputPath, params.startX, params.endX, params.startY, params.endY);
-        displayProgressBar("Creating the image...");
-        if (params.outputMode == Util::OutputMode::RGB_UserValues ||
-            params.outputMode == Util::OutputMode::RGB_UserRanges ||
-            params.outputMode == Util::OutputMode::RGB_Formula ||
-            params.outputMode == Util::OutputMode::RGB_Lua) {
-            auto buf = io.CreateImageData_RGB(rawValues.get(), params, absoluteWidthAndHeight);
-            auto img = Png::CreatePngData(buf.get(), absoluteWidthAndHeight, Util::PixelSize::ThirtyTwoBit);
-            displayProgressBar("Compressing to PNG...");
-            Png::SavePng(img, path);
-        }
+    // the tiles of every zoom level go to a directory named after the chosen file
+    if (getTileModeSelected() == Util::TileMode::XyzPyramid) {
+        displayProgressBar("Creating the tiles...");
+        size_t tileCount = 0;
+        std::uint64_t byteCount = 0;
+        auto saved = io.SaveXyzPyramid(params, outputPath, format, compression, tileCount, byteCount);
+        hideProgressBar();
+        if (saved) Gui::PrintExportSummary(QString::number(tileCount)+" tiles", byteCount, start, Png::DescribeOutput(format, compression), LuaCacheDetails(io));
+        return;
+    }
 
-        else {
-            if (params.outputMode == Util::OutputMode::Grayscale16_MinToMax) {
-                params.minAndMax = std::pair<double,double>{};
-                params.minAndMax.value().first = *std::min_element(rawValues.get(), rawValues.get()+(absoluteWidthAndHeight.first*absoluteWidthAndHeight.second));
-                params.minAndMax.value().second = *std::max_element(rawValues.get(), rawValues.get()+(absoluteWidthAndHeight.first*absoluteWidthAndHeight.second));
-            }
-            auto buf = io.CreateImageData_G16(rawValues.get(), params, absoluteWidthAndHeight);
-            auto img = Png::CreatePngData(buf.get(), absoluteWidthAndHeight, Util::PixelSize::SixteenBit);
-            displayProgressBar("Compressing to PNG...");
-            Png::SavePng(img, path);
-        }
+    // a single image is written band by band as it's converted, tiles are small enough to be made whole
+    if (params.scaleMode != Util::ScaleMode::No || params.outputMode == Util::OutputMode::Grayscale16_Lua || params.outputMode == Util::OutputMode::RGB_Lua ||
+        getTileModeSelected() == Util::TileMode::No) {
+        displayProgressBar("Creating the image...");
+        auto saved = io.SaveImageStreamed(params, path, format, compression);
         hideProgressBar();
+        if (saved) Gui::PrintExportSummary({path}, start, Png::DescribeOutput(format, compression), LuaCacheDetails(io));
         return;
     }
 
     int tileSize_x = absoluteWidthAndHeight.first, tileSize_y = absoluteWidthAndHeight.second;
     getTileSize(tileSize_x, tileSize_y, absoluteWidthAndHeight);
 
+    // finding min and max reads a tile's window once more right before it's converted, this keeps the second read off the disk
+    Tiff::TileCache tileCache(TileCacheSize::exportBytes);
+    if (params.outputMode == Util::OutputMode::Grayscale16_MinToMax && !ui->checkBox_commonMinAndMax->isChecked()) io.setTileCache(&tileCache);
+
+    std::optional<std::pair<double,double>> commonMinAndMax;
+    if (params.outputMode == Util::OutputMode::Grayscale16_MinToMax && ui->checkBox_commonMinAndMax->isChecked()) {
+        commonMinAndMax = std::pair<double,double>{};
+        displayProgressBar("Finding min and max values...");
+        auto ok = io.GetMinAndMaxValues(parameters.inputPath, commonMinAndMax.value().first, commonMinAndMax.value().second, absoluteStartX, absoluteEndX, absoluteStartY, absoluteEndY);
+        if (!ok) return;
+    }
+
+    // a tile that failed is reported and left out of the summary
+    QStringList saved;
+    auto save = [&](const auto& buf) {
+        if (!buf) return;
+        if (Png::SaveImage(buf, path, format, compression)) saved.push_back(path);
+        else Gui::ThrowError("Error creating the image.");
+    };
+
     for (auto startX = absoluteStartX; startX < absoluteEndX; startX+=tileSize_x) {
         for (auto startY = absoluteStartY; startY < absoluteEndY; startY+=tileSize_y) {
-            if (getTileModeSelected() != Util::TileMode::No) path = outputPath+"_"+QString::number((startX-absoluteStartX)/tileSize_x)+"_"+QString::number((startY-absoluteStartY)/tileSize_y)+".png";
+            if (getTileModeSelected() != Util::TileMode::No) path = outputPath+"_"+QString::number((startX-absoluteStartX)/tileSize_x)+"_"+QString::number((startY-absoluteStartY)/tileSize_y)+Png::FileExtension(format);
             displayProgressBar("Creating " + QFileInfo(path).fileName() + "...");
             auto endX = std::min((unsigned int)startX+tileSize_x-1,absoluteEndX);
             auto endY = std::min((unsigned int)startY+tileSize_y-1,absoluteEndY);
@@ -525,47 +605,45 @@ void GeotiffWindow::exportImage() {
             switch (params.outputMode) {
                 case Util::OutputMode::Grayscale16_MinToMax:
                     {
-                        parameters.minAndMax = std::pair<double,double>{};
-                        displayProgressBar("Finding min and max values...");
-                        auto ok = io.GetMinAndMaxValues(parameters.inputPath, parameters.minAndMax.value().first, parameters.minAndMax.value().second, startX, endX, startY, endY);
-                        if (!ok) return;
+                        if (commonMinAndMax.has_value()) parameters.minAndMax = commonMinAndMax;
+                        else {
+                            parameters.minAndMax = std::pair<double,double>{};
+                            displayProgressBar("Finding min and max values...");
+                            auto ok = io.GetMinAndMaxValues(parameters.inputPath, parameters.minAndMax.value().first, parameters.minAndMax.value().second, startX, endX, startY, endY);
+                            if (!ok) return;
+                        }
                         displayProgressBar("Creating " + QFileInfo(path).fileName() + "...");
                         auto buf = io.CreateG16_MinToMax(parameters.inputPath, parameters.minAndMax.value(), startX, startY, endX, endY);
-                        auto img = Png::CreatePngData(buf.get(), tileWidthAndHeight, Util::PixelSize::SixteenBit);
-                        displayProgressBar("Compressing to PNG...");
-                        Png::SavePng(img, path);
+                        displayProgressBar("Writing " + QFileInfo(path).fileName() + "...");
+                        save(buf);
                     }
                     break;
                 case Util::OutputMode::Grayscale16_TrueValue:
                     {
                         auto buf = io.CreateG16_TrueValue(parameters.inputPath, parameters.offset.value(), startX, startY, endX, endY);
-                        auto img = Png::CreatePngData(buf.get(), tileWidthAndHeight, Util::PixelSize::SixteenBit);
-                        displayProgressBar("Compressing to PNG...");
-                        Png::SavePng(img, path);
+                        displayProgressBar("Writing " + QFileInfo(path).fileName() + "...");
+                        save(buf);
                     }
                     break;
                 case Util::OutputMode::RGB_UserValues:
                     {
                         auto buf = io.CreateRGB_UserValues(parameters.inputPath, parameters.colorValues.value(), startX, startY, endX, endY);
-                        auto img = Png::CreatePngData(buf.get(), tileWidthAndHeight, Util::PixelSize::ThirtyTwoBit);
-                        displayProgressBar("Compressing to PNG...");
-                        Png::SavePng(img, path);
+                        displayProgressBar("Writing " + QFileInfo(path).fileName() + "...");
+                        save(buf);
                     }
                 break;
                 case Util::OutputMode::RGB_UserRanges:
                     {
                         auto buf = io.CreateRGB_UserRanges(parameters.inputPath, parameters.colorValues.value(), parameters.gradient.value(), startX, startY, endX, endY);
-                        auto img = Png::CreatePngData(buf.get(), tileWidthAndHeight, Util::PixelSize::ThirtyTwoBit);
-                        displayProgressBar("Compressing to PNG...");
-                        Png::SavePng(img, path);
+                        displayProgressBar("Writing " + QFileInfo(path).fileName() + "...");
+                        save(buf);
                     }
                     break;
                 case Util::OutputMode::RGB_Formula:
                     {
                         auto buf = io.CreateRGB_Formula(parameters.inputPath, startX, startY, endX, endY);
-                        auto img = Png::CreatePngData(buf.get(), tileWidthAndHeight, Util::PixelSize::ThirtyTwoBit);
-                        displayProgressBar("Compressing to PNG...");
-                        Png::SavePng(img, path);
+                        displayProgressBar("Writing " + QFileInfo(path).fileName() + "...");
+                        save(buf);
                     }
                     break;
                 default:
@@ -574,7 +652,11 @@ void GeotiffWindow::exportImage() {
             hideProgressBar();
         }
     }
-
+    if (!saved.isEmpty()) Gui::PrintExportSummary(saved, start, Png::DescribeOutput(format, compression));
 }
 
-
+void GeotiffWindow::on_comboBox_format_currentIndexChanged(int index)
+{
+    // only PNG is compressed
+    ui->comboBox_compression->setEnabled(static_cast<Util::OutputFormat>(index) == Util::OutputFormat::Png);
+}
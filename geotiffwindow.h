@@ -7,6 +7,8 @@
 #include "configurergbform.h"
 #include "conversionparameters.h"
 #include "luacodewindow.h"
+#include "pyramidfunctions.h"
+#include <memory>
 
 namespace Ui {
 class GeotiffWindow;
@@ -38,6 +40,8 @@ private slots:
 
     void on_comboBox_scaleImage_activated(int index);
 
+    void on_comboBox_format_currentIndexChanged(int index);
+
 public slots:
     void receiveColorValues(const std::map<double,color>& colors);
     void receiveGradient(bool yes);
@@ -48,6 +52,7 @@ public slots:
     void receiveProgressError();
     void receiveProgressReset(QString desc);
     void receiveLuaScript(const std::string& code);
+    void receiveLuaPure(bool pure);
 
 private:
     Ui::GeotiffWindow *ui;
@@ -55,6 +60,8 @@ private:
     LuaCodeWindow* luaCodeWindow;
     TiffConvertParams parameters;
     std::vector<Util::OutputMode> outputModes;
+    // the pyramid build started by the last scaled preview, cancelled when the window closes
+    std::unique_ptr<Pyramid::Builder> pyramidBuilder;
 
     bool checkInput();
     void setParameters();
@@ -66,6 +73,8 @@ private:
     void getTileSize(int& tileSizeX, int& tileSizeY, std::pair<int,int> widthAndHeight);
 
     Util::TileMode getTileModeSelected();
+    Util::OutputFormat getFormatSelected();
+    Util::Compression getCompressionSelected();
     Util::OutputMode getOutputModeSelected();
     Util::ScaleMode getScaleModeSelected();
 };
@@ -0,0 +1,50 @@
+#ifndef IMAGEBUFFER_H
+#define IMAGEBUFFER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+namespace Png {
+// an image laid out the way png stores it: the channels of a pixel side by side, rows one after another from the top.
+// a pixel is written with a single store, and rows can be handed to libpng as they are
+template <typename T, unsigned int Channels>
+class ImageBuffer {
+public:
+    using Sample_t = T;
+    using Pixel_t = std::array<T,Channels>;
+    static constexpr unsigned int channels = Channels;
+
+    ImageBuffer() = default;
+    // zeroed, which is transparent black for rgba, when the converter doesn't write every pixel
+    ImageBuffer(std::uint32_t width, std::uint32_t height, bool zeroed = false) :
+        w(width), h(height), samples(zeroed ? new T[(size_t)width*height*Channels]() : new T[(size_t)width*height*Channels]) {}
+
+    explicit operator bool() const { return samples != nullptr; }
+    std::uint32_t width() const { return w; }
+    std::uint32_t height() const { return h; }
+    size_t rowSize() const { return (size_t)w*Channels; }
+
+    T* data() { return samples.get(); }
+    const T* data() const { return samples.get(); }
+    T* row(std::uint32_t y) { return samples.get()+y*rowSize(); }
+    const T* row(std::uint32_t y) const { return samples.get()+y*rowSize(); }
+
+    // index counts pixels from the top left corner, row by row
+    void setPixel(size_t index, const Pixel_t& value) { std::memcpy(samples.get()+index*Channels, value.data(), sizeof(Pixel_t)); }
+    void setPixels(size_t index, const Pixel_t* values, size_t count) { std::memcpy(samples.get()+index*Channels, values, count*sizeof(Pixel_t)); }
+
+private:
+    static_assert(sizeof(Pixel_t) == Channels*sizeof(T), "pixels have to be packed");
+
+    std::uint32_t w = 0, h = 0;
+    std::unique_ptr<T[]> samples;
+};
+
+using Rgba8 = ImageBuffer<std::uint8_t,4>;
+using Gray16 = ImageBuffer<std::uint16_t,1>;
+}
+
+#endif // IMAGEBUFFER_H
@@ -1,24 +1,78 @@
 ﻿#include "imageconverter.h"
 
 #include "consts.h"
+#include "luafunctions.h"
 #include "pngfunctions.h"
 #include "qjsonarray.h"
 #include "qjsondocument.h"
 #include "qjsonobject.h"
+#include "pyramidfunctions.h"
 #include "qtfunctions.h"
+#include "simdkernels.h"
+#include "statsfunctions.h"
+#include "xyzpyramid.h"
 #include "tifffunctions.h"
+#include "colorlookup.h"
 #include "commonfunctions.h"
 #include <limits.h>
 
 #include <QFile>
 #include <QJsonObject>
+#include <QSignalBlocker>
 #include <QThreadPool>
 #include <bitset>
+#include <numeric>
+#include <unordered_set>
 #include <rapidcsv.h>
 
 #include <sqlite3/sqlite_modern_cpp.h>
 #include <sol/sol.hpp>
 
+namespace {
+// an integer raster of up to 16 bits holds few enough distinct values to convert every one of them up front,
+// which pays off once the window has more pixels than that
+template <typename V>
+std::optional<Lookup::DenseTable<V>> CreateDenseTable(const QString& path, size_t numberOfPixels)
+{
+    Tiff::TiffProperties properties;
+    if (!Tiff::GetProperties(path, properties)) return {};
+    if (properties.sampleFormat != SAMPLEFORMAT_UINT && properties.sampleFormat != SAMPLEFORMAT_INT) return {};
+    if (properties.bitsPerSample != 8 && properties.bitsPerSample != 16) return {};
+    if (numberOfPixels < ((size_t)1 << properties.bitsPerSample)) return {};
+    return Lookup::DenseTable<V>(properties.sampleFormat == SAMPLEFORMAT_INT, properties.bitsPerSample);
+}
+
+// the rows libtiff decodes at once; an uncompressed file is read straight from its mapping, a row at a time
+std::uint32_t GetDecodedRows(const QString& path, const Tiff::TiffProperties& properties, std::uint16_t directory)
+{
+    Tiff::MappedLayout layout;
+    if (Tiff::ReadMappedLayout(path, properties, layout, directory)) return 1;
+    return properties.tiled ? properties.tileHeight : properties.rowsPerStrip;
+}
+
+// the rows of the bands a streamed export reads, the first band and the ones after it
+struct BandRows {
+    std::uint32_t first, rest;
+};
+
+// bands are made of whole strips or tiles (step rows), so that none of them is decoded twice, and of whole output rows
+// (scale rows from startY) when decreasing. a strip larger than the wanted band is read in a single band.
+// the first band ends on the first row that ends both a strip and an output row; a window without such a row gets
+// bands of whole output rows, and the strip each band boundary cuts through is decoded for both of its bands
+BandRows GetBandRows(std::uint32_t startY, std::uint32_t wantedRows, std::uint32_t step, std::uint32_t scale)
+{
+    const std::uint32_t unit = std::lcm(step, scale);
+    const std::uint32_t rows = std::max(wantedRows/unit, 1u)*unit;
+    for (std::uint32_t end = startY+scale; end <= startY+unit; end += scale) {
+        if (end % step != 0) continue;
+        auto first = end-startY;
+        return {first+(rows-first)/unit*unit, rows};
+    }
+    std::uint32_t rest = (std::max(wantedRows, step)+scale-1)/scale*scale;
+    return {rest, rest};
+}
+}
+
 
 std::vector<std::vector<std::string> > ImageConverter::getRows(const std::string& path)
 {
@@ -219,49 +273,12 @@ int ImageConverter::getStyleForCsvShape(const std::vector<std::string> &csvRow,
 
 uint16_t ImageConverter::transformCellToG16TrueValue(double cell, double offset)
 {
-    uint16_t value;
-    if (cell+offset < 0) value = 0;
-    else if (cell+offset > std::numeric_limits<uint16_t>::max()) value = std::numeric_limits<uint16_t>::max();
-    else value = (uint16_t)(cell+offset);
-    return value;
+    return Simd::G16Transform::TrueValue(offset).apply(cell);
 }
 
 uint16_t ImageConverter::transformCellToG16MinToMax(double cell, const std::pair<double, double>& minAndMax)
 {
-    auto remapped = Util::Remap(cell, minAndMax.first, minAndMax.second, 0, std::numeric_limits<uint16_t>::max());
-    uint16_t value = round(remapped);
-    return value;
-}
-
-uint16_t ImageConverter::transformCellToG16Lua(double cell, const std::string& script)
-{
-    sol::state lua;
-    lua.open_libraries(sol::lib::base, sol::lib::table);
-    lua.script(script);
-    //lua["params"] = lua.create_table_with("val", cell);
-    auto map = std::map<std::string, double> { {"val", cell } };
-    //auto params = lua.create_table_with("val", cell);
-    auto params = sol::as_table_t<std::map<std::string, double>>(map);
-    sol::function func = lua["color"];
-    auto result = func(params);
-    sol::table color = result;
-    uint16_t rv = color.get_or("value", 0);
-    return rv;
-}
-
-color ImageConverter::transformCellToRGBLua(double cell, const std::string &script)
-{
-    color rv = {0,0,0,0};
-    sol::state lua;
-    lua.open_libraries(sol::lib::base);
-    auto result = lua.script(script + "\nparams = {}\nparams[\"val\"] = " + std::to_string(cell) + ";\ncolor(params");
-    if (!result.valid()) return rv;
-    sol::table table = result;
-    rv[0] = table["r"];
-    rv[1] = table["g"];
-    rv[2] = table["b"];
-    rv[3] = table["a"];
-    return rv;
+    return Simd::G16Transform::MinToMax(minAndMax.first, minAndMax.second).apply(cell);
 }
 
 void ImageConverter::writeJsonValueToLuaParams(const QJsonValue &jsonValue, const QString& name, sol::table &luaTable)
@@ -333,32 +350,9 @@ void ImageConverter::writeJsonObjectToLuaParams(const QJsonObject &jsonObj, sol:
 
 color ImageConverter::transformCellToRGBUserValues(double cell, const std::map<double, color> &colorValues)
 {
-    return colorValues.at(cell);
-}
-
-color ImageConverter::transformCellToRGBUserRanges(double cell, const std::map<double, color> &colorValues, bool useGradient)
-{
-    color ar = {0,0,0,0};
-    for (auto it = colorValues.begin(); it != colorValues.end();) {
-
-        if (cell > it->first) {
-            ++it;
-            continue;
-        }
-        if (!useGradient || cell == it->first) ar = it->second;
-        else {
-            auto previousIt = it;
-            --previousIt;
-            double from1 = previousIt->first, to1 = it->first;
-            color from2 = previousIt->second, to2 = it->second;
-            ar[0] = Util::Remap(cell, from1, to1, from2[0], to2[0]);
-            ar[1] = Util::Remap(cell, from1, to1, from2[1], to2[1]);
-            ar[2] = Util::Remap(cell, from1, to1, from2[2], to2[2]);
-            ar[3] = Util::Remap(cell, from1, to1, from2[3], to2[3]);
-        }
-        break;
-    }
-    return ar;
+    auto it = colorValues.find(cell);
+    if (it == colorValues.end()) return {0,0,0,0};
+    return it->second;
 }
 
 color ImageConverter::transformCellToRGBFormula(double cell)
@@ -379,7 +373,81 @@ color ImageConverter::transformCellToRGBFormula(double cell)
     return ar;
 }
 
-std::unique_ptr<uint16_t[]> ImageConverter::CreateImageData_G16(double* rawValues, const TiffConvertParams &params, std::pair<unsigned int,unsigned int>& outWidthAndHeight)
+color ImageConverter::transformCellToRGB(double cell, const TiffConvertParams& params, const std::optional<Lookup::RangeTable>& ranges, Lua::Converter* lua)
+{
+    switch(params.outputMode) {
+        case Util::OutputMode::RGB_UserValues:
+            return transformCellToRGBUserValues(cell, params.colorValues.value());
+        case Util::OutputMode::RGB_UserRanges:
+            return (*ranges)(cell);
+        case Util::OutputMode::RGB_Formula:
+            return transformCellToRGBFormula(cell);
+        case Util::OutputMode::RGB_Lua:
+            return lua->toRGB(cell);
+        default:
+            throw std::invalid_argument("unreachable code");
+    }
+}
+
+std::optional<Lookup::DenseTable<color>> ImageConverter::CreateTable_RGB(const TiffConvertParams& params)
+{
+    bool rgb = params.outputMode == Util::OutputMode::RGB_UserValues ||
+               params.outputMode == Util::OutputMode::RGB_UserRanges ||
+               params.outputMode == Util::OutputMode::RGB_Formula ||
+               params.outputMode == Util::OutputMode::RGB_Lua;
+    if (!rgb || params.scaleMode == Util::ScaleMode::Decrease) return {};
+    auto table = CreateDenseTable<color>(params.inputPath, (size_t)(params.endX-params.startX+1)*(params.endY-params.startY+1));
+    if (!table) return {};
+
+    std::optional<Lookup::RangeTable> ranges;
+    if (params.outputMode == Util::OutputMode::RGB_UserRanges) ranges.emplace(params.colorValues.value(), params.gradient.value());
+
+    auto threadCount = std::thread::hardware_concurrency();
+    std::vector<std::thread> threads; threads.reserve(threadCount);
+    for (auto t = 0; t < threadCount; ++t) {
+        threads.emplace_back([t, threadCount, &table, &params, &ranges]() {
+            std::optional<Lua::Converter> lua;
+            if (params.outputMode == Util::OutputMode::RGB_Lua) lua.emplace(params.luaFunction.value());
+            size_t threadBegin = (float)t/threadCount*table->size();
+            size_t threadEnd = (float)(t+1)/threadCount*table->size();
+            if (lua && lua->isBatched()) {
+                table->fillRows(threadBegin, threadEnd, [&lua](const double* cells, size_t count, color* output) {
+                    lua->toRGB(cells, count, output);
+                });
+            }
+            else table->fill(threadBegin, threadEnd, [&params, &ranges, &lua](double cell) {
+                return transformCellToRGB(cell, params, ranges, lua ? &*lua : nullptr);
+            });
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    return table;
+}
+
+std::optional<Lookup::DenseTable<uint16_t>> ImageConverter::CreateTable_G16(const TiffConvertParams& params)
+{
+    // the linear modes are converted by the vectorised kernels, which are as fast as a lookup
+    if (params.outputMode != Util::OutputMode::Grayscale16_Lua || params.scaleMode == Util::ScaleMode::Decrease) return {};
+    auto table = CreateDenseTable<uint16_t>(params.inputPath, (size_t)(params.endX-params.startX+1)*(params.endY-params.startY+1));
+    if (!table) return {};
+
+    auto threadCount = std::thread::hardware_concurrency();
+    std::vector<std::thread> threads; threads.reserve(threadCount);
+    for (auto t = 0; t < threadCount; ++t) {
+        threads.emplace_back([t, threadCount, &table, &params]() {
+            Lua::Converter lua(params.luaFunction.value());
+            size_t threadBegin = (float)t/threadCount*table->size();
+            size_t threadEnd = (float)(t+1)/threadCount*table->size();
+            table->fillRows(threadBegin, threadEnd, [&lua](const double* cells, size_t count, std::uint16_t* output) {
+                lua.toG16(cells, count, output);
+            });
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    return table;
+}
+
+Png::Gray16 ImageConverter::CreateImageData_G16(double* rawValues, const TiffConvertParams &params, std::pair<unsigned int,unsigned int>& outWidthAndHeight, const Lookup::DenseTable<uint16_t>* table)
 {
     if (rawValues == nullptr) return {};
 
@@ -401,63 +469,74 @@ std::unique_ptr<uint16_t[]> ImageConverter::CreateImageData_G16(double* rawValue
             break;
     }
 
-    auto buf = std::unique_ptr<unsigned short[]>(new unsigned short[width*height]);
+    auto buf = Png::Gray16(width, height);
+
+    // the linear modes are converted a row at a time by the vectorised kernels
+    std::optional<Simd::G16Transform> transform;
+    switch(params.outputMode) {
+        case Util::OutputMode::Grayscale16_MinToMax:
+            transform = Simd::G16Transform::MinToMax(params.minAndMax.value().first, params.minAndMax.value().second);
+            break;
+        case Util::OutputMode::Grayscale16_TrueValue:
+            transform = Simd::G16Transform::TrueValue(params.offset.value());
+            break;
+        case Util::OutputMode::Grayscale16_Lua:
+            break;
+        default:
+            throw std::invalid_argument("unreachable code");
+    }
+
+    const bool memoize = !transform && params.luaPure.value_or(false);
+    std::atomic<size_t> memoHits = 0, memoMisses = 0;
 
     auto threadCount = std::thread::hardware_concurrency();
     std::vector<std::thread> threads; threads.reserve(threadCount);
     for (auto t = 0; t < threadCount; ++t) {
-        threads.emplace_back([t, threadCount, width, height, rawWidth, rawHeight, &rawValues, &buf, &params, this]() {
+        threads.emplace_back([t, threadCount, width, height, rawWidth, rawHeight, &rawValues, &buf, &params, &transform, table, memoize, &memoHits, &memoMisses, this]() {
             // lua
-            sol::state lua;
-            if (params.outputMode == Util::OutputMode::Grayscale16_Lua) {
-                lua.open_libraries(sol::lib::base, sol::lib::table, sol::lib::math);
-                lua.create_named_table("params");
-                lua.create_named_table("color");
-                lua.script(params.luaFunction.value());
-            }
+            std::optional<Lua::Converter> lua;
+            if (!transform) lua.emplace(params.luaFunction.value());
+            std::optional<Lua::Memo<std::uint16_t>> memo;
+            if (memoize && !lua->isBatched()) memo.emplace();
+            auto convert = [&lua, &transform, table, &memo](const double* cells, size_t count, std::uint16_t* output) {
+                if (transform) {
+                    Simd::ToG16(cells, count, output, *transform);
+                    return;
+                }
+                // a batched script gets the whole row, unless the table already has most of it
+                if (lua->isBatched() && !table) {
+                    lua->toG16(cells, count, output);
+                    return;
+                }
+                for (size_t i = 0; i < count; ++i) {
+                    if (table && table->contains(cells[i])) output[i] = (*table)[(std::int32_t)cells[i]];
+                    else if (memo) output[i] = memo->get(cells[i], [&lua](double cell) { return lua->toG16(cell); });
+                    else output[i] = lua->toG16(cells[i]);
+                }
+            };
             //
-            double cell;
-            std::uint16_t value;
             size_t threadBegin, threadEnd;
             switch(params.scaleMode) {
                 case Util::ScaleMode::No:
-                    threadBegin = (float)t/threadCount*width*height;
-                    threadEnd = (float)(t+1)/threadCount*width*height;
-                    for (size_t i = threadBegin; i < threadEnd; ++i) {
-                        cell = rawValues[i];
-                        switch(params.outputMode) {
-                            case Util::OutputMode::Grayscale16_MinToMax:
-                                buf[i] = transformCellToG16MinToMax(cell, params.minAndMax.value());
-                                break;
-                            case Util::OutputMode::Grayscale16_TrueValue:
-                                buf[i] = transformCellToG16TrueValue(cell, params.offset.value());
-                                break;
-                            case Util::OutputMode::Grayscale16_Lua:
-                            {
-                                lua["params"]["val"] = cell;
-                                lua["color"]["value"] = 0;
-                                lua["set_color"]();
-                                double pixelValue = lua["color"]["value"];
-                                buf[i] = pixelValue;
-                            }
-                            break;
-                            default:
-                                throw std::invalid_argument("unreachable code");
-                        }
+                    threadBegin = (float)t/threadCount*height;
+                    threadEnd = (float)(t+1)/threadCount*height;
+                    for (size_t j = threadBegin; j < threadEnd; ++j) {
+                        convert(&rawValues[j*width], width, buf.row(j));
                         if (t == 0) {
-                            float br = (float)i+1;
-                            float nz = (float)width*height/threadCount;
+                            float br = (float)j+1;
+                            float nz = (float)height/threadCount;
                             emit sendProgress(br/nz*100);
                         }
                     }
-
                     break;
                 case Util::ScaleMode::Decrease:
+                {
+                    std::vector<double> cells(width);
                     threadBegin = (float)t/threadCount*height;
                     threadEnd = (float)(t+1)/threadCount*height;
                     for (auto j = threadBegin; j < threadEnd; ++j) {
                         for (auto i = 0; i < width; ++i) {
-                            cell = 0;
+                            double cell = 0;
                             auto cellCount = 0;
                             for (auto l = 0; l < params.scale; ++l) {
                                 for (auto k = 0; k < params.scale; ++k) {
@@ -468,27 +547,9 @@ std::unique_ptr<uint16_t[]> ImageConverter::CreateImageData_G16(double* rawValue
                                     ++cellCount;
                                 }
                             }
-                            cell /= cellCount;
-                            switch(params.outputMode) {
-                                case Util::OutputMode::Grayscale16_MinToMax:
-                                    buf[j*width+i] = transformCellToG16MinToMax(cell, params.minAndMax.value());
-                                    break;
-                                case Util::OutputMode::Grayscale16_TrueValue:
-                                    buf[j*width+i] = transformCellToG16TrueValue(cell, params.offset.value());
-                                    break;
-                                case Util::OutputMode::Grayscale16_Lua:
-                                {
-                                    lua["params"]["val"] = cell;
-                                    lua["color"]["value"] = 0;
-                                    lua["set_color"]();
-                                    double pixelValue = lua["color"]["value"];
-                                    buf[j*width+i] = pixelValue;
-                                }
-                                break;
-                                default:
-                                    throw std::invalid_argument("unreachable code");
-                            }
+                            cells[i] = cell/cellCount;
                         }
+                        convert(cells.data(), width, buf.row(j));
                         if (t == 0) {
                             float br = (float)j+1;
                             float nz = (float)height/threadCount;
@@ -496,34 +557,18 @@ std::unique_ptr<uint16_t[]> ImageConverter::CreateImageData_G16(double* rawValue
                         }
                     }
                     break;
+                }
                 case Util::ScaleMode::Increase:
+                {
+                    std::vector<std::uint16_t> values(rawWidth);
                     threadBegin = (float)t/threadCount*rawHeight;
                     threadEnd = (float)(t+1)/threadCount*rawHeight;
                     for (auto j = threadBegin; j < threadEnd; ++j) {
+                        convert(&rawValues[j*rawWidth], rawWidth, values.data());
                         for (auto i = 0; i < rawWidth; ++i) {
-                            cell = rawValues[j*rawWidth+i];
-                            switch(params.outputMode) {
-                                case Util::OutputMode::Grayscale16_MinToMax:
-                                    value = transformCellToG16MinToMax(cell, params.minAndMax.value());
-                                    break;
-                                case Util::OutputMode::Grayscale16_TrueValue:
-                                    value = transformCellToG16TrueValue(cell, params.offset.value());
-                                    break;
-                                case Util::OutputMode::Grayscale16_Lua:
-                                {
-                                    lua["params"]["val"] = cell;
-                                    lua["color"]["value"] = 0;
-                                    lua["set_color"]();
-                                    double pixelValue = lua["color"]["value"];
-                                    value = pixelValue;
-                                }
-                                break;
-                                default:
-                                    throw std::invalid_argument("unreachable code");
-                            }
                             for (auto l = 0; l < params.scale; ++l) {
                                 for (auto k = 0; k < params.scale; ++k) {
-                                    buf[(j*params.scale+l)*width+i*params.scale+k] = value;
+                                    buf.data()[(j*params.scale+l)*width+i*params.scale+k] = values[i];
                                 }
                             }
                         }
@@ -534,18 +579,25 @@ std::unique_ptr<uint16_t[]> ImageConverter::CreateImageData_G16(double* rawValue
                         }
                     }
                     break;
+                }
+            }
+            if (memo) {
+                memoHits += memo->hits;
+                memoMisses += memo->misses;
             }
         });
     }
 
     for (auto& thread : threads) thread.join();
+    luaCacheHits += memoHits;
+    luaCacheMisses += memoMisses;
 
     outWidthAndHeight = {width, height};
     return buf;
 }
 
 
-std::unique_ptr<uint8_t[]> ImageConverter::CreateImageData_RGB(double* rawValues, const TiffConvertParams &params, std::pair<unsigned int,unsigned int>& outWidthAndHeight)
+Png::Rgba8 ImageConverter::CreateImageData_RGB(double* rawValues, const TiffConvertParams &params, std::pair<unsigned int,unsigned int>& outWidthAndHeight, const Lookup::DenseTable<color>* table)
 {
     if (rawValues == nullptr) return {};
 
@@ -567,75 +619,66 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateImageData_RGB(double* rawValues
             break;
     }
 
-    auto numberOfPixels = width*height;
-    constexpr auto numberOfChannels = 4;
-    auto buf = std::unique_ptr<unsigned char[]>(new unsigned char[numberOfChannels*numberOfPixels]);
+    auto buf = Png::Rgba8(width, height);
+
+    // the ranges are compiled once and shared by the threads
+    std::optional<Lookup::RangeTable> ranges;
+    if (params.outputMode == Util::OutputMode::RGB_UserRanges) ranges.emplace(params.colorValues.value(), params.gradient.value());
+
+    // the results of a pure script are reused for repeated cells
+    const bool memoize = params.outputMode == Util::OutputMode::RGB_Lua && params.luaPure.value_or(false);
+    std::atomic<size_t> memoHits = 0, memoMisses = 0;
 
     auto threadCount = std::thread::hardware_concurrency();
     std::vector<std::thread> threads; threads.reserve(threadCount);
     for (auto t = 0; t < threadCount; ++t) {
-        threads.emplace_back([t, threadCount, width, height, rawWidth, rawHeight, numberOfPixels, &params, &buf, &rawValues, this]() {
+        threads.emplace_back([t, threadCount, width, height, rawWidth, rawHeight, &params, &buf, &rawValues, &ranges, table, memoize, &memoHits, &memoMisses, this]() {
             // lua
-            sol::state lua;
-            if (params.outputMode == Util::OutputMode::RGB_Lua) {
-                lua.open_libraries(sol::lib::base, sol::lib::table, sol::lib::math);
-                lua.create_named_table("params");
-                lua.create_named_table("color");
-                lua.script(params.luaFunction.value());
-            }
+            std::optional<Lua::Converter> lua;
+            if (params.outputMode == Util::OutputMode::RGB_Lua) lua.emplace(params.luaFunction.value());
+            std::optional<Lua::Memo<color>> memo;
+            if (memoize && !lua->isBatched()) memo.emplace();
             //
-            double cell;
-            color value;
+            auto convert = [table, &params, &ranges, &lua, &memo](const double* cells, size_t count, color* output) {
+                // a batched script gets the whole row, unless the table already has most of it
+                if (lua && lua->isBatched() && !table) {
+                    lua->toRGB(cells, count, output);
+                    return;
+                }
+                for (size_t i = 0; i < count; ++i) {
+                    if (table && table->contains(cells[i])) output[i] = (*table)[(std::int32_t)cells[i]];
+                    else if (memo) output[i] = memo->get(cells[i], [&params, &ranges, &lua](double cell) { return transformCellToRGB(cell, params, ranges, &*lua); });
+                    else output[i] = transformCellToRGB(cells[i], params, ranges, lua ? &*lua : nullptr);
+                }
+            };
             size_t threadBegin;
             size_t threadEnd;
             switch(params.scaleMode) {
                 case Util::ScaleMode::No:
-                    threadBegin = (float)t/threadCount*numberOfPixels;
-                    threadEnd = (float)(t+1)/threadCount*numberOfPixels;
-                    for (auto i = threadBegin; i < threadEnd; ++i) {
-                        cell = rawValues[i];
-                        switch(params.outputMode) {
-                            case Util::OutputMode::RGB_UserValues:
-                                value = transformCellToRGBUserValues(cell, params.colorValues.value());
-                                break;
-                            case Util::OutputMode::RGB_UserRanges:
-                                value = transformCellToRGBUserRanges(cell, params.colorValues.value(), params.gradient.value());
-                                break;
-                            case Util::OutputMode::RGB_Formula:
-                                value = transformCellToRGBFormula(cell);
-                                break;
-                            case Util::OutputMode::RGB_Lua:
-                            {
-                                lua["params"]["val"] = cell;
-                                lua["color"]["r"] = 0;
-                                lua["color"]["g"] = 0;
-                                lua["color"]["b"] = 0;
-                                lua["color"]["a"] = 255;
-                                lua["set_color"]();
-                                double rgba[4] = {lua["color"]["r"], lua["color"]["g"], lua["color"]["b"], lua["color"]["a"]};
-                                value = {static_cast<unsigned char>(rgba[0]), static_cast<unsigned char>(rgba[1]), static_cast<unsigned char>(rgba[2]), static_cast<unsigned char>(rgba[3])};
-                            }
-                                break;
-                            default:
-                                throw std::invalid_argument("unreachable code");
-                        }
-                        buf[i] = value[0];
-                        buf[i+1*numberOfPixels] = value[1];
-                        buf[i+2*numberOfPixels] = value[2];
-                        buf[i+3*numberOfPixels] = value[3];
+                {
+                    std::vector<color> values(width);
+                    threadBegin = (float)t/threadCount*height;
+                    threadEnd = (float)(t+1)/threadCount*height;
+                    for (auto j = threadBegin; j < threadEnd; ++j) {
+                        convert(&rawValues[j*width], width, values.data());
+                        buf.setPixels(j*width, values.data(), width);
                         if (t == 0) {
-                            float br = (float)i+1;
-                            float nz = (float)numberOfPixels/threadCount;
+                            float br = (float)j+1;
+                            float nz = (float)height/threadCount;
                             emit sendProgress(br/nz*100);
                         }
                     }
                     break;
+                }
                 case Util::ScaleMode::Decrease:
+                {
+                    std::vector<double> cells(width);
+                    std::vector<color> values(width);
                     threadBegin = (float)t/threadCount*height;
                     threadEnd = (float)(t+1)/threadCount*height;
                     for (auto j = threadBegin; j < threadEnd; ++j) {
                         for (auto i = 0; i < width; ++i) {
-                            cell = 0;
+                            double cell = 0;
                             auto cellCount = 0;
                             for (auto l = 0; l < params.scale; ++l) {
                                 for (auto k = 0; k < params.scale; ++k) {
@@ -646,81 +689,30 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateImageData_RGB(double* rawValues
                                     ++cellCount;
                                 }
                             }
-                            cell /= cellCount;
-                            switch(params.outputMode) {
-                                case Util::OutputMode::RGB_UserValues:
-                                    value = transformCellToRGBUserValues(cell, params.colorValues.value());
-                                    break;
-                                case Util::OutputMode::RGB_UserRanges:
-                                    value = transformCellToRGBUserRanges(cell, params.colorValues.value(), params.gradient.value());
-                                    break;
-                                case Util::OutputMode::RGB_Formula:
-                                    value = transformCellToRGBFormula(cell);
-                                    break;
-                                case Util::OutputMode::RGB_Lua:
-                                {
-                                    lua["params"]["val"] = cell;
-                                    lua["color"]["r"] = 0;
-                                    lua["color"]["g"] = 0;
-                                    lua["color"]["b"] = 0;
-                                    lua["color"]["a"] = 255;
-                                    lua["set_color"]();
-                                    double rgba[4] = {lua["color"]["r"], lua["color"]["g"], lua["color"]["b"], lua["color"]["a"]};
-                                    value = {static_cast<unsigned char>(rgba[0]), static_cast<unsigned char>(rgba[1]), static_cast<unsigned char>(rgba[2]), static_cast<unsigned char>(rgba[3])};
-                                }
-                                    break;
-                                default:
-                                    throw std::invalid_argument("unreachable code");
-                            }
-                            buf[j*width+i] = value[0];
-                            buf[j*width+i+1*numberOfPixels] = value[1];
-                            buf[j*width+i+2*numberOfPixels] = value[2];
-                            buf[j*width+i+3*numberOfPixels] = value[3];
-                            if (t == 0) {
-                                float br = (float)j+1;
-                                float nz = (float)height/threadCount;
-                                emit sendProgress(br/nz*100);
-                            }
+                            cells[i] = cell/cellCount;
+                        }
+                        convert(cells.data(), width, values.data());
+                        buf.setPixels(j*width, values.data(), width);
+                        if (t == 0) {
+                            float br = (float)j+1;
+                            float nz = (float)height/threadCount;
+                            emit sendProgress(br/nz*100);
                         }
                     }
                     break;
+                }
                 case Util::ScaleMode::Increase:
+                {
+                    std::vector<color> values(rawWidth);
                     threadBegin = (float)t/threadCount*rawHeight;
                     threadEnd = (float)(t+1)/threadCount*rawHeight;
                     for (auto j = threadBegin; j < threadEnd; ++j) {
+                        convert(&rawValues[j*rawWidth], rawWidth, values.data());
                         for (auto i = 0; i < rawWidth; ++i) {
-                            cell = rawValues[j*rawWidth+i];
-                            switch(params.outputMode) {
-                                case Util::OutputMode::RGB_UserValues:
-                                    value = transformCellToRGBUserValues(cell, params.colorValues.value());
-                                    break;
-                                case Util::OutputMode::RGB_UserRanges:
-                                    value = transformCellToRGBUserRanges(cell, params.colorValues.value(), params.gradient.value());
-                                    break;
-                                case Util::OutputMode::RGB_Formula:
-                                    value = transformCellToRGBFormula(cell);
-                                    break;
-                                case Util::OutputMode::RGB_Lua:
-                                {
-                                    lua["params"]["val"] = cell;
-                                    lua["color"]["r"] = 0;
-                                    lua["color"]["g"] = 0;
-                                    lua["color"]["b"] = 0;
-                                    lua["color"]["a"] = 255;
-                                    lua["set_color"]();
-                                    double rgba[4] = {lua["color"]["r"], lua["color"]["g"], lua["color"]["b"], lua["color"]["a"]};
-                                    value = {static_cast<unsigned char>(rgba[0]), static_cast<unsigned char>(rgba[1]), static_cast<unsigned char>(rgba[2]), static_cast<unsigned char>(rgba[3])};
-                                }
-                                    break;
-                                default:
-                                    throw std::invalid_argument("unreachable code");
-                            }
+                            auto value = values[i];
                             for (auto l = 0; l < params.scale; ++l) {
                                 for (auto k = 0; k < params.scale; ++k) {
-                                    buf[(j*params.scale+l)*width+i*params.scale+k] = value[0];
-                                    buf[(j*params.scale+l)*width+i*params.scale+k+1*numberOfPixels] = value[1];
-                                    buf[(j*params.scale+l)*width+i*params.scale+k+2*numberOfPixels] = value[2];
-                                    buf[(j*params.scale+l)*width+i*params.scale+k+3*numberOfPixels] = value[3];
+                                    buf.setPixel((j*params.scale+l)*width+i*params.scale+k, value);
                                 }
                             }
                         }
@@ -731,220 +723,120 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateImageData_RGB(double* rawValues
                         }
                     }
                     break;
-        }
+                }
+            }
+            if (memo) {
+                memoHits += memo->hits;
+                memoMisses += memo->misses;
+            }
         });
     }
     for (auto& thread : threads) thread.join();
+    luaCacheHits += memoHits;
+    luaCacheMisses += memoMisses;
 
     outWidthAndHeight = {width, height};
     return buf;
 }
 
-std::unique_ptr<uint16_t[]> ImageConverter::CreateG16_MinToMax(const QString &path, const std::pair<double, double>& minAndMax,
-                                                               int startX, int startY, int endX, int endY)
+Png::Gray16 ImageConverter::CreateG16_MinToMax(const QString &path, const std::pair<double, double>& minAndMax,
+                                               int startX, int startY, int endX, int endY)
 {
     auto width = (endX-startX+1);
     auto height = (endY-startY+1);
-    auto buf = std::unique_ptr<uint16_t[]>(new uint16_t[width*height]);
-    if (!Tiff::LoadTiff(path,
-        [&buf,minAndMax, startX, endX, startY, endY, width](std::vector<std::vector<double>>&& pixels, unsigned int _startX, unsigned int _startY) {
-            for (auto _y = 0; _y < pixels.size(); ++_y) {
-                if (_startY+_y < startY || _startY+_y > endY) continue;
-                for (auto _x = 0; _x < pixels[0].size(); ++_x) {
-                    if (_startX+_x < startX || _startX+_x > endX) continue;
-                    auto x = _startX+_x-startX;
-                    auto y = _startY+_y-startY;
-                    buf[y*width+x] = transformCellToG16MinToMax(pixels[x][y], minAndMax);
-                }
-            }
-        },
-        [&buf,minAndMax, startX, endX, startY, width](std::vector<double>&& pixels, uint32_t row) {
-            for (auto i = 0; i < pixels.size(); ++i) {
-                buf[(row-startY)*width+i] = transformCellToG16MinToMax(pixels[i], minAndMax);
+    auto buf = Png::Gray16(width, height);
+    if (!Tiff::LoadTiffView(path,
+        [&buf, transform = Simd::G16Transform::MinToMax(minAndMax.first, minAndMax.second), startX, startY, width](const auto& view, unsigned int) {
+            for (std::uint32_t _y = 0; _y < view.height; ++_y) {
+                Simd::ToG16(view.row(_y), view.width, buf.data()+(size_t)(view.y+_y-startY)*width+view.x-startX, transform);
             }
         },
         [this](uint32_t percent) {
             emit sendProgress(percent);
         },
-        startY, endY, startX, endX)) {
-            return {};
+        startY, endY, startX, endX, readOptions())) {
             emit sendProgressError();
+            return {};
         }
     return buf;
 }
 
-std::unique_ptr<uint16_t[]> ImageConverter::CreateG16_TrueValue(const QString &path, double offset, int startX, int startY, int endX, int endY)
+Png::Gray16 ImageConverter::CreateG16_TrueValue(const QString &path, double offset, int startX, int startY, int endX, int endY)
 {
     auto width = (endX-startX+1);
     auto height = (endY-startY+1);
-    auto buf = std::unique_ptr<uint16_t[]>(new uint16_t[width*height]);
-    if (!Tiff::LoadTiff(path,
-        [&buf,offset, startX, endX, startY, endY, width](std::vector<std::vector<double>>&& pixels, unsigned int _startX, unsigned int _startY) {
-            for (auto _y = 0; _y < pixels.size(); ++_y) {
-                if (_startY+_y < startY || _startY+_y > endY) continue;
-                for (auto _x = 0; _x < pixels[0].size(); ++_x) {
-                    if (_startX+_x < startX || _startX+_x > endX) continue;
-                    auto x = _startX+_x-startX;
-                    auto y = _startY+_y-startY;
-                    buf[y*width+x] = transformCellToG16TrueValue(pixels[_y][_x], offset);
-                }
-            }
-        },
-        [&buf,offset, startX, endX, startY, width](std::vector<double>&& pixels, uint32_t row) {
-            for (auto i = 0; i < pixels.size(); ++i) {
-                buf[(row-startY)*width+i] = transformCellToG16TrueValue(pixels[i], offset);
+    auto buf = Png::Gray16(width, height);
+    if (!Tiff::LoadTiffView(path,
+        [&buf, transform = Simd::G16Transform::TrueValue(offset), startX, startY, width](const auto& view, unsigned int) {
+            for (std::uint32_t _y = 0; _y < view.height; ++_y) {
+                Simd::ToG16(view.row(_y), view.width, buf.data()+(size_t)(view.y+_y-startY)*width+view.x-startX, transform);
             }
         },
         [this](uint32_t percent) {
             emit sendProgress(percent);
         },
-        startY, endY, startX, endX)) {
+        startY, endY, startX, endX, readOptions())) {
             emit sendProgressError();
             return {};
         }
     return buf;
 }
 
-std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_UserValues(const QString &path, const std::map<double, color>& colorValues, int startX, int startY, int endX, int endY)
+template <typename F>
+Png::Rgba8 ImageConverter::CreateRGB_Mapped(const QString &path, const F& transform, int startX, int startY, int endX, int endY)
 {
     auto width = (endX-startX+1);
     auto height = (endY-startY+1);
-    constexpr auto numberOfChannels = 4;
-    auto numberOfPixels = width*height;
-    auto buf = std::unique_ptr<uint8_t[]>(new uint8_t[numberOfChannels*numberOfPixels]);
-    if (!Tiff::LoadTiff(path,
-        [&buf,&colorValues, numberOfPixels, startX, endX, startY, endY, width](std::vector<std::vector<double>>&& pixels, unsigned int _startX, unsigned int _startY) {
-            for (auto _y = 0; _y < pixels.size(); ++_y) {
-                if (_startY+_y < startY || _startY+_y > endY) continue;
-                for (auto _x = 0; _x < pixels[0].size(); ++_x) {
-                    if (_startX+_x < startX || _startX+_x > endX) continue;
-                    auto x = _startX+_x-startX;
-                    auto y = _startY+_y-startY;
-                    auto ar = transformCellToRGBUserValues(pixels[_y][_x], colorValues);
-                    auto position = y*width+x;
-                    buf[position] = ar[0];
-                    buf[position+1*numberOfPixels] = ar[1];
-                    buf[position+2*numberOfPixels] = ar[2];
-                    buf[position+3*numberOfPixels] = ar[3];
+    auto buf = Png::Rgba8(width, height);
+    auto table = CreateDenseTable<color>(path, (size_t)width*height);
+    if (table) table->fill(0, table->size(), transform);
+    if (!Tiff::LoadTiffView(path,
+        [&buf, &transform, &table, startX, startY, width](const auto& view, unsigned int) {
+            using T = typename std::decay_t<decltype(view)>::value_type;
+            for (std::uint32_t _y = 0; _y < view.height; ++_y) {
+                auto pixels = view.row(_y);
+                auto position = (size_t)(view.y+_y-startY)*width+view.x-startX;
+                for (std::uint32_t _x = 0; _x < view.width; ++_x, ++position) {
+                    color ar;
+                    if constexpr (std::is_integral_v<T> && sizeof(T) <= 2) ar = table ? (*table)[pixels[_x]] : transform(pixels[_x]);
+                    else ar = transform(pixels[_x]);
+                    buf.setPixel(position, ar);
                 }
             }
         },
-        [&buf,&colorValues, startX, endX, startY, numberOfPixels, width](std::vector<double>&& pixels, uint32_t row) {
-            for (auto i = 0; i < pixels.size(); ++i) {
-                auto ar = transformCellToRGBUserValues(pixels[i], colorValues);
-                auto position = (row-startY)*width+i;
-                buf[position] = ar[0];
-                buf[position+1*numberOfPixels] = ar[1];
-                buf[position+2*numberOfPixels] = ar[2];
-                buf[position+3*numberOfPixels] = ar[3];
-            }
-        },
         [this](uint32_t percent) {
             emit sendProgress(percent);
         },
-        startY, endY, startX, endX)) {
+        startY, endY, startX, endX, readOptions())) {
             emit sendProgressError();
             return {};
         }
     return buf;
 }
 
-std::unique_ptr<unsigned char[]> ImageConverter::CreateRGB_UserRanges(const QString &path, const std::map<double, color>& colorValues, bool useGradient, int startX, int startY, int endX, int endY)
+Png::Rgba8 ImageConverter::CreateRGB_UserValues(const QString &path, const std::map<double, color>& colorValues, int startX, int startY, int endX, int endY)
 {
-    auto width = (endX-startX+1);
-    auto height = (endY-startY+1);
-    constexpr auto numberOfChannels = 4;
-    auto numberOfPixels = width*height;
-    auto buf = std::unique_ptr<unsigned char[]>(new unsigned char[numberOfChannels*numberOfPixels]);
-    if (!Tiff::LoadTiff(path,
-        [&buf,&colorValues, numberOfPixels, useGradient, startX, endX, startY, endY, width](std::vector<std::vector<double>>&& pixels, unsigned int _startX, unsigned int _startY) {
-            for (auto _y = 0; _y < pixels.size(); ++_y) {
-                if (_startY+_y < startY || _startY+_y > endY) continue;
-                for (auto _x = 0; _x < pixels[0].size(); ++_x) {
-                    if (_startX+_x < startX || _startX+_x > endX) continue;
-                    auto x = _startX+_x-startX;
-                    auto y = _startY+_y-startY;
-                    auto ar = transformCellToRGBUserRanges(pixels[_y][_x], colorValues, useGradient);
-                    auto position = y*width+x;
-                    buf[position] = ar[0];
-                    buf[position+1*numberOfPixels] = ar[1];
-                    buf[position+2*numberOfPixels] = ar[2];
-                    buf[position+3*numberOfPixels] = ar[3];
-                }
-            }
-        },
-        [&buf,&colorValues, startX, endX, startY, numberOfPixels, useGradient, width](std::vector<double>&& pixels, uint32_t row) {
-            for (auto i = 0; i < pixels.size(); ++i) {
-                auto ar = transformCellToRGBUserRanges(pixels[i], colorValues, useGradient);
-                auto position = (row-startY)*width+i;
-                buf[position] = ar[0];
-                buf[position+1*numberOfPixels] = ar[1];
-                buf[position+2*numberOfPixels] = ar[2];
-                buf[position+3*numberOfPixels] = ar[3];
-            }
-        },
-        [this](uint32_t percent) {
-            emit sendProgress(percent);
-        },
-        startY, endY, startX, endX)) {
-            emit sendProgressError();
-            return {};
-        }
-    return buf;
+    return CreateRGB_Mapped(path, [&colorValues](double cell) {
+        return transformCellToRGBUserValues(cell, colorValues);
+    }, startX, startY, endX, endY);
 }
 
-std::unique_ptr<unsigned char[]> ImageConverter::CreateRGB_Formula(const QString &path, int startX, int startY, int endX, int endY)
+Png::Rgba8 ImageConverter::CreateRGB_UserRanges(const QString &path, const std::map<double, color>& colorValues, bool useGradient, int startX, int startY, int endX, int endY)
 {
-    auto width = (endX-startX+1);
-    auto height = (endY-startY+1);
-    constexpr auto numberOfChannels = 4;
-    auto numberOfPixels = width*height;
-    auto buf = std::unique_ptr<unsigned char[]>(new unsigned char[numberOfChannels*numberOfPixels]);
-
-    if (!Tiff::LoadTiff(path,
-        [&buf, numberOfPixels, startX, endX, startY, endY, width](std::vector<std::vector<double>>&& pixels, unsigned int _startX, unsigned int _startY) {
-            for (auto _y = 0; _y < pixels.size(); ++_y) {
-                if (_startY+_y < startY || _startY+_y > endY) continue;
-                for (auto _x = 0; _x < pixels[0].size(); ++_x) {
-                    if (_startX+_x < startX || _startX+_x > endX) continue;
-                    auto x = _startX+_x-startX;
-                    auto y = _startY+_y-startY;
-                    auto position = y*width+x;
-                    auto ar = transformCellToRGBFormula(pixels[_y][_x]);
-                    buf[position] = ar[0];
-                    buf[position+1*numberOfPixels] = ar[1];
-                    buf[position+2*numberOfPixels] = ar[2];
-                    buf[position+3*numberOfPixels] = ar[3];
-                }
-            }
-        },
-        [&buf, startX, endX, startY, numberOfPixels, width](std::vector<double>&& pixels, uint32_t row) {
-            for (auto i = 0; i < pixels.size(); ++i) {
-                auto ar = ImageConverter::transformCellToRGBFormula(pixels[i]);
-                auto position = (row-startY)*width+i;
-                buf[position] = ar[0];
-                buf[position+1*numberOfPixels] = ar[1];
-                buf[position+2*numberOfPixels] = ar[2];
-                buf[position+3*numberOfPixels] = ar[3];
-            }
-        },
-        [this](uint32_t percent) {
-            emit sendProgress(percent);
-
-        },
-        startY, endY, startX, endX)) {
-            emit sendProgressError();
-            return {};
-        }
-    return buf;
+    return CreateRGB_Mapped(path, [ranges = Lookup::RangeTable(colorValues, useGradient)](double cell) {
+        return ranges(cell);
+    }, startX, startY, endX, endY);
 }
 
+Png::Rgba8 ImageConverter::CreateRGB_Formula(const QString &path, int startX, int startY, int endX, int endY)
+{
+    return CreateRGB_Mapped(path, [](double cell) {
+        return transformCellToRGBFormula(cell);
+    }, startX, startY, endX, endY);
+}
 
-std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const NewCsvConvertParams &params) {
-    constexpr auto numberOfChannels = 4;
-    auto numberOfPixels = params.width*params.height;
-
-    auto buf = std::unique_ptr<uint8_t[]>(new uint8_t[numberOfChannels*numberOfPixels]());
+Png::Rgba8 ImageConverter::CreateRGB_Points(const NewCsvConvertParams &params) {
+    auto buf = Png::Rgba8(params.width, params.height, true);
     auto csv = getRows(params.inputPath.toStdString());
     bool isAValidCoordinateFile = true;
     auto _boundaries = getBoundaries(csv, params.coordinateIndexes, isAValidCoordinateFile); // this is run even if the boundaries are set by user in order to check for invalid csv file
@@ -958,13 +850,13 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const NewCsvConvertP
     auto threadCount = std::thread::hardware_concurrency();
     std::vector<std::thread> threads; threads.reserve(threadCount);
     for (auto i = 0; i < threadCount; ++i) {
-        threads.emplace_back([i, threadCount, numberOfPixels, &csv, &columns, &buf, &params, &boundaries, this]() {
+        threads.emplace_back([i, threadCount, &csv, &columns, &buf, &params, &boundaries, this]() {
             // lua
-            sol::state lua;
-            lua.open_libraries(sol::lib::base, sol::lib::table, sol::lib::math);
-            lua.create_named_table("params");
-            lua.create_named_table("style");
-            lua.script(params.luaScript.value());
+            auto state = Lua::StatePool::session().acquire(params.luaScript.value(), Lua::StatePool::Kind::Points, [](sol::state& lua) {
+                lua.create_named_table("params");
+                lua.create_named_table("style");
+            });
+            sol::state& lua = *state;
             //
 
             size_t threadBegin = (float)i/threadCount*csv.size();
@@ -999,10 +891,7 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const NewCsvConvertP
                 double center_b = lua["style"]["center_b"];
                 double center_a = lua["style"]["center_a"];
 
-                buf[pos] = center_r;
-                buf[pos+1*numberOfPixels] = center_g;
-                buf[pos+2*numberOfPixels] = center_b;
-                buf[pos+3*numberOfPixels] = center_a;
+                buf.setPixel(pos, {static_cast<uint8_t>(center_r), static_cast<uint8_t>(center_g), static_cast<uint8_t>(center_b), static_cast<uint8_t>(center_a)});
 
                 double _shapeSize = lua["style"]["size"];
                 uint32_t shapeSize = _shapeSize;
@@ -1032,10 +921,7 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const NewCsvConvertP
                         double g = lua["style"]["g"];
                         double b = lua["style"]["b"];
                         double a = lua["style"]["a"];
-                        buf[currPos] = r;
-                        buf[currPos+1*numberOfPixels] = g;
-                        buf[currPos+2*numberOfPixels] = b;
-                        buf[currPos+3*numberOfPixels] = a;
+                        buf.setPixel(currPos, {static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b), static_cast<uint8_t>(a)});
                     }
                 }
                 if (i == 0) {
@@ -1050,12 +936,9 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const NewCsvConvertP
     return buf;
 }
 
-std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const CsvConvertParams &params)
+Png::Rgba8 ImageConverter::CreateRGB_Points(const CsvConvertParams &params)
 {
-    constexpr auto numberOfChannels = 4;
-    auto numberOfPixels = params.width*params.height;
-
-    auto buf = std::unique_ptr<uint8_t[]>(new uint8_t[numberOfChannels*numberOfPixels]());
+    auto buf = Png::Rgba8(params.width, params.height, true);
 
     auto csv = getRows(params.inputPath.toStdString());
     bool isAValidCoordinateFile = true;
@@ -1069,7 +952,7 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const CsvConvertPara
     auto threadCount = std::thread::hardware_concurrency();
     std::vector<std::thread> threads; threads.reserve(threadCount);
     for (auto i = 0; i < threadCount; ++i) {
-        threads.emplace_back([i, threadCount, numberOfPixels, &csv, &buf, &params, &boundaries, this]() {
+        threads.emplace_back([i, threadCount, &csv, &buf, &params, &boundaries, this]() {
             size_t threadBegin = (float)i/threadCount*csv.size();
             size_t threadEnd = (float)(i+1)/threadCount*csv.size();
             for (auto row = threadBegin; row < threadEnd; ++row) {
@@ -1082,10 +965,7 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const CsvConvertPara
 
                 auto styleIndex = getStyleForCsvShape(csv[row], params);
                 auto centerColor = params.colors[styleIndex].second;
-                buf[pos] = centerColor[0];
-                buf[pos+1*numberOfPixels] = centerColor[1];
-                buf[pos+2*numberOfPixels] = centerColor[2];
-                buf[pos+3*numberOfPixels] = centerColor[3];
+                buf.setPixel(pos, centerColor);
 
                 auto shapeSize = params.shapes[styleIndex].second;
                 if (shapeSize < 2) continue;
@@ -1110,10 +990,7 @@ std::unique_ptr<uint8_t[]> ImageConverter::CreateRGB_Points(const CsvConvertPara
                         if (!doesShapeFillThisCell) continue;
 
                         auto shapeColor = params.colors[styleIndex].first;
-                        buf[currPos] = shapeColor[0];
-                        buf[currPos+1*numberOfPixels] = shapeColor[1];
-                        buf[currPos+2*numberOfPixels] = shapeColor[2];
-                        buf[currPos+3*numberOfPixels] = shapeColor[3];
+                        buf.setPixel(currPos, shapeColor);
                     }
                 }
                 if (i == 0) {
@@ -1174,12 +1051,12 @@ cimg_library::CImg<uint8_t> ImageConverter::CreateRGB_VectorShapes(NewGeoJsonCon
     for (auto i = 0; i < threadCount; ++i) {
         threads.emplace_back([i, threadCount, &mtx, &img, &allShapes, &params, &properties, this]() {
             // lua
-            sol::state lua;
-            lua.open_libraries(sol::lib::base, sol::lib::table, sol::lib::math);
-            lua["shape_type"] = "";
-            lua.create_named_table("params");
-            lua.create_named_table("color");
-            lua.script(params.luaScript.value());
+            auto state = Lua::StatePool::session().acquire(params.luaScript.value(), Lua::StatePool::Kind::Shapes, [](sol::state& lua) {
+                lua["shape_type"] = "";
+                lua.create_named_table("params");
+                lua.create_named_table("color");
+            });
+            sol::state& lua = *state;
             //
             size_t threadBegin = (float)i/threadCount*allShapes.size();
             size_t threadEnd = (float)(i+1)/threadCount*allShapes.size();
@@ -1471,12 +1348,12 @@ std::vector<std::unique_ptr<Shape::Shape> > ImageConverter::getAllShapesFromLaye
         for (auto i = 0; i < threadCount; ++i) {
             threads.emplace_back([this, i, threadCount, &mtx, layerName, boundariesNotSet, entryCount, &bounds, &blobs, &shapes, &properties, &allColumns, &propertyColumns, &params, &colors]() {
                 // lua
-                sol::state lua;
-                lua.open_libraries(sol::lib::base, sol::lib::table, sol::lib::math);
-                lua["shape_type"] = "";
-                lua.create_named_table("params");
-                lua.create_named_table("color");
-                lua.script(params.luaScript.value());
+                auto state = Lua::StatePool::session().acquire(params.luaScript.value(), Lua::StatePool::Kind::Shapes, [](sol::state& lua) {
+                    lua["shape_type"] = "";
+                    lua.create_named_table("params");
+                    lua.create_named_table("color");
+                });
+                sol::state& lua = *state;
                 //
                 size_t threadBegin = (float)i/threadCount*entryCount;
                 size_t threadEnd = (float)(i+1)/threadCount*entryCount;
@@ -1704,95 +1581,343 @@ std::vector<std::unique_ptr<Shape::Shape> > ImageConverter::getAllShapesFromJson
 
 bool ImageConverter::GetMinAndMaxValues(const QString& path, double& min, double& max, int startX, int endX, int startY, int endY)
 {
-    auto _min = std::numeric_limits<double>::max();
-    auto _max = std::numeric_limits<double>::lowest();
-
-    auto widthAndHeight = Tiff::GetWidthAndHeight(path);
-    if (widthAndHeight.first == 0 || widthAndHeight.second == 0) return false;
-    if (endX == -1) endX = widthAndHeight.first-1;
-    if (endY == -1) endY = widthAndHeight.second-1;
-
-    if (!Tiff::LoadTiff(path,
-        [&_min,&_max](std::vector<std::vector<double>>&& pixels, unsigned int, unsigned int) {
-            for (auto& row : pixels) {
-                for (auto pixel : row) {
-                    if (pixel < _min) _min = pixel;
-                    if (pixel > _max) _max = pixel;
-                }
-            }
-        },
-        [&_min,&_max](std::vector<double>&& pixels, uint32_t row) {
-            for (auto v : pixels) {
-                if (v < _min) _min = v;
-                if (v > _max) _max = v;
-            }
-        },
-        [this](uint32_t percent) {
-            emit sendProgress(percent);
-        },
-        startY, endY, startX, endX)) {
+    Stats::RasterStats stats;
+    if (!GetStatistics(path, stats, startX, endX, startY, endY)) return false;
+    min = stats.min;
+    max = stats.max;
+    return true;
+}
+
+void ImageConverter::setTileCache(Tiff::TileCache *cache)
+{
+    tileCache = cache;
+}
+
+Tiff::ReadOptions ImageConverter::readOptions(std::uint16_t directory) const
+{
+    Tiff::ReadOptions options;
+    options.directory = directory;
+    options.tileCache = tileCache;
+    return options;
+}
+
+bool ImageConverter::GetStatistics(const QString &path, Stats::RasterStats &stats, int startX, int endX, int startY, int endY, std::uint16_t directory)
+{
+    auto options = readOptions(directory);
+    if (!Stats::Get(path, stats, [this](uint32_t percent) {
+        emit sendProgress(percent);
+    },
+    startX, endX, startY, endY, options)) {
         emit sendProgressError();
         return false;
     }
-    min = _min;
-    max = _max;
     return true;
 }
 
-std::set<double> ImageConverter::GetDistinctValues(const QString &path)
+std::set<double> ImageConverter::GetDistinctValues(const QString &path, size_t maxCount, bool& tooManyValues)
 {
-    std::set<double> rv;
-    bool ok = Tiff::LoadTiff(path,
-        [&rv](std::vector<std::vector<double>>&& pixels, unsigned int, unsigned int) {
-            for (auto& row : pixels) {
-                for (auto pixel : row) {
-                    rv.insert(pixel);
-                }
+    // every thread collects into its own set, and stops everyone once it alone has gone over the limit
+    tooManyValues = false;
+    std::atomic<bool> cancel = false;
+    std::vector<std::unordered_set<double>> threadValues(std::thread::hardware_concurrency());
+    auto options = readOptions();
+    options.cancel = &cancel;
+
+    bool ok = Tiff::LoadTiffView(path, [&threadValues, &cancel, maxCount](const auto& view, unsigned int threadIndex) {
+        auto& values = threadValues[threadIndex];
+        for (std::uint32_t _y = 0; _y < view.height; ++_y) {
+            auto pixels = view.row(_y);
+            double previous = std::numeric_limits<double>::quiet_NaN();
+            for (std::uint32_t _x = 0; _x < view.width; ++_x) {
+                double v = pixels[_x];
+                // neighbouring cells are often equal, and NaN would never match a set entry
+                if (v == previous || std::isnan(v)) continue;
+                values.insert(v);
+                previous = v;
             }
-        },
-        [&rv](std::vector<double>&& pixels, uint32_t) {
-            for (auto v : pixels) {
-                rv.insert(v);
+            if (values.size() > maxCount) {
+                cancel = true;
+                return;
             }
-    },
-        [this](uint32_t percent) {
-            emit sendProgress(percent);
         }
-    );
+    },
+    [this](uint32_t percent) {
+        emit sendProgress(percent);
+    },
+    0, -1, 0, -1, options);
     if (!ok) {
         emit sendProgressError();
         return {};
     }
-    return rv;
+
+    std::unordered_set<double> merged;
+    for (auto& values : threadValues) {
+        if (cancel || merged.size() > maxCount) break;
+        merged.insert(values.begin(), values.end());
+    }
+    if (cancel || merged.size() > maxCount) {
+        tooManyValues = true;
+        emit sendProgressError();
+        return {};
+    }
+    return std::set<double>(merged.begin(), merged.end());
 }
 
-std::unique_ptr<double[]> ImageConverter::GetRawImageValues(const QString &path, int startX, int endX, int startY, int endY)
+std::unique_ptr<double[]> ImageConverter::GetRawImageValues(const QString &path, int startX, int endX, int startY, int endY, std::uint16_t directory)
 {
     auto width = (endX-startX+1);
     auto height = (endY-startY+1);
 
-    auto buf = std::unique_ptr<double[]>(new double[width*height]);
+    auto buf = std::unique_ptr<double[]>(new double[(size_t)width*height]);
+    auto options = readOptions(directory);
 
-    if (!Tiff::LoadTiff(path, [&buf, startX, endX, startY, endY, width](std::vector<std::vector<double>>&& pixels, std::uint32_t _startX, std::uint32_t _startY) {
-        for (auto _y = 0; _y < pixels.size(); ++_y) {
-                if (_startY+_y < startY || _startY+_y > endY) continue;
-            for (auto _x = 0; _x < pixels[0].size(); ++_x) {
-                if (_startX+_x < startX || _startX+_x > endX) continue;
-                buf[(_startY+_y-startY)*width+_startX+_x-startX] = pixels[_y][_x];
-            }
-        }
-    },
-    [&buf, startX, endX, startY, endY, width](std::vector<double>&& pixels, uint32_t row) {
-        for (auto i = 0; i < pixels.size(); ++i) {
-            buf[(row-startY)*width+i] = pixels[i];
+    if (!Tiff::LoadTiffView(path, [&buf, startX, startY, width](const auto& view, unsigned int) {
+        for (std::uint32_t _y = 0; _y < view.height; ++_y) {
+            std::copy(view.row(_y), view.row(_y)+view.width, &buf[(size_t)(view.y+_y-startY)*width+view.x-startX]);
         }
     },
     [this](uint32_t percent) {
         emit sendProgress(percent);
     },
-    startY, endY, startX, endX)) {
+    startY, endY, startX, endX, options)) {
         emit sendProgressError();
         return nullptr;
     }
     return buf;
 }
+
+QString ImageConverter::GetRawValueSource(TiffConvertParams &params, std::uint16_t &directory, bool buildPyramid)
+{
+    // when decreasing, a reduced copy of the image (an overview stored in the file, or a cached pyramid level)
+    // can do part of the averaging, so only a fraction of the data is read.
+    // params' window and scale are changed to the ones of the reduced image.
+    // a missing pyramid is built only when asked to, by exports, since it writes a third of the image's size as floats to the cache.
+    // previews build it in the background instead, see GeotiffWindow::previewImage
+    directory = 0;
+    if (params.scaleMode == Util::ScaleMode::Decrease && params.scale > 1) {
+        auto windowPixels = (std::uint64_t)(params.endX-params.startX+1)*(params.endY-params.startY+1);
+        if (buildPyramid && Pyramid::ShouldBuild(params.inputPath, windowPixels)) {
+            emit sendProgressReset("Building overview pyramid...");
+            Pyramid::Build(params.inputPath, [this](uint32_t percent) {
+                emit sendProgress(percent);
+            });
+            emit sendProgressReset("Reading raw image values...");
+        }
+        // a window that doesn't start on the scale's grid would put the cells of the reduced image across the output cells,
+        // changing their averages and their number. the reduced window keeps the number of output cells of the full one
+        const auto outWidth = (params.endX-params.startX)/params.scale+1;
+        const auto outHeight = (params.endY-params.startY)/params.scale+1;
+        const bool aligned = params.startX % params.scale == 0 && params.startY % params.scale == 0;
+        auto reduce = [&params, outWidth, outHeight](unsigned int factor, std::uint32_t width, std::uint32_t height) {
+            auto scale = params.scale/factor;
+            auto startX = params.startX/factor, startY = params.startY/factor;
+            // the last output cell needs at least one cell of the reduced image
+            if (startX+(outWidth-1)*scale >= width || startY+(outHeight-1)*scale >= height) return false;
+            params.startX = startX;
+            params.startY = startY;
+            params.endX = std::min(std::min(params.endX/factor, width-1), startX+outWidth*scale-1);
+            params.endY = std::min(std::min(params.endY/factor, height-1), startY+outHeight*scale-1);
+            params.scale = scale;
+            if (params.scale == 1) params.scaleMode = Util::ScaleMode::No;
+            return true;
+        };
+        if (!aligned) return params.inputPath;
+        auto overview = Tiff::FindBestOverview(params.inputPath, params.scale);
+        auto level = Pyramid::FindBestLevel(params.inputPath, params.scale);
+        if (level.has_value() && (!overview.has_value() || level->factor > overview->factor) && reduce(level->factor, level->width, level->height)) {
+            return level->path;
+        }
+        if (overview.has_value() && reduce(overview->factor, overview->width, overview->height)) {
+            directory = overview->directory;
+        }
+    }
+    return params.inputPath;
+}
+
+std::unique_ptr<double[]> ImageConverter::GetRawImageValues(TiffConvertParams &params)
+{
+    std::uint16_t directory;
+    auto source = GetRawValueSource(params, directory);
+    return GetRawImageValues(source, params.startX, params.endX, params.startY, params.endY, directory);
+}
+
+bool ImageConverter::SaveImageStreamed(TiffConvertParams params, const QString &path, Util::OutputFormat format, Util::Compression compression)
+{
+    // made before the source is chosen, since that turns a decrease into a smaller one of a reduced image, whose values are averages
+    auto rgbTable = CreateTable_RGB(params);
+    auto g16Table = CreateTable_G16(params);
+    std::uint16_t directory;
+    auto source = GetRawValueSource(params, directory, true);
+    Tiff::TiffProperties properties;
+    if (!Tiff::GetProperties(source, properties, directory)) {
+        emit sendProgressError();
+        return false;
+    }
+    bool rgb = params.outputMode == Util::OutputMode::RGB_UserValues ||
+               params.outputMode == Util::OutputMode::RGB_UserRanges ||
+               params.outputMode == Util::OutputMode::RGB_Formula ||
+               params.outputMode == Util::OutputMode::RGB_Lua;
+    auto rawWidth = (params.endX-params.startX+1);
+    auto rawHeight = (params.endY-params.startY+1);
+    unsigned int width, height;
+    double outputRowsPerRawRow;
+    switch (params.scaleMode) {
+        case Util::ScaleMode::No:
+            width = rawWidth;
+            height = rawHeight;
+            outputRowsPerRawRow = 1;
+            break;
+        case Util::ScaleMode::Decrease:
+            width = std::ceil((float)rawWidth/params.scale);
+            height = std::ceil((float)rawHeight/params.scale);
+            outputRowsPerRawRow = 1.0/params.scale;
+            break;
+        case Util::ScaleMode::Increase:
+            width = rawWidth*params.scale;
+            height = rawHeight*params.scale;
+            outputRowsPerRawRow = params.scale;
+            break;
+    }
+
+    // the mapping needs the extremes of the whole window before the first band is converted
+    if (params.outputMode == Util::OutputMode::Grayscale16_MinToMax) {
+        emit sendProgressReset("Finding min and max values...");
+        Stats::RasterStats stats;
+        if (!GetStatistics(source, stats, params.startX, params.endX, params.startY, params.endY, directory)) return false;
+        params.minAndMax = std::pair<double,double>{stats.min, stats.max};
+    }
+
+    auto sink = Png::OpenImageSink(path, width, height, rgb ? Util::PixelSize::ThirtyTwoBit : Util::PixelSize::SixteenBit, format, compression);
+    if (!sink || !sink->isOpen()) {
+        Gui::ThrowError("Error creating the image.");
+        emit sendProgressError();
+        return false;
+    }
+    // converted bands are compressed on the writer's thread while the next ones are read and converted
+    Png::OrderedWriter writer(*sink, Stream::pendingBands);
+
+    // a band holds the raw rows and the converted rows made from them, so memory use depends on the band and not on the image
+    const double bytesPerRawRow = (double)rawWidth*sizeof(double)+(double)width*(rgb ? 4 : 2)*outputRowsPerRawRow;
+    std::uint32_t wantedRows = std::clamp<double>(Stream::bandBytes/bytesPerRawRow, 1, rawHeight);
+    auto bandRows = GetBandRows(params.startY, wantedRows, GetDecodedRows(source, properties, directory),
+                                params.scaleMode == Util::ScaleMode::Decrease ? params.scale : 1);
+
+    emit sendProgressReset("Creating the image...");
+    std::uint32_t outputRow = 0;
+    std::uint32_t bandEndY;
+    for (auto bandStartY = params.startY; bandStartY <= params.endY; bandStartY = bandEndY+1) {
+        bandEndY = std::min(bandStartY+(bandStartY == params.startY ? bandRows.first : bandRows.rest)-1, params.endY);
+        auto bandParams = params;
+        bandParams.startY = bandStartY;
+        bandParams.endY = bandEndY;
+        bool written = false;
+        {
+            // the calls below report the progress of a single band, the progress of the whole image is reported here instead
+            const QSignalBlocker blocker(this);
+            auto rawValues = GetRawImageValues(source, bandParams.startX, bandParams.endX, bandParams.startY, bandParams.endY, directory);
+            std::pair<unsigned int, unsigned int> bandWidthAndHeight = {0, 0};
+            if (rawValues && rgb) {
+                auto buf = CreateImageData_RGB(rawValues.get(), bandParams, bandWidthAndHeight, rgbTable ? &*rgbTable : nullptr);
+                written = buf && writer.put(outputRow, std::move(buf));
+            }
+            else if (rawValues) {
+                auto buf = CreateImageData_G16(rawValues.get(), bandParams, bandWidthAndHeight, g16Table ? &*g16Table : nullptr);
+                written = buf && writer.put(outputRow, std::move(buf));
+            }
+            outputRow += bandWidthAndHeight.second;
+        }
+        if (!written) {
+            Gui::ThrowError("Error creating the image.");
+            emit sendProgressError();
+            return false;
+        }
+        emit sendProgress((float)(bandParams.endY-params.startY+1)/rawHeight*100);
+    }
+    if (!writer.finish()) {
+        Gui::ThrowError("Error creating the image.");
+        emit sendProgressError();
+        return false;
+    }
+    return true;
+}
+
+bool ImageConverter::SaveXyzPyramid(TiffConvertParams params, const QString &outputDirectory, Util::OutputFormat format, Util::Compression compression, size_t &tileCount, std::uint64_t &byteCount)
+{
+    // the most detailed level has the resolution of the source, the levels above it are made from it
+    if (params.scaleMode != Util::ScaleMode::No) {
+        Gui::ThrowError("XYZ tile pyramids are made at the resolution of the image and can't be scaled.");
+        emit sendProgressError();
+        return false;
+    }
+    auto rgbTable = CreateTable_RGB(params);
+    auto g16Table = CreateTable_G16(params);
+    std::uint16_t directory;
+    auto source = GetRawValueSource(params, directory);
+    Tiff::TiffProperties properties;
+    if (!Tiff::GetProperties(source, properties, directory)) {
+        emit sendProgressError();
+        return false;
+    }
+    bool rgb = params.outputMode == Util::OutputMode::RGB_UserValues ||
+               params.outputMode == Util::OutputMode::RGB_UserRanges ||
+               params.outputMode == Util::OutputMode::RGB_Formula ||
+               params.outputMode == Util::OutputMode::RGB_Lua;
+    auto width = (params.endX-params.startX+1);
+    auto height = (params.endY-params.startY+1);
+
+    if (params.outputMode == Util::OutputMode::Grayscale16_MinToMax) {
+        emit sendProgressReset("Finding min and max values...");
+        Stats::RasterStats stats;
+        if (!GetStatistics(source, stats, params.startX, params.endX, params.startY, params.endY, directory)) return false;
+        params.minAndMax = std::pair<double,double>{stats.min, stats.max};
+    }
+
+    // only the writer of the output's pixel type is made
+    std::optional<Xyz::PyramidWriter<Png::Rgba8>> rgbWriter;
+    std::optional<Xyz::PyramidWriter<Png::Gray16>> g16Writer;
+    if (rgb) rgbWriter.emplace(outputDirectory, width, height, format, compression);
+    else g16Writer.emplace(outputDirectory, width, height, format, compression);
+
+    // the source is read once, in bands of whole strips or tiles, while the pool writes the tiles of the previous bands
+    const double bytesPerRow = (double)width*(sizeof(double)+(rgb ? 4 : 2));
+    std::uint32_t wantedRows = std::clamp<double>(Stream::bandBytes/bytesPerRow, 1, height);
+    auto bandRows = GetBandRows(params.startY, wantedRows, GetDecodedRows(source, properties, directory), 1);
+
+    emit sendProgressReset("Creating the tiles...");
+    std::uint32_t bandEndY;
+    for (auto bandStartY = params.startY; bandStartY <= params.endY; bandStartY = bandEndY+1) {
+        bandEndY = std::min(bandStartY+(bandStartY == params.startY ? bandRows.first : bandRows.rest)-1, params.endY);
+        auto bandParams = params;
+        bandParams.startY = bandStartY;
+        bandParams.endY = bandEndY;
+        bool written = false;
+        {
+            const QSignalBlocker blocker(this);
+            auto rawValues = GetRawImageValues(source, bandParams.startX, bandParams.endX, bandParams.startY, bandParams.endY, directory);
+            std::pair<unsigned int, unsigned int> bandWidthAndHeight = {0, 0};
+            if (rawValues && rgb) {
+                auto buf = CreateImageData_RGB(rawValues.get(), bandParams, bandWidthAndHeight, rgbTable ? &*rgbTable : nullptr);
+                written = buf && rgbWriter->put(buf);
+            }
+            else if (rawValues) {
+                auto buf = CreateImageData_G16(rawValues.get(), bandParams, bandWidthAndHeight, g16Table ? &*g16Table : nullptr);
+                written = buf && g16Writer->put(buf);
+            }
+        }
+        if (!written) {
+            Gui::ThrowError("Error creating the tiles.");
+            emit sendProgressError();
+            return false;
+        }
+        emit sendProgress((float)(bandParams.endY-params.startY+1)/height*100);
+    }
+    emit sendProgressReset("Writing the remaining tiles...");
+    if (rgb ? !rgbWriter->finish() : !g16Writer->finish()) {
+        Gui::ThrowError("Error creating the tiles.");
+        emit sendProgressError();
+        return false;
+    }
+    tileCount = rgb ? rgbWriter->tileCount() : g16Writer->tileCount();
+    byteCount = rgb ? rgbWriter->byteCount() : g16Writer->byteCount();
+    return true;
+}
@@ -1,8 +1,12 @@
 #ifndef IMAGECONVERTER_H
 #define IMAGECONVERTER_H
 
+#include "colorlookup.h"
 #include "conversionparameters.h"
+#include "imagebuffer.h"
+#include "luafunctions.h"
 #include "shapes.h"
+#include "statsfunctions.h"
 #include "sol/sol.hpp"
 
 #include <CImg.h>
@@ -21,26 +25,36 @@ signals:
     void sendProgressError();
 public:
     ImageConverter() = default;
+    void setTileCache(Tiff::TileCache* cache);
+    // what the cache of a pure Lua script found, over every image this converter created
+    std::pair<size_t,size_t> GetLuaCacheHitsAndMisses() const { return {luaCacheHits, luaCacheMisses}; }
 
     bool GetMinAndMaxValues(const QString& path, double &min, double &max, int startX = 0, int endX = -1, int startY = 0, int endY = -1);
-    std::set<double> GetDistinctValues(const QString& path);
-    std::unique_ptr<double[]> GetRawImageValues(const QString& path, int startX, int endX, int startY, int endY);
-    std::unique_ptr<unsigned short[]> CreateImageData_G16(double* rawValues, const TiffConvertParams& params, std::pair<unsigned int,unsigned int>& outWidthAndHeight);
-    std::unique_ptr<unsigned char[]> CreateImageData_RGB(double* rawValues, const TiffConvertParams& params, std::pair<unsigned int,unsigned int>& outWidthAndHeight);
+    bool GetStatistics(const QString& path, Stats::RasterStats& stats, int startX = 0, int endX = -1, int startY = 0, int endY = -1, std::uint16_t directory = 0);
+    std::set<double> GetDistinctValues(const QString& path, size_t maxCount, bool& tooManyValues);
+    std::unique_ptr<double[]> GetRawImageValues(const QString& path, int startX, int endX, int startY, int endY, std::uint16_t directory = 0);
+    QString GetRawValueSource(TiffConvertParams& params, std::uint16_t& directory, bool buildPyramid = false);
+    std::unique_ptr<double[]> GetRawImageValues(TiffConvertParams& params);
+    bool SaveImageStreamed(TiffConvertParams params, const QString& path, Util::OutputFormat format, Util::Compression compression); // pass by value
+    bool SaveXyzPyramid(TiffConvertParams params, const QString& outputDirectory, Util::OutputFormat format, Util::Compression compression, size_t& tileCount, std::uint64_t& byteCount); // pass by value
+    std::optional<Lookup::DenseTable<uint16_t>> CreateTable_G16(const TiffConvertParams& params);
+    std::optional<Lookup::DenseTable<color>> CreateTable_RGB(const TiffConvertParams& params);
+    Png::Gray16 CreateImageData_G16(double* rawValues, const TiffConvertParams& params, std::pair<unsigned int,unsigned int>& outWidthAndHeight, const Lookup::DenseTable<uint16_t>* table = nullptr);
+    Png::Rgba8 CreateImageData_RGB(double* rawValues, const TiffConvertParams& params, std::pair<unsigned int,unsigned int>& outWidthAndHeight, const Lookup::DenseTable<color>* table = nullptr);
 
-    std::unique_ptr<uint16_t[]> CreateG16_TrueValue(const QString& path, double offset, int startX, int startY, int endX, int endY);
-    std::unique_ptr<uint16_t[]> CreateG16_MinToMax(const QString &path, const std::pair<double,double>& minAndMax, int startX, int startY, int endX, int endY);
-    std::unique_ptr<uint8_t[]> CreateRGB_UserValues(const QString& path, const std::map<double,color>& colorValues, int startX, int startY, int endX, int endY);
-    std::unique_ptr<uint8_t[]> CreateRGB_UserRanges(const QString& path, const std::map<double,color>& colorValues, bool useGradient, int startX, int startY, int endX, int endY);
-    std::unique_ptr<uint8_t[]> CreateRGB_Formula(const QString& path, int startX, int startY, int endX, int endY);
-    std::unique_ptr<uint8_t[]> CreateRGB_Points(const CsvConvertParams& params);
-    std::unique_ptr<uint8_t[]> CreateRGB_Points(const NewCsvConvertParams &params);
+    Png::Gray16 CreateG16_TrueValue(const QString& path, double offset, int startX, int startY, int endX, int endY);
+    Png::Gray16 CreateG16_MinToMax(const QString &path, const std::pair<double,double>& minAndMax, int startX, int startY, int endX, int endY);
+    Png::Rgba8 CreateRGB_UserValues(const QString& path, const std::map<double,color>& colorValues, int startX, int startY, int endX, int endY);
+    Png::Rgba8 CreateRGB_UserRanges(const QString& path, const std::map<double,color>& colorValues, bool useGradient, int startX, int startY, int endX, int endY);
+    Png::Rgba8 CreateRGB_Formula(const QString& path, int startX, int startY, int endX, int endY);
+    Png::Rgba8 CreateRGB_Points(const CsvConvertParams& params);
+    Png::Rgba8 CreateRGB_Points(const NewCsvConvertParams &params);
     cimg_library::CImg<uint8_t> CreateRGB_VectorShapes(GeoJsonConvertParams params, bool flipY = true); // pass by value
     cimg_library::CImg<uint8_t> CreateRGB_VectorShapes(NewGeoJsonConvertParams params, bool flipY = true); // pass by value
     cimg_library::CImg<uint8_t> CreateRGB_GeoPackage(GeoPackageConvertParams params, bool flipY = true); // pass by value
     cimg_library::CImg<uint8_t> CreateRGB_GeoPackage(NewGeoPackageConvertParams params, bool flipY = true); // pass by value
-    std::unique_ptr<uint16_t[]> CreateG16_Lua(const QString& path, const std::string& script, int startX, int startY, int endX, int endY);
-    std::unique_ptr<uint8_t[]> CreateRGB_Lua(const QString& path, const std::string& script, int startX, int startY, int endX, int endY);
+    Png::Gray16 CreateG16_Lua(const QString& path, const std::string& script, int startX, int startY, int endX, int endY);
+    Png::Rgba8 CreateRGB_Lua(const QString& path, const std::string& script, int startX, int startY, int endX, int endY);
 
     std::vector<std::unique_ptr<Shape::Shape>> getAllShapesFromJson(const QString& path, std::optional<Util::Boundaries>& boundaries, std::vector<QJsonObject>& outputProperties);
     std::vector<std::unique_ptr<Shape::Shape>> getAllShapesFromLayer(const QString& path, std::string layerName, GeoPackageConvertParams& params, std::vector<color>& outputColors, boolean calculateBoundaries);
@@ -55,16 +69,21 @@ public:
     static int getStyleForCsvShape(const std::vector<std::string>& csvRow, const CsvConvertParams& params);
     static uint16_t transformCellToG16TrueValue (double cell, double offset);
     static uint16_t transformCellToG16MinToMax (double cell, const std::pair<double,double>& minAndMax);
-    static uint16_t transformCellToG16Lua(double cell, const std::string& script);
     static color transformCellToRGBUserValues(double cell, const std::map<double,color>& colorValues);
-    static color transformCellToRGBUserRanges(double cell, const std::map<double,color>& colorValues, bool useGradient);
     static color transformCellToRGBFormula(double cell);
-    static color transformCellToRGBLua(double cell, const std::string& script);
+    static color transformCellToRGB(double cell, const TiffConvertParams& params, const std::optional<Lookup::RangeTable>& ranges, Lua::Converter* lua);
     static void writeJsonValueToLuaParams(const QJsonValue& jsonValue, const QString& name, sol::table& luaTable);
     static void writeJsonValueToLuaParams(const QJsonValue& jsonValue, const uint32_t index, sol::table& luaTable);
     static void writeJsonObjectToLuaParams(const QJsonObject& jsonObj, sol::table& luaTable);
 
+private:
+    Tiff::ReadOptions readOptions(std::uint16_t directory = 0) const;
+    template <typename F>
+    Png::Rgba8 CreateRGB_Mapped(const QString& path, const F& transform, int startX, int startY, int endX, int endY);
 
+    // reads aren't cached unless a cache is set, previews set the session one
+    Tiff::TileCache* tileCache = nullptr;
+    size_t luaCacheHits = 0, luaCacheMisses = 0;
 };
 
 #endif // IMAGECONVERTER_H
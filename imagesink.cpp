@@ -0,0 +1,270 @@
+#include "imagesink.h"
+#include <cstring>
+
+Png::OrderedWriter::OrderedWriter(ImageSink &sink, size_t maxPending) : sink(sink), maxPending(maxPending), writer(&OrderedWriter::run, this)
+{
+}
+
+Png::OrderedWriter::~OrderedWriter()
+{
+    if (!writer.joinable()) return;
+    {
+        // abandoned without finish(), whatever is still pending is dropped
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = true;
+    }
+    changed.notify_all();
+    writer.join();
+}
+
+bool Png::OrderedWriter::put(std::uint32_t firstRow, Rgba8 band)
+{
+    return push(firstRow, std::move(band));
+}
+
+bool Png::OrderedWriter::put(std::uint32_t firstRow, Gray16 band)
+{
+    return push(firstRow, std::move(band));
+}
+
+bool Png::OrderedWriter::finish()
+{
+    if (!writer.joinable()) return false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    changed.notify_all();
+    writer.join();
+    return !failed && sink.finish();
+}
+
+bool Png::OrderedWriter::push(std::uint32_t firstRow, Band_t band)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // the band the writer waits for is always let in, so a full queue can't stall it
+    changed.wait(lock, [this, firstRow]() { return failed || pending.size() < maxPending || firstRow == nextRow; });
+    if (failed || closing || firstRow < nextRow) return false;
+    pending.emplace(firstRow, std::move(band));
+    lock.unlock();
+    changed.notify_all();
+    return true;
+}
+
+void Png::OrderedWriter::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        changed.wait(lock, [this]() { return failed || closing || (!pending.empty() && pending.begin()->first == nextRow); });
+        if (failed) return;
+        if (pending.empty() || pending.begin()->first != nextRow) {
+            // closing with rows missing
+            if (!pending.empty()) failed = true;
+            return;
+        }
+        auto band = std::move(pending.begin()->second);
+        pending.erase(pending.begin());
+        lock.unlock();
+        changed.notify_all();
+        std::uint32_t rows = 0;
+        bool written = std::visit([this, &rows](const auto& buffer) {
+            rows = buffer.height();
+            return sink.writeRows(buffer.data(), buffer.height());
+        }, band);
+        lock.lock();
+        nextRow += rows;
+        if (!written) failed = true;
+        changed.notify_all();
+    }
+}
+
+namespace {
+bool LittleEndianHost()
+{
+    const std::uint16_t probe = 1;
+    return *reinterpret_cast<const std::uint8_t*>(&probe) == 1;
+}
+
+void PutBigEndian(std::vector<std::uint8_t>& out, std::uint32_t value)
+{
+    out.insert(out.end(), { static_cast<std::uint8_t>(value >> 24), static_cast<std::uint8_t>(value >> 16), static_cast<std::uint8_t>(value >> 8), static_cast<std::uint8_t>(value) });
+}
+}
+
+Png::RawSink::RawSink(const std::string &path, std::uint32_t width, std::uint32_t height, unsigned int channels, unsigned int bitsPerSample)
+    : width(width), height(height), rowBytes((size_t)width*channels*bitsPerSample/8), rgba(channels == 4)
+{
+    file = std::fopen(path.data(), "wb");
+    if (!file) return;
+    // the offset is part of the header, so it's grown until the header fits in front of it
+    std::string header;
+    size_t offset = 0;
+    while (true) {
+        header = "{\"width\":"+std::to_string(width)+",\"height\":"+std::to_string(height)+",\"channels\":"+std::to_string(channels)+
+                 ",\"bitsPerSample\":"+std::to_string(bitsPerSample)+",\"byteOrder\":\""+(LittleEndianHost() ? "little" : "big")+
+                 "\",\"dataOffset\":"+std::to_string(offset)+"}";
+        const size_t padded = (header.size()+1+63)/64*64;
+        if (padded == offset) break;
+        offset = padded;
+    }
+    header.append(offset-header.size()-1, ' ');
+    header.push_back('\n');
+    failed = std::fwrite(header.data(), 1, header.size(), file) != header.size();
+}
+
+Png::RawSink::~RawSink()
+{
+    if (file) std::fclose(file);
+}
+
+bool Png::RawSink::writeRows(const std::uint8_t *rgba, std::uint32_t rows)
+{
+    if (!this->rgba) return false;
+    return write(rgba, rows);
+}
+
+bool Png::RawSink::writeRows(const std::uint16_t *gray, std::uint32_t rows)
+{
+    if (rgba) return false;
+    return write(gray, rows);
+}
+
+bool Png::RawSink::finish()
+{
+    if (!isOpen() || rowsWritten != height) return false;
+    return std::fflush(file) == 0;
+}
+
+bool Png::RawSink::write(const void *samples, std::uint32_t rows)
+{
+    if (!isOpen() || rowsWritten+rows > height) return false;
+    const size_t size = rowBytes*rows;
+    if (std::fwrite(samples, 1, size, file) != size) {
+        failed = true;
+        return false;
+    }
+    rowsWritten += rows;
+    return true;
+}
+
+Png::QoiSink::QoiSink(const std::string &path, std::uint32_t width, std::uint32_t height) : width(width), height(height)
+{
+    file = std::fopen(path.data(), "wb");
+    if (!file) return;
+    // rgba, srgb with linear alpha
+    encoded = { 'q', 'o', 'i', 'f' };
+    PutBigEndian(encoded, width);
+    PutBigEndian(encoded, height);
+    encoded.insert(encoded.end(), { 4, 0 });
+    failed = std::fwrite(encoded.data(), 1, encoded.size(), file) != encoded.size();
+}
+
+Png::QoiSink::~QoiSink()
+{
+    if (file) std::fclose(file);
+}
+
+bool Png::QoiSink::writeRows(const std::uint8_t *rgba, std::uint32_t rows)
+{
+    if (!isOpen() || rowsWritten+rows > height) return false;
+    const size_t count = (size_t)width*rows;
+    const bool lastRows = rowsWritten+rows == height;
+    // the longest op is 5 bytes
+    encoded.clear();
+    encoded.reserve(count*5);
+    for (size_t i = 0; i < count; ++i) {
+        Pixel_t pixel;
+        std::memcpy(pixel.data(), rgba+i*4, 4);
+        if (pixel == previous) {
+            ++run;
+            if (run == 62 || (lastRows && i+1 == count)) {
+                encoded.push_back(0xc0 | (run-1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            encoded.push_back(0xc0 | (run-1));
+            run = 0;
+        }
+        const unsigned int hash = (pixel[0]*3+pixel[1]*5+pixel[2]*7+pixel[3]*11) % 64;
+        if (seen[hash] == pixel) {
+            encoded.push_back(hash);
+        }
+        else {
+            seen[hash] = pixel;
+            if (pixel[3] == previous[3]) {
+                const int dr = static_cast<std::int8_t>(pixel[0]-previous[0]);
+                const int dg = static_cast<std::int8_t>(pixel[1]-previous[1]);
+                const int db = static_cast<std::int8_t>(pixel[2]-previous[2]);
+                const int drg = dr-dg, dbg = db-dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    encoded.push_back(0x40 | (dr+2) << 4 | (dg+2) << 2 | (db+2));
+                }
+                else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                    encoded.push_back(0x80 | (dg+32));
+                    encoded.push_back((drg+8) << 4 | (dbg+8));
+                }
+                else {
+                    encoded.insert(encoded.end(), { 0xfe, pixel[0], pixel[1], pixel[2] });
+                }
+            }
+            else {
+                encoded.insert(encoded.end(), { 0xff, pixel[0], pixel[1], pixel[2], pixel[3] });
+            }
+        }
+        previous = pixel;
+    }
+    if (std::fwrite(encoded.data(), 1, encoded.size(), file) != encoded.size()) {
+        failed = true;
+        return false;
+    }
+    rowsWritten += rows;
+    return true;
+}
+
+bool Png::QoiSink::finish()
+{
+    if (!isOpen() || rowsWritten != height) return false;
+    if (finished) return true;
+    static const std::uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    finished = true;
+    return std::fwrite(end, 1, sizeof(end), file) == sizeof(end) && std::fflush(file) == 0;
+}
+
+Png::PgmSink::PgmSink(const std::string &path, std::uint32_t width, std::uint32_t height) : width(width), height(height)
+{
+    file = std::fopen(path.data(), "wb");
+    if (!file) return;
+    const std::string header = "P5\n"+std::to_string(width)+" "+std::to_string(height)+"\n65535\n";
+    failed = std::fwrite(header.data(), 1, header.size(), file) != header.size();
+}
+
+Png::PgmSink::~PgmSink()
+{
+    if (file) std::fclose(file);
+}
+
+bool Png::PgmSink::writeRows(const std::uint16_t *gray, std::uint32_t rows)
+{
+    if (!isOpen() || rowsWritten+rows > height) return false;
+    // pgm samples are big endian
+    const size_t count = (size_t)width*rows;
+    swapped.resize(count*2);
+    for (size_t i = 0; i < count; ++i) {
+        swapped[i*2] = gray[i] >> 8;
+        swapped[i*2+1] = gray[i] & 0xff;
+    }
+    if (std::fwrite(swapped.data(), 1, swapped.size(), file) != swapped.size()) {
+        failed = true;
+        return false;
+    }
+    rowsWritten += rows;
+    return true;
+}
+
+bool Png::PgmSink::finish()
+{
+    if (!isOpen() || rowsWritten != height) return false;
+    return std::fflush(file) == 0;
+}
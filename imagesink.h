@@ -0,0 +1,133 @@
+#ifndef IMAGESINK_H
+#define IMAGESINK_H
+
+#include "imagebuffer.h"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+namespace Png {
+// a file that an image is written to from the top, a few rows at a time, so that the whole image never has to be in memory.
+// rows come in the interleaved layout of ImageBuffer
+class ImageSink {
+public:
+    virtual ~ImageSink() = default;
+
+    virtual bool isOpen() const = 0;
+    virtual bool writeRows(const std::uint8_t* rgba, std::uint32_t rows) = 0;
+    virtual bool writeRows(const std::uint16_t* gray, std::uint32_t rows) = 0;
+    virtual bool finish() = 0;
+};
+
+// the samples as they are in memory, after a line of json that gives the width, height, channels, bits per sample,
+// byte order and the offset of the data. the line is padded with spaces so that the data starts on 64 bytes
+class RawSink : public ImageSink {
+public:
+    RawSink(const std::string& path, std::uint32_t width, std::uint32_t height, unsigned int channels, unsigned int bitsPerSample);
+    ~RawSink() override;
+    RawSink(const RawSink&) = delete;
+    RawSink& operator=(const RawSink&) = delete;
+
+    bool isOpen() const override { return file != nullptr && !failed; }
+    bool writeRows(const std::uint8_t* rgba, std::uint32_t rows) override;
+    bool writeRows(const std::uint16_t* gray, std::uint32_t rows) override;
+    bool finish() override;
+
+private:
+    bool write(const void* samples, std::uint32_t rows);
+
+    std::FILE* file = nullptr;
+    std::uint32_t width, height, rowsWritten = 0;
+    size_t rowBytes;
+    bool rgba;
+    bool failed = false;
+};
+
+// qoi, lossless rgba that's encoded and decoded in a single pass without entropy coding. 8-bit rgba only
+class QoiSink : public ImageSink {
+public:
+    QoiSink(const std::string& path, std::uint32_t width, std::uint32_t height);
+    ~QoiSink() override;
+    QoiSink(const QoiSink&) = delete;
+    QoiSink& operator=(const QoiSink&) = delete;
+
+    bool isOpen() const override { return file != nullptr && !failed; }
+    bool writeRows(const std::uint8_t* rgba, std::uint32_t rows) override;
+    bool writeRows(const std::uint16_t*, std::uint32_t) override { return false; }
+    bool finish() override;
+
+private:
+    using Pixel_t = std::array<std::uint8_t,4>;
+
+    std::FILE* file = nullptr;
+    std::uint32_t width, height, rowsWritten = 0;
+    // the encoder state carries over from one call to the next
+    std::array<Pixel_t,64> seen{};
+    Pixel_t previous{0, 0, 0, 255};
+    unsigned int run = 0;
+    std::vector<std::uint8_t> encoded;
+    bool failed = false;
+    bool finished = false;
+};
+
+// binary pgm with a maximum of 65535, for the 16-bit grayscale modes only
+class PgmSink : public ImageSink {
+public:
+    PgmSink(const std::string& path, std::uint32_t width, std::uint32_t height);
+    ~PgmSink() override;
+    PgmSink(const PgmSink&) = delete;
+    PgmSink& operator=(const PgmSink&) = delete;
+
+    bool isOpen() const override { return file != nullptr && !failed; }
+    bool writeRows(const std::uint8_t*, std::uint32_t) override { return false; }
+    bool writeRows(const std::uint16_t* gray, std::uint32_t rows) override;
+    bool finish() override;
+
+private:
+    std::FILE* file = nullptr;
+    std::uint32_t width, height, rowsWritten = 0;
+    std::vector<std::uint8_t> swapped;
+    bool failed = false;
+};
+
+// takes bands of rows from any thread and in any order, and writes them to a sink in order on a thread of its own,
+// so that the sink's encoding overlaps the conversion of the next bands. only bands that arrive ahead of
+// their turn are kept, and once maxPending of them are waiting, put() blocks until the writer catches up
+class OrderedWriter {
+public:
+    OrderedWriter(ImageSink& sink, size_t maxPending);
+    ~OrderedWriter();
+    OrderedWriter(const OrderedWriter&) = delete;
+    OrderedWriter& operator=(const OrderedWriter&) = delete;
+
+    // false once anything failed to be written, the band is then dropped
+    bool put(std::uint32_t firstRow, Rgba8 band);
+    bool put(std::uint32_t firstRow, Gray16 band);
+    // waits for the pending bands and finishes the sink
+    bool finish();
+
+private:
+    using Band_t = std::variant<Rgba8, Gray16>;
+
+    bool push(std::uint32_t firstRow, Band_t band);
+    void run();
+
+    ImageSink& sink;
+    size_t maxPending;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<std::uint32_t, Band_t> pending;
+    std::uint32_t nextRow = 0;
+    bool closing = false;
+    bool failed = false;
+    std::thread writer;
+};
+}
+
+#endif // IMAGESINK_H
@@ -1,4 +1,5 @@
 #include "luacodewindow.h"
+#include "luafunctions.h"
 #include "qtfunctions.h"
 #include "ui_luacodewindow.h"
 #include "sol/sol.hpp"
@@ -9,17 +10,18 @@ LuaCodeWindow::LuaCodeWindow(Util::OutputMode outputMode, const std::string& scr
 {
     ui->setupUi(this);
     setWindowTitle("Lua Code Window");
+    ui->checkBox_batched->setChecked(script.rfind("function set_colors(", 0) == 0);
     initFunction();
     if (script.empty()) return;
     try {
         size_t beginIndex, substrSize;
         switch(outputMode) {
             case Util::OutputMode::Grayscale16_Lua:
-            beginIndex = G16LuaHeaderSize + 1;
+            beginIndex = (isBatched() ? G16BatchLuaHeaderSize : G16LuaHeaderSize) + 1;
             substrSize = script.size() - G16LuaFooterSize - beginIndex - 1;
             break;
             case Util::OutputMode::RGB_Lua:
-            beginIndex = RGBLuaHeaderSize + 1;
+            beginIndex = (isBatched() ? RGBBatchLuaHeaderSize : RGBLuaHeaderSize) + 1;
             substrSize = script.size() - RGBLuaFooterSize - beginIndex - 1;
             break;
             case Util::OutputMode::RGB_Points:
@@ -54,9 +56,15 @@ void LuaCodeWindow::on_pushButton_check_clicked()
 }
 
 
+void LuaCodeWindow::setPure(bool pure)
+{
+    ui->checkBox_pure->setChecked(pure);
+}
+
 void LuaCodeWindow::on_pushButton_ok_clicked()
 {
     if (!verifyCode()) return;
+    emit sendPure(ui->checkBox_pure->isChecked());
     emit sendCode(createCode());
     close();
 }
@@ -68,13 +76,20 @@ void LuaCodeWindow::on_pushButton_cancel_clicked()
 
 void LuaCodeWindow::initFunction()
 {
+    // only a raster's cells are converted often enough with the same value for caching to pay off,
+    // and only they come in rows
+    bool raster = functionType == Util::OutputMode::RGB_Lua || functionType == Util::OutputMode::Grayscale16_Lua;
+    ui->checkBox_pure->setVisible(raster);
+    ui->checkBox_batched->setVisible(raster);
+    // a batched script is called once per row, so there is nothing to cache per cell
+    ui->checkBox_pure->setEnabled(!isBatched());
     switch(functionType) {
         case Util::OutputMode::RGB_Lua :
-        ui->label_functionHeader->setText(QString::fromStdString(RGBLuaHeader));
+        ui->label_functionHeader->setText(QString::fromStdString(isBatched() ? RGBBatchLuaHeader : RGBLuaHeader));
         ui->label_functionFooter->setText(QString::fromStdString(RGBLuaFooter));
         break;
         case Util::OutputMode::Grayscale16_Lua :
-        ui->label_functionHeader->setText(QString::fromStdString(G16LuaHeader));
+        ui->label_functionHeader->setText(QString::fromStdString(isBatched() ? G16BatchLuaHeader : G16LuaHeader));
         ui->label_functionFooter->setText(QString::fromStdString(G16LuaFooter));
         break;
         case Util::OutputMode::RGB_Points :
@@ -92,6 +107,11 @@ void LuaCodeWindow::initFunction()
     }
 }
 
+bool LuaCodeWindow::isBatched() const
+{
+    return !ui->checkBox_batched->isHidden() && ui->checkBox_batched->isChecked();
+}
+
 std::string LuaCodeWindow::createCode()
 {
     return (ui->label_functionHeader->text() + "\n" + ui->textEdit_code->toPlainText() + "\n" + ui->label_functionFooter->text()).toStdString();
@@ -101,15 +121,25 @@ bool LuaCodeWindow::verifyCode()
 {
     auto code = createCode();
     sol::state lua;
-    lua.open_libraries(sol::lib::base, sol::lib::table);
+    Lua::OpenLibraries(lua);
     try {
+#ifdef USE_LUAJIT
+        auto unsupported = Lua::FindUnsupportedSyntax(code);
+        if (!unsupported.empty()) {
+            std::string message = "LuaJIT does not support these Lua 5.3 features:";
+            for (const auto& item : unsupported) message += "\n" + item;
+            throw sol::error(message);
+        }
+#endif
         auto result = lua.script(code);
         if (result.valid()) {
-            sol::function fx = lua["set_color"];
+            sol::function fx = lua[isBatched() ? "set_colors" : "set_color"];
             if (!fx.valid()) {
                 throw sol::error("invalid function");
             }
-            Gui::PrintMessage("OK", "Valid code");
+            bool raster = functionType == Util::OutputMode::RGB_Lua || functionType == Util::OutputMode::Grayscale16_Lua;
+            if (raster && !isBatched() && Lua::Expression::Compile(code)) Gui::PrintMessage("OK", "Valid code, compiled without the Lua interpreter");
+            else Gui::PrintMessage("OK", "Valid code");
         }
         else {
             throw sol::error("invalid function");
@@ -125,6 +155,12 @@ bool LuaCodeWindow::verifyCode()
 void LuaCodeWindow::on_pushButton_preview_clicked()
 {
     if (!verifyCode()) return;
+    emit sendPure(ui->checkBox_pure->isChecked());
     emit sendPreviewRequest(createCode());
 }
 
+void LuaCodeWindow::on_checkBox_batched_toggled(bool checked)
+{
+    initFunction();
+}
+
@@ -16,9 +16,11 @@ public:
     Util::OutputMode functionType;
     explicit LuaCodeWindow(Util::OutputMode outputMode, const std::string& script, QWidget* parent = nullptr);
     ~LuaCodeWindow();
+    void setPure(bool pure);
 
 signals:
     void sendCode(const std::string& code);
+    void sendPure(bool pure);
     void sendPreviewRequest(const std::string& code);
 
 private slots:
@@ -31,10 +33,13 @@ private slots:
 
     void on_pushButton_preview_clicked();
 
+    void on_checkBox_batched_toggled(bool checked);
+
 private:
     Ui::LuaCodeWindow *ui;
 
     void initFunction();
+    bool isBatched() const;
     std::string createCode();
     bool verifyCode();
 
@@ -46,6 +51,14 @@ private:
                                      "\t--output pixel will get the value stored in color[\"value\"]\n"
                                      "\t--input pixel's value is stored in params[\"val\"]";
     const size_t G16LuaHeaderSize = G16LuaHeader.size();
+    const std::string RGBBatchLuaHeader = "function set_colors(values, out)\n"
+                                          "\t--values[i] holds the value of the i-th input pixel of a row, for i from 1 to #values\n"
+                                          "\t--output pixel i will get the values stored in out.r[i], out.g[i], out.b[i] and out.a[i]";
+    const size_t RGBBatchLuaHeaderSize = RGBBatchLuaHeader.size();
+    const std::string G16BatchLuaHeader = "function set_colors(values, out)\n"
+                                          "\t--values[i] holds the value of the i-th input pixel of a row, for i from 1 to #values\n"
+                                          "\t--output pixel i will get the value stored in out[i]";
+    const size_t G16BatchLuaHeaderSize = G16BatchLuaHeader.size();
     const std::string RGBLuaFooter = "end";
     const size_t RGBLuaFooterSize = RGBLuaFooter.size();
     const std::string G16LuaFooter = "end";
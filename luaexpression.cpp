@@ -0,0 +1,504 @@
+#include "luaexpression.h"
+#include "consts.h"
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+
+namespace {
+using Op = Lua::Expression::Op;
+using Instruction = Lua::Expression::Instruction;
+
+// thrown by the compiler at anything outside the subset
+struct Unsupported {};
+
+struct Token {
+    enum class Kind { Name, Number, Symbol, End } kind;
+    std::string text;
+    double number = 0;
+};
+
+std::vector<Token> Tokenize(const std::string& script)
+{
+    std::vector<Token> rv;
+    size_t i = 0;
+    auto longBracket = [&script](size_t i) {
+        if (i >= script.size() || script[i] != '[') return -1;
+        size_t j = i+1;
+        while (j < script.size() && script[j] == '=') ++j;
+        return j < script.size() && script[j] == '[' ? (int)(j-i-1) : -1;
+    };
+    while (i < script.size()) {
+        char c = script[i];
+        char next = i+1 < script.size() ? script[i+1] : 0;
+        if (std::isspace((unsigned char)c)) ++i;
+        else if (c == '-' && next == '-') {
+            i += 2;
+            int level = longBracket(i);
+            if (level >= 0) {
+                auto end = script.find("]" + std::string(level, '=') + "]", i);
+                if (end == std::string::npos) throw Unsupported();
+                i = end+level+2;
+            }
+            else while (i < script.size() && script[i] != '\n') ++i;
+        }
+        else if (std::isalpha((unsigned char)c) || c == '_') {
+            size_t begin = i;
+            while (i < script.size() && (std::isalnum((unsigned char)script[i]) || script[i] == '_')) ++i;
+            rv.push_back({Token::Kind::Name, script.substr(begin, i-begin)});
+        }
+        else if (std::isdigit((unsigned char)c) || (c == '.' && std::isdigit((unsigned char)next))) {
+            size_t begin = i;
+            while (i < script.size() && (std::isalnum((unsigned char)script[i]) || script[i] == '.' ||
+                   ((script[i] == '-' || script[i] == '+') && std::strchr("eEpP", script[i-1])))) ++i;
+            std::string text = script.substr(begin, i-begin);
+            char* end;
+            double number = std::strtod(text.c_str(), &end);
+            if (*end) throw Unsupported();
+            rv.push_back({Token::Kind::Number, text, number});
+        }
+        else {
+            static const char* symbols[] = {"==", "~=", "<=", ">=", "<", ">", "=", "+", "-", "*", "/", "%", "^", "(", ")", ",", ".", ";"};
+            std::string symbol;
+            for (auto s : symbols) {
+                if (script.compare(i, std::strlen(s), s) == 0) {
+                    symbol = s;
+                    break;
+                }
+            }
+            // strings, tables, concatenation, lengths and 5.3 operators are left to the interpreter
+            if (symbol.empty() || script.compare(i, 2, "..") == 0 || script.compare(i, 2, "//") == 0) throw Unsupported();
+            rv.push_back({Token::Kind::Symbol, symbol});
+            i += symbol.size();
+        }
+    }
+    rv.push_back({Token::Kind::End, ""});
+    return rv;
+}
+
+// what an expression evaluates to. Lua's a and b or c works on any values, the subset follows it for
+// numbers and booleans, with MaybeNumber for the "false or a number" in between
+struct Value {
+    enum class Type { Number, Bool, MaybeNumber } type;
+    int reg;
+    // for MaybeNumber, whether it holds the number
+    int flag = -1;
+};
+
+class Compiler {
+public:
+    Compiler(const std::vector<Token>& tokens, std::vector<Instruction>& program, int& registerCount) :
+        tokens(tokens), program(program), registerCount(registerCount) {}
+
+    void script() {
+        expectName("function");
+        expectName("set_color");
+        expectSymbol("(");
+        expectSymbol(")");
+        scopes.emplace_back();
+        block(-1);
+        expectName("end");
+        if (peek().kind != Token::Kind::End) throw Unsupported();
+    }
+
+private:
+    struct Local {
+        int reg;
+        Value::Type type;
+    };
+
+    const Token& peek() const { return tokens[position]; }
+    bool isName(const char* name) const { return peek().kind == Token::Kind::Name && peek().text == name; }
+    bool isSymbol(const char* symbol) const { return peek().kind == Token::Kind::Symbol && peek().text == symbol; }
+    void expectName(const char* name) {
+        if (!isName(name)) throw Unsupported();
+        ++position;
+    }
+    void expectSymbol(const char* symbol) {
+        if (!isSymbol(symbol)) throw Unsupported();
+        ++position;
+    }
+    std::string name() {
+        static const char* keywords[] = {"and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto",
+                                         "if", "in", "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while"};
+        if (peek().kind != Token::Kind::Name) throw Unsupported();
+        for (auto keyword : keywords) if (peek().text == keyword) throw Unsupported();
+        return tokens[position++].text;
+    }
+
+    int newRegister() {
+        if (registerCount >= (int)LuaExpression::maxRegisters) throw Unsupported();
+        return registerCount++;
+    }
+    int emit(Op op, int a = -1, int b = -1, int c = -1, double constant = 0) {
+        int dst = newRegister();
+        program.push_back({op, dst, a, b, c, constant});
+        return dst;
+    }
+    // masks are bool registers, -1 stands for every cell
+    int maskAnd(int mask, int condition) { return mask < 0 ? condition : emit(Op::And, mask, condition); }
+    void assign(int dst, int src, int mask) {
+        if (mask < 0) program.push_back({Op::Copy, dst, src, -1, -1, 0});
+        else program.push_back({Op::Select, dst, mask, src, dst, 0});
+    }
+    int condition(const Value& value) {
+        switch(value.type) {
+            case Value::Type::Bool: return value.reg;
+            case Value::Type::MaybeNumber: return value.flag;
+            default: return emit(Op::Const, -1, -1, -1, 1);
+        }
+    }
+
+    bool blockEnds() const { return isName("end") || isName("else") || isName("elseif") || peek().kind == Token::Kind::End; }
+
+    // returns the cells that hit a return in the block, or -1 if none did
+    int block(int mask) {
+        int returned = -1;
+        while (!blockEnds()) {
+            if (isSymbol(";")) {
+                ++position;
+                continue;
+            }
+            if (isName("return")) {
+                ++position;
+                if (isSymbol(";")) ++position;
+                // a return has to be the last statement of its block, and returns nothing to the caller
+                if (!blockEnds()) throw Unsupported();
+                int hit = mask < 0 ? emit(Op::Const, -1, -1, -1, 1) : mask;
+                return returned < 0 ? hit : emit(Op::Or, returned, hit);
+            }
+            int hit = statement(mask);
+            if (hit >= 0) {
+                // the cells that returned skip the rest of the function
+                mask = maskAnd(mask, emit(Op::Not, hit));
+                returned = returned < 0 ? hit : emit(Op::Or, returned, hit);
+            }
+        }
+        return returned;
+    }
+
+    int statement(int mask) {
+        if (isName("local")) {
+            ++position;
+            auto localName = name();
+            expectSymbol("=");
+            auto value = expression();
+            if (value.type == Value::Type::MaybeNumber) throw Unsupported();
+            int reg = newRegister();
+            program.push_back({Op::Copy, reg, value.reg, -1, -1, 0});
+            scopes.back()[localName] = {reg, value.type};
+            return -1;
+        }
+        if (isName("if")) return ifStatement(mask);
+        auto target = name();
+        if (target == "color" && !findLocal(target)) {
+            expectSymbol(".");
+            static const std::map<std::string, int> fields = {{"r", 0}, {"g", 1}, {"b", 2}, {"a", 3}, {"value", 4}};
+            auto field = fields.find(name());
+            if (field == fields.end()) throw Unsupported();
+            expectSymbol("=");
+            auto value = expression();
+            if (value.type != Value::Type::Number) throw Unsupported();
+            assign(field->second, value.reg, mask);
+            return -1;
+        }
+        // globals outlive the call, so only locals can be assigned
+        auto local = findLocal(target);
+        if (!local) throw Unsupported();
+        expectSymbol("=");
+        auto value = expression();
+        if (value.type != local->type) throw Unsupported();
+        assign(local->reg, value.reg, mask);
+        return -1;
+    }
+
+    int ifStatement(int mask) {
+        // cells that haven't taken a branch yet
+        int remaining = mask;
+        int returned = -1;
+        do {
+            if (isName("else")) {
+                ++position;
+                scopes.emplace_back();
+                int hit = block(remaining);
+                scopes.pop_back();
+                if (hit >= 0) returned = returned < 0 ? hit : emit(Op::Or, returned, hit);
+                break;
+            }
+            ++position;
+            int test = condition(expression());
+            expectName("then");
+            int branch = maskAnd(remaining, test);
+            scopes.emplace_back();
+            int hit = block(branch);
+            scopes.pop_back();
+            if (hit >= 0) returned = returned < 0 ? hit : emit(Op::Or, returned, hit);
+            remaining = maskAnd(remaining, emit(Op::Not, test));
+        } while (isName("elseif") || isName("else"));
+        expectName("end");
+        return returned;
+    }
+
+    const Local* findLocal(const std::string& localName) const {
+        for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope) {
+            auto local = scope->find(localName);
+            if (local != scope->end()) return &local->second;
+        }
+        return nullptr;
+    }
+
+    // precedence climbing over Lua's binary operators, from or up to ^
+    Value expression(int level = 0) {
+        static const std::vector<std::vector<std::string>> levels = {
+            {"or"}, {"and"}, {"<", ">", "<=", ">=", "~=", "=="}, {"+", "-"}, {"*", "/", "%"}
+        };
+        if (level == (int)levels.size()) return unary();
+        auto left = expression(level+1);
+        while (true) {
+            const auto& token = peek();
+            std::string op;
+            for (const auto& candidate : levels[level]) {
+                if ((token.kind == Token::Kind::Symbol || token.kind == Token::Kind::Name) && token.text == candidate) op = candidate;
+            }
+            if (op.empty()) return left;
+            ++position;
+            left = binary(op, left, expression(level+1));
+        }
+    }
+
+    Value unary() {
+        if (isName("not")) {
+            ++position;
+            auto operand = unary();
+            if (operand.type == Value::Type::Number) return {Value::Type::Bool, emit(Op::Const, -1, -1, -1, 0)};
+            return {Value::Type::Bool, emit(Op::Not, condition(operand))};
+        }
+        if (isSymbol("-")) {
+            ++position;
+            auto operand = unary();
+            if (operand.type != Value::Type::Number) throw Unsupported();
+            return {Value::Type::Number, emit(Op::Neg, operand.reg)};
+        }
+        return power();
+    }
+
+    Value power() {
+        auto base = primary();
+        if (!isSymbol("^")) return base;
+        ++position;
+        // right associative, and binds tighter than a unary minus on its left but not on its right
+        auto exponent = unary();
+        if (base.type != Value::Type::Number || exponent.type != Value::Type::Number) throw Unsupported();
+        return {Value::Type::Number, emit(Op::Pow, base.reg, exponent.reg)};
+    }
+
+    Value primary() {
+        const auto& token = peek();
+        if (token.kind == Token::Kind::Number) {
+            ++position;
+            return {Value::Type::Number, emit(Op::Const, -1, -1, -1, token.number)};
+        }
+        if (isSymbol("(")) {
+            ++position;
+            auto value = expression();
+            expectSymbol(")");
+            return value;
+        }
+        if (isName("true") || isName("false")) {
+            bool truth = isName("true");
+            ++position;
+            return {Value::Type::Bool, emit(Op::Const, -1, -1, -1, truth)};
+        }
+        auto identifier = name();
+        if (auto local = findLocal(identifier)) return {local->type, local->reg};
+        if (identifier == "params") {
+            expectSymbol(".");
+            if (name() != "val") throw Unsupported();
+            return {Value::Type::Number, emit(Op::Cell)};
+        }
+        if (identifier == "math") return math();
+        throw Unsupported();
+    }
+
+    Value math() {
+        expectSymbol(".");
+        auto function = name();
+        if (function == "pi") return {Value::Type::Number, emit(Op::Const, -1, -1, -1, 3.141592653589793238462643383279502884)};
+        if (function == "huge") return {Value::Type::Number, emit(Op::Const, -1, -1, -1, HUGE_VAL)};
+        static const std::map<std::string, Op> unaries = {
+            {"floor", Op::Floor}, {"ceil", Op::Ceil}, {"abs", Op::Abs}, {"sqrt", Op::Sqrt}, {"exp", Op::Exp},
+            {"sin", Op::Sin}, {"cos", Op::Cos}, {"tan", Op::Tan}
+        };
+        std::vector<int> arguments;
+        expectSymbol("(");
+        if (!isSymbol(")")) {
+            while (true) {
+                auto argument = expression();
+                if (argument.type != Value::Type::Number) throw Unsupported();
+                arguments.push_back(argument.reg);
+                if (!isSymbol(",")) break;
+                ++position;
+            }
+        }
+        expectSymbol(")");
+        auto unary = unaries.find(function);
+        if (unary != unaries.end()) {
+            if (arguments.size() != 1) throw Unsupported();
+            return {Value::Type::Number, emit(unary->second, arguments[0])};
+        }
+        if (function == "log" && arguments.size() == 1) return {Value::Type::Number, emit(Op::Log, arguments[0])};
+        if (function == "log" && arguments.size() == 2) return {Value::Type::Number, emit(Op::LogBase, arguments[0], arguments[1])};
+        if (function == "fmod" && arguments.size() == 2) return {Value::Type::Number, emit(Op::Fmod, arguments[0], arguments[1])};
+        if ((function == "min" || function == "max") && !arguments.empty()) {
+            int rv = arguments[0];
+            for (size_t i = 1; i < arguments.size(); ++i) rv = emit(function == "min" ? Op::Min : Op::Max, rv, arguments[i]);
+            return {Value::Type::Number, rv};
+        }
+        throw Unsupported();
+    }
+
+    Value binary(const std::string& op, const Value& left, const Value& right) {
+        using Type = Value::Type;
+        if (op == "and") {
+            // a number is always true
+            if (left.type == Type::Number) return right;
+            int test = condition(left);
+            switch(right.type) {
+                case Type::Bool: return {Type::Bool, emit(Op::And, test, right.reg)};
+                case Type::Number: return {Type::MaybeNumber, right.reg, test};
+                case Type::MaybeNumber: return {Type::MaybeNumber, right.reg, emit(Op::And, test, right.flag)};
+            }
+        }
+        if (op == "or") {
+            if (left.type == Type::Number) return left;
+            if (left.type == Type::Bool && right.type == Type::Bool) return {Type::Bool, emit(Op::Or, left.reg, right.reg)};
+            // true or 5 mixes the types, only false or a number is followed
+            if (left.type == Type::MaybeNumber && right.type == Type::Number) return {Type::Number, emit(Op::Select, left.flag, left.reg, right.reg)};
+            if (left.type == Type::MaybeNumber && right.type == Type::MaybeNumber)
+                return {Type::MaybeNumber, emit(Op::Select, left.flag, left.reg, right.reg), emit(Op::Or, left.flag, right.flag)};
+            throw Unsupported();
+        }
+        if ((op == "==" || op == "~=") && left.type == Type::Bool && right.type == Type::Bool) {
+            return {Type::Bool, emit(op == "==" ? Op::Eq : Op::Ne, left.reg, right.reg)};
+        }
+        if (left.type != Type::Number || right.type != Type::Number) throw Unsupported();
+        static const std::map<std::string, Op> arithmetic = {{"+", Op::Add}, {"-", Op::Sub}, {"*", Op::Mul}, {"/", Op::Div}, {"%", Op::Mod}};
+        auto found = arithmetic.find(op);
+        if (found != arithmetic.end()) return {Type::Number, emit(found->second, left.reg, right.reg)};
+        if (op == "<") return {Type::Bool, emit(Op::Lt, left.reg, right.reg)};
+        if (op == "<=") return {Type::Bool, emit(Op::Le, left.reg, right.reg)};
+        if (op == ">") return {Type::Bool, emit(Op::Lt, right.reg, left.reg)};
+        if (op == ">=") return {Type::Bool, emit(Op::Le, right.reg, left.reg)};
+        if (op == "==") return {Type::Bool, emit(Op::Eq, left.reg, right.reg)};
+        return {Type::Bool, emit(Op::Ne, left.reg, right.reg)};
+    }
+
+    const std::vector<Token>& tokens;
+    std::vector<Instruction>& program;
+    int& registerCount;
+    size_t position = 0;
+    std::vector<std::map<std::string, Local>> scopes;
+};
+}
+
+std::optional<Lua::Expression> Lua::Expression::Compile(const std::string &script)
+{
+    Expression rv;
+    try {
+        auto tokens = Tokenize(script);
+        Compiler(tokens, rv.program, rv.registerCount).script();
+    } catch (const Unsupported&) {
+        return {};
+    }
+    return rv;
+}
+
+const double *Lua::Expression::run(const double *cells, size_t count, std::vector<double> &registers) const
+{
+    constexpr size_t n = LuaExpression::blockSize;
+    registers.resize(registerCount*n);
+    double* r = registers.data();
+    // the defaults set_color starts with
+    const double defaults[fieldCount] = {0, 0, 0, 255, 0};
+    for (auto k = 0; k < fieldCount; ++k) std::fill(r+k*n, r+(k+1)*n, defaults[k]);
+    for (const auto& instruction : program) {
+        double* dst = r + instruction.dst*n;
+        const double* a = r + instruction.a*n;
+        const double* b = r + instruction.b*n;
+        const double* c = r + instruction.c*n;
+        switch(instruction.op) {
+            case Op::Const: for (size_t i = 0; i < count; ++i) dst[i] = instruction.constant; break;
+            case Op::Cell: for (size_t i = 0; i < count; ++i) dst[i] = cells[i]; break;
+            case Op::Copy: for (size_t i = 0; i < count; ++i) dst[i] = a[i]; break;
+            case Op::Select: for (size_t i = 0; i < count; ++i) dst[i] = a[i] != 0 ? b[i] : c[i]; break;
+            case Op::Add: for (size_t i = 0; i < count; ++i) dst[i] = a[i] + b[i]; break;
+            case Op::Sub: for (size_t i = 0; i < count; ++i) dst[i] = a[i] - b[i]; break;
+            case Op::Mul: for (size_t i = 0; i < count; ++i) dst[i] = a[i] * b[i]; break;
+            case Op::Div: for (size_t i = 0; i < count; ++i) dst[i] = a[i] / b[i]; break;
+            // Lua's float modulo takes the sign of the divisor
+            case Op::Mod:
+                for (size_t i = 0; i < count; ++i) {
+                    double m = std::fmod(a[i], b[i]);
+                    dst[i] = m*b[i] < 0 ? m+b[i] : m;
+                }
+                break;
+            case Op::Pow: for (size_t i = 0; i < count; ++i) dst[i] = std::pow(a[i], b[i]); break;
+            case Op::Neg: for (size_t i = 0; i < count; ++i) dst[i] = -a[i]; break;
+            case Op::Lt: for (size_t i = 0; i < count; ++i) dst[i] = a[i] < b[i]; break;
+            case Op::Le: for (size_t i = 0; i < count; ++i) dst[i] = a[i] <= b[i]; break;
+            case Op::Eq: for (size_t i = 0; i < count; ++i) dst[i] = a[i] == b[i]; break;
+            case Op::Ne: for (size_t i = 0; i < count; ++i) dst[i] = a[i] != b[i]; break;
+            case Op::And: for (size_t i = 0; i < count; ++i) dst[i] = a[i] != 0 && b[i] != 0; break;
+            case Op::Or: for (size_t i = 0; i < count; ++i) dst[i] = a[i] != 0 || b[i] != 0; break;
+            case Op::Not: for (size_t i = 0; i < count; ++i) dst[i] = a[i] == 0; break;
+            case Op::Floor: for (size_t i = 0; i < count; ++i) dst[i] = std::floor(a[i]); break;
+            case Op::Ceil: for (size_t i = 0; i < count; ++i) dst[i] = std::ceil(a[i]); break;
+            case Op::Abs: for (size_t i = 0; i < count; ++i) dst[i] = std::fabs(a[i]); break;
+            case Op::Sqrt: for (size_t i = 0; i < count; ++i) dst[i] = std::sqrt(a[i]); break;
+            case Op::Exp: for (size_t i = 0; i < count; ++i) dst[i] = std::exp(a[i]); break;
+            case Op::Log: for (size_t i = 0; i < count; ++i) dst[i] = std::log(a[i]); break;
+            // the same special cases as math.log
+            case Op::LogBase:
+                for (size_t i = 0; i < count; ++i) {
+                    if (b[i] == 2) dst[i] = std::log2(a[i]);
+                    else if (b[i] == 10) dst[i] = std::log10(a[i]);
+                    else dst[i] = std::log(a[i])/std::log(b[i]);
+                }
+                break;
+            case Op::Sin: for (size_t i = 0; i < count; ++i) dst[i] = std::sin(a[i]); break;
+            case Op::Cos: for (size_t i = 0; i < count; ++i) dst[i] = std::cos(a[i]); break;
+            case Op::Tan: for (size_t i = 0; i < count; ++i) dst[i] = std::tan(a[i]); break;
+            // math.min and math.max keep the first argument unless a later one compares below or above it
+            case Op::Min: for (size_t i = 0; i < count; ++i) dst[i] = b[i] < a[i] ? b[i] : a[i]; break;
+            case Op::Max: for (size_t i = 0; i < count; ++i) dst[i] = a[i] < b[i] ? b[i] : a[i]; break;
+            case Op::Fmod: for (size_t i = 0; i < count; ++i) dst[i] = std::fmod(a[i], b[i]); break;
+        }
+    }
+    return r;
+}
+
+void Lua::Expression::toG16(const double *cells, size_t count, uint16_t *output) const
+{
+    constexpr size_t n = LuaExpression::blockSize;
+    std::vector<double> registers;
+    for (size_t begin = 0; begin < count; begin += n) {
+        size_t blockCount = std::min(n, count-begin);
+        auto r = run(cells+begin, blockCount, registers);
+        for (size_t i = 0; i < blockCount; ++i) output[begin+i] = r[4*n+i];
+    }
+}
+
+void Lua::Expression::toRGB(const double *cells, size_t count, Color *output) const
+{
+    constexpr size_t n = LuaExpression::blockSize;
+    std::vector<double> registers;
+    for (size_t begin = 0; begin < count; begin += n) {
+        size_t blockCount = std::min(n, count-begin);
+        auto r = run(cells+begin, blockCount, registers);
+        for (size_t i = 0; i < blockCount; ++i) {
+            for (auto k = 0; k < 4; ++k) output[begin+i][k] = static_cast<unsigned char>(r[k*n+i]);
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef LUAEXPRESSION_H
+#define LUAEXPRESSION_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace Lua {
+using Color = std::array<std::uint8_t,4>;
+
+// a set_color() script compiled to a program over blocks of cells, so the common arithmetic and threshold
+// scripts run without the interpreter. it knows numbers, params.val, the color fields, locals, if/elseif/else,
+// return, the arithmetic, comparison and logical operators and the usual math functions. both sides of an if
+// are evaluated for every cell and merged by a mask, which is fine since nothing in the subset has side effects
+class Expression {
+public:
+    // nothing when the script uses more of Lua than that, it's then run by the interpreter as before
+    static std::optional<Expression> Compile(const std::string& script);
+
+    void toG16(const double* cells, size_t count, std::uint16_t* output) const;
+    void toRGB(const double* cells, size_t count, Color* output) const;
+
+    enum class Op {
+        Const, Cell, Copy, Select,
+        Add, Sub, Mul, Div, Mod, Pow, Neg,
+        Lt, Le, Eq, Ne, And, Or, Not,
+        Floor, Ceil, Abs, Sqrt, Exp, Log, LogBase, Sin, Cos, Tan, Min, Max, Fmod
+    };
+    struct Instruction {
+        Op op;
+        int dst;
+        int a;
+        int b;
+        int c;
+        double constant;
+    };
+    // registers of the color fields, in the order r, g, b, a, value
+    static constexpr int fieldCount = 5;
+
+private:
+    Expression() = default;
+    // runs the program over one block and returns the registers, block values apart
+    const double* run(const double* cells, size_t count, std::vector<double>& registers) const;
+
+    std::vector<Instruction> program;
+    int registerCount = fieldCount;
+};
+}
+
+#endif // LUAEXPRESSION_H
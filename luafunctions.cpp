@@ -0,0 +1,302 @@
+#include "luafunctions.h"
+#include <cctype>
+#include <set>
+#include <thread>
+
+void Lua::OpenLibraries(sol::state &lua)
+{
+    lua.open_libraries(sol::lib::base, sol::lib::table, sol::lib::math);
+#ifdef USE_LUAJIT
+    lua.open_libraries(sol::lib::jit);
+#endif
+}
+
+namespace {
+// the number of '=' in the opening bracket of a long string or comment at script[i], or -1 if there is none
+int LongBracketLevel(const std::string& script, size_t i)
+{
+    if (i >= script.size() || script[i] != '[') return -1;
+    size_t j = i+1;
+    while (j < script.size() && script[j] == '=') ++j;
+    return j < script.size() && script[j] == '[' ? j-i-1 : -1;
+}
+}
+
+std::vector<std::string> Lua::FindUnsupportedSyntax(const std::string &script)
+{
+    static const std::set<std::string> functions = {"math.type", "math.tointeger", "math.ult", "string.pack", "string.unpack", "string.packsize", "table.move"};
+    std::vector<std::string> rv;
+    auto report = [&rv](size_t line, const std::string& what) {
+        rv.push_back("line " + std::to_string(line) + ": " + what);
+    };
+    auto isName = [](char c) { return std::isalnum((unsigned char)c) || c == '_'; };
+    size_t line = 1;
+    size_t i = 0;
+    // skips a long string or comment, counting its lines
+    auto skipLong = [&script, &line, &i](int level) {
+        std::string close = "]" + std::string(level, '=') + "]";
+        auto end = script.find(close, i);
+        end = end == std::string::npos ? script.size() : end+close.size();
+        for (; i < end; ++i) if (script[i] == '\n') ++line;
+    };
+    while (i < script.size()) {
+        char c = script[i];
+        char next = i+1 < script.size() ? script[i+1] : 0;
+        if (c == '\n') {
+            ++line;
+            ++i;
+        }
+        else if (c == '-' && next == '-') {
+            i += 2;
+            int level = LongBracketLevel(script, i);
+            if (level >= 0) skipLong(level);
+            else while (i < script.size() && script[i] != '\n') ++i;
+        }
+        else if (c == '"' || c == '\'') {
+            ++i;
+            while (i < script.size() && script[i] != c && script[i] != '\n') i += script[i] == '\\' ? 2 : 1;
+            ++i;
+        }
+        else if (LongBracketLevel(script, i) >= 0) skipLong(LongBracketLevel(script, i));
+        else if (std::isdigit((unsigned char)c)) {
+            // exponents may have a sign, so 1e-5 is one token
+            while (i < script.size() && (isName(script[i]) || script[i] == '.' ||
+                   ((script[i] == '-' || script[i] == '+') && std::strchr("eEpP", script[i-1])))) ++i;
+        }
+        else if (isName(c)) {
+            size_t begin = i;
+            while (i < script.size() && isName(script[i])) ++i;
+            std::string name = script.substr(begin, i-begin);
+            if (name == "utf8") report(line, "the utf8 library");
+            else if (i+1 < script.size() && script[i] == '.' && isName(script[i+1])) {
+                size_t end = i+1;
+                while (end < script.size() && isName(script[end])) ++end;
+                std::string field = script.substr(begin, end-begin);
+                if (functions.count(field)) report(line, field + "()");
+                i = end;
+            }
+        }
+        else if (c == '/' && next == '/') {
+            report(line, "'//' (integer division)");
+            i += 2;
+        }
+        else if ((c == '<' && next == '<') || (c == '>' && next == '>')) {
+            report(line, std::string("'") + c + c + "' (bit shift)");
+            i += 2;
+        }
+        else if (c == '&' || c == '|' || (c == '~' && next != '=')) {
+            report(line, std::string("'") + c + "' (bitwise operator)");
+            ++i;
+        }
+        else i += c == '~' ? 2 : 1;
+    }
+    return rv;
+}
+
+namespace {
+int WriteBytecode(lua_State*, const void* data, size_t size, void* bytecode)
+{
+    static_cast<std::string*>(bytecode)->append(static_cast<const char*>(data), size);
+    return 0;
+}
+
+// loads a chunk, source or bytecode, and runs it
+void Run(lua_State* L, const std::string& chunk)
+{
+    if (luaL_loadbuffer(L, chunk.data(), chunk.size(), "script") != 0 || lua_pcall(L, 0, 0, 0) != 0) {
+        std::string message = lua_tostring(L, -1);
+        lua_pop(L, 1);
+        throw sol::error(message);
+    }
+}
+}
+
+Lua::StatePool &Lua::StatePool::session()
+{
+    static StatePool pool;
+    return pool;
+}
+
+Lua::StatePool::State_t Lua::StatePool::acquire(const std::string &script, Kind kind, const std::function<void(sol::state&)>& prepare)
+{
+    auto key = static_cast<char>(kind) + script;
+    std::unique_ptr<sol::state> state;
+    std::string bytecode;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = entries.find(key);
+        if (found == entries.end()) {
+            sol::state compiler;
+            lua_State* L = compiler.lua_state();
+            if (luaL_loadbuffer(L, script.data(), script.size(), "script") != 0) {
+                std::string message = lua_tostring(L, -1);
+                throw sol::error(message);
+            }
+            Entry entry;
+#if LUA_VERSION_NUM >= 503
+            lua_dump(L, WriteBytecode, &entry.bytecode, 0);
+#else
+            lua_dump(L, WriteBytecode, &entry.bytecode);
+#endif
+            if (entries.size() >= LuaPool::maxScripts) {
+                auto oldest = entries.begin();
+                for (auto it = entries.begin(); it != entries.end(); ++it) if (it->second.lastUse < oldest->second.lastUse) oldest = it;
+                entries.erase(oldest);
+            }
+            found = entries.emplace(key, std::move(entry)).first;
+        }
+        found->second.lastUse = ++clock;
+        bytecode = found->second.bytecode;
+        if (!found->second.idle.empty()) {
+            state = std::move(found->second.idle.back());
+            found->second.idle.pop_back();
+        }
+    }
+    if (!state) {
+        state = std::make_unique<sol::state>();
+        OpenLibraries(*state);
+    }
+    prepare(*state);
+    Run(state->lua_state(), bytecode);
+    return State_t(state.release(), [this, key](sol::state* state) { release(key, state); });
+}
+
+void Lua::StatePool::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
+
+void Lua::StatePool::release(const std::string &key, sol::state *state)
+{
+    std::unique_ptr<sol::state> owned(state);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = entries.find(key);
+    // one idle state per thread is all a conversion can use
+    if (found == entries.end() || found->second.idle.size() >= std::thread::hardware_concurrency()) return;
+    found->second.idle.push_back(std::move(owned));
+}
+
+Lua::Converter::Converter(const std::string &script) : expression(Expression::Compile(script))
+{
+    if (expression) return;
+    lua = StatePool::session().acquire(script, StatePool::Kind::Raster, [](sol::state& lua) {
+        lua.create_named_table("params");
+        lua.create_named_table("color");
+    });
+    batched = (*lua)["set_colors"].get_type() == sol::type::function;
+}
+
+std::uint16_t Lua::Converter::toG16(double cell)
+{
+    if (isBatched()) {
+        std::uint16_t rv;
+        toG16(&cell, 1, &rv);
+        return rv;
+    }
+    auto& lua = *this->lua;
+    lua["params"]["val"] = cell;
+    lua["color"]["value"] = 0;
+    lua["set_color"]();
+    double pixelValue = lua["color"]["value"];
+    return pixelValue;
+}
+
+Lua::Color Lua::Converter::toRGB(double cell)
+{
+    if (isBatched()) {
+        Color rv;
+        toRGB(&cell, 1, &rv);
+        return rv;
+    }
+    auto& lua = *this->lua;
+    lua["params"]["val"] = cell;
+    lua["color"]["r"] = 0;
+    lua["color"]["g"] = 0;
+    lua["color"]["b"] = 0;
+    lua["color"]["a"] = 255;
+    lua["set_color"]();
+    double rgba[4] = {lua["color"]["r"], lua["color"]["g"], lua["color"]["b"], lua["color"]["a"]};
+    return {static_cast<unsigned char>(rgba[0]), static_cast<unsigned char>(rgba[1]), static_cast<unsigned char>(rgba[2]), static_cast<unsigned char>(rgba[3])};
+}
+
+void Lua::Converter::toG16(const double *cells, size_t count, std::uint16_t *output)
+{
+    if (expression) {
+        expression->toG16(cells, count, output);
+        return;
+    }
+    if (!batched) {
+        for (size_t i = 0; i < count; ++i) output[i] = toG16(cells[i]);
+        return;
+    }
+    callBatch(cells, count, false);
+    lua_State* L = lua->lua_state();
+    for (size_t i = 0; i < count; ++i) {
+        lua_rawgeti(L, -1, i+1);
+        // cells the script left out become 0, like with set_color
+        double pixelValue = lua_tonumber(L, -1);
+        output[i] = pixelValue;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+void Lua::Converter::toRGB(const double *cells, size_t count, Color *output)
+{
+    if (expression) {
+        expression->toRGB(cells, count, output);
+        return;
+    }
+    if (!batched) {
+        for (size_t i = 0; i < count; ++i) output[i] = toRGB(cells[i]);
+        return;
+    }
+    callBatch(cells, count, true);
+    lua_State* L = lua->lua_state();
+    const char* channels[4] = {"r", "g", "b", "a"};
+    const std::uint8_t defaults[4] = {0, 0, 0, 255};
+    for (auto k = 0; k < 4; ++k) {
+        lua_getfield(L, -1, channels[k]);
+        bool isTable = lua_istable(L, -1);
+        for (size_t i = 0; i < count; ++i) {
+            if (!isTable) {
+                output[i][k] = defaults[k];
+                continue;
+            }
+            lua_rawgeti(L, -1, i+1);
+            output[i][k] = lua_isnumber(L, -1) ? static_cast<unsigned char>(lua_tonumber(L, -1)) : defaults[k];
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+// calls set_colors(values, out) and leaves out on the stack. values and out are filled and read through the C API,
+// so a row costs one call into the script instead of several binding round trips per cell
+void Lua::Converter::callBatch(const double *cells, size_t count, bool rgb)
+{
+    lua_State* L = lua->lua_state();
+    if (rgb) {
+        lua_createtable(L, 0, 4);
+        for (auto channel : {"r", "g", "b", "a"}) {
+            lua_createtable(L, count, 0);
+            lua_setfield(L, -2, channel);
+        }
+    }
+    else lua_createtable(L, count, 0);
+
+    lua_getglobal(L, "set_colors");
+    lua_createtable(L, count, 0);
+    for (size_t i = 0; i < count; ++i) {
+        lua_pushnumber(L, cells[i]);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_pushvalue(L, -3);
+    if (lua_pcall(L, 2, 0, 0) != 0) {
+        std::string message = lua_tostring(L, -1);
+        lua_pop(L, 2);
+        throw sol::error(message);
+    }
+}
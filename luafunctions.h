@@ -0,0 +1,112 @@
+#ifndef LUAFUNCTIONS_H
+#define LUAFUNCTIONS_H
+
+#include "consts.h"
+#include "luaexpression.h"
+#include "sol/sol.hpp"
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Lua {
+
+// the libraries every styling script gets; on LuaJIT this also turns the compiler on
+void OpenLibraries(sol::state& lua);
+// Lua 5.3+ operators and library functions in a script, one message with its line for each.
+// LuaJIT implements 5.1 (plus goto), so such scripts are rejected before they are run
+std::vector<std::string> FindUnsupportedSyntax(const std::string& script);
+
+// states with the libraries open, kept per script for the whole session, so that previews and exports don't
+// create a state and parse the script again on every thread. a script is parsed once and its bytecode is run
+// on every acquire, after prepare() has created the tables it expects; globals it sets inside its functions
+// carry over to the next user of the state, as they already did from one cell to the next
+class StatePool {
+public:
+    using State_t = std::shared_ptr<sol::state>;
+    // what prepare() sets up, states of one kind are never handed to a caller of another
+    enum class Kind : char { Raster, Points, Shapes };
+
+    static StatePool& session();
+
+    // the state goes back to the pool once the last copy of the pointer is gone. throws sol::error if the
+    // script doesn't compile or run
+    State_t acquire(const std::string& script, Kind kind, const std::function<void(sol::state&)>& prepare);
+    void clear();
+
+private:
+    struct Entry {
+        std::string bytecode;
+        std::vector<std::unique_ptr<sol::state>> idle;
+        std::uint64_t lastUse = 0;
+    };
+
+    void release(const std::string& key, sol::state* state);
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::uint64_t clock = 0;
+};
+
+// runs a raster script in a state of its own, one per thread.
+// a script defines either set_color(), called for every cell through the params and color tables,
+// or set_colors(values, out), called once for a whole row of cells.
+// a set_color() simple enough for Lua::Expression is compiled instead, and takes whole rows too
+class Converter {
+public:
+    explicit Converter(const std::string& script);
+
+    // whether whole rows should be passed at once
+    bool isBatched() const { return batched || expression; }
+    std::uint16_t toG16(double cell);
+    Color toRGB(double cell);
+    void toG16(const double* cells, size_t count, std::uint16_t* output);
+    void toRGB(const double* cells, size_t count, Color* output);
+
+private:
+    void callBatch(const double* cells, size_t count, bool rgb);
+
+    StatePool::State_t lua;
+    bool batched = false;
+    std::optional<Expression> expression;
+};
+
+// remembers what a pure script returned for recent cells of one thread.
+// direct-mapped on the bits of the cell, so a new value replaces whatever shared its slot and memory stays bounded
+template <typename V>
+class Memo {
+public:
+    Memo() : entries((size_t)1 << LuaMemo::entriesLog2) {}
+
+    template <typename F>
+    V get(double cell, F&& compute) {
+        std::uint64_t key;
+        std::memcpy(&key, &cell, sizeof(key));
+        auto& entry = entries[(key*0x9E3779B97F4A7C15ull) >> (64-LuaMemo::entriesLog2)];
+        if (entry.used && entry.key == key) {
+            ++hits;
+            return entry.value;
+        }
+        ++misses;
+        entry = {key, compute(cell), true};
+        return entry.value;
+    }
+
+    size_t hits = 0, misses = 0;
+
+private:
+    struct Entry {
+        std::uint64_t key = 0;
+        V value = {};
+        bool used = false;
+    };
+    std::vector<Entry> entries;
+};
+}
+
+#endif // LUAFUNCTIONS_H
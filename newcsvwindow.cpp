@@ -89,6 +89,8 @@ void NewCsvWindow::on_pushButton_reset_clicked()
     params = NewCsvConvertParams();
     ui->lineEdit_inputPath->clear();
     ui->pushButton_inputPath->setEnabled(true);
+    ui->comboBox_format->setCurrentIndex(static_cast<int>(Util::OutputFormat::Png));
+    ui->comboBox_compression->setCurrentIndex(static_cast<int>(Util::Compression::Balanced));
     Util::changeSuccessState(ui->label_success, Util::SuccessStateColor::Red);
 
     ui->lineEdit_width->setValue(1);
@@ -175,7 +177,7 @@ void NewCsvWindow::previewImage()
     connect(&io, &ImageConverter::sendProgress, this, &NewCsvWindow::receiveProgressUpdate, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressError, this, &NewCsvWindow::receiveProgressError, Qt::DirectConnection);
     auto buf = io.CreateRGB_Points(params);
-    auto img = Png::CreatePngData(buf.get(), {params.width, params.height}, Util::PixelSize::ThirtyTwoBit, true);
+    auto img = Png::CreatePngData(buf, true);
     auto displayImageTask = new PreviewTask<uint8_t>(img);
     QThreadPool::globalInstance()->start(displayImageTask);
     hideProgressBar();
@@ -184,23 +186,32 @@ void NewCsvWindow::previewImage()
 void NewCsvWindow::exportImage()
 {
     if (!checkInput()) return;
+    const auto format = static_cast<Util::OutputFormat>(ui->comboBox_format->currentIndex());
+    const auto compression = static_cast<Util::Compression>(ui->comboBox_compression->currentIndex());
     setParameters();
     auto path = Gui::GetSavePath();
     if (path.isEmpty()) return;
-    if (path.right(4) != ".png") path.append(".png");
+    if (path.right(4) != Png::FileExtension(format)) path.append(Png::FileExtension(format));
+    const auto start = std::chrono::steady_clock::now();
     displayProgressBar("Creating " + QFileInfo(path).fileName() + "...");
     auto io = ImageConverter();
     connect(&io, &ImageConverter::sendProgress, this, &NewCsvWindow::receiveProgressUpdate, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressError, this, &NewCsvWindow::receiveProgressError, Qt::DirectConnection);
     auto buf = io.CreateRGB_Points(params);
-    auto img = Png::CreatePngData(buf.get(), {params.width, params.height}, Util::PixelSize::ThirtyTwoBit, true);
-    displayProgressBar("Compressing to PNG...");
-    Png::SavePng(img, path);
+    // CreateRGB_Points has already reported why there is no image
+    if (!buf) {
+        hideProgressBar();
+        return;
+    }
+    displayProgressBar("Writing " + QFileInfo(path).fileName() + "...");
+    auto saved = Png::SaveImage(buf, path, format, compression, true);
     hideProgressBar();
+    if (saved) Gui::PrintExportSummary({path}, start, Png::DescribeOutput(format, compression));
+    else Gui::ThrowError("Error creating the image.");
 }
 
-
-
-
-
-
+void NewCsvWindow::on_comboBox_format_currentIndexChanged(int index)
+{
+    // only PNG is compressed
+    ui->comboBox_compression->setEnabled(static_cast<Util::OutputFormat>(index) == Util::OutputFormat::Png);
+}
@@ -77,6 +77,8 @@ void NewGeoJsonWindow::on_pushButton_reset_clicked()
     ui->doubleSpinBox_endX->setValue(0);
     ui->doubleSpinBox_endY->setValue(0);
     parameters = NewGeoJsonConvertParams();
+    ui->comboBox_format->setCurrentIndex(static_cast<int>(Util::OutputFormat::Png));
+    ui->comboBox_compression->setCurrentIndex(static_cast<int>(Util::Compression::Balanced));
     Util::changeSuccessState(ui->label_success, Util::SuccessStateColor::Red);
 }
 
@@ -84,10 +86,13 @@ void NewGeoJsonWindow::on_pushButton_reset_clicked()
 void NewGeoJsonWindow::on_pushButton_save_clicked()
 {
     if (!checkInput()) return;
+    const auto format = static_cast<Util::OutputFormat>(ui->comboBox_format->currentIndex());
+    const auto compression = static_cast<Util::Compression>(ui->comboBox_compression->currentIndex());
     auto savePath = Gui::GetSavePath();
     if (savePath.isEmpty()) return;
-    if (savePath.right(4) != ".png") savePath += ".png";
+    if (savePath.right(4) != Png::FileExtension(format)) savePath += Png::FileExtension(format);
     setParameters();
+    const auto start = std::chrono::steady_clock::now();
 
     displayProgressBar("Reading JSON...");
     auto io = ImageConverter();
@@ -95,8 +100,10 @@ void NewGeoJsonWindow::on_pushButton_save_clicked()
     connect(&io, &ImageConverter::sendProgressError, this, &NewGeoJsonWindow::receiveProgressError, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressReset, this, &NewGeoJsonWindow::receiveProgressReset, Qt::DirectConnection);
     auto img = io.CreateRGB_VectorShapes(parameters);
-    Png::SavePng(img, savePath);
+    auto saved = !img.is_empty() && Png::SaveImage(img, savePath, format, compression);
     hideProgressBar();
+    if (saved) Gui::PrintExportSummary({savePath}, start, Png::DescribeOutput(format, compression));
+    else if (!img.is_empty()) Gui::ThrowError("Error creating the image.");
 }
 
 void NewGeoJsonWindow::receiveProgressUpdate(uint32_t progress)
@@ -178,8 +185,8 @@ void NewGeoJsonWindow::previewImage()
     hideProgressBar();
 }
 
-
-
-
-
-
+void NewGeoJsonWindow::on_comboBox_format_currentIndexChanged(int index)
+{
+    // only PNG is compressed
+    ui->comboBox_compression->setEnabled(static_cast<Util::OutputFormat>(index) == Util::OutputFormat::Png);
+}
@@ -84,6 +84,8 @@ void NewGeoPackageWindow::on_pushButton_reset_clicked()
     for (auto v : layerChecks) v->deleteLater();
     layerChecks.clear();
     parameters = {};
+    ui->comboBox_format->setCurrentIndex(static_cast<int>(Util::OutputFormat::Png));
+    ui->comboBox_compression->setCurrentIndex(static_cast<int>(Util::Compression::Balanced));
     Util::changeSuccessState(ui->label_success, Util::SuccessStateColor::Red);
 }
 
@@ -200,17 +202,27 @@ void NewGeoPackageWindow::previewImage()
 void NewGeoPackageWindow::on_pushButton_save_clicked()
 {
     if (!checkInput()) return;
+    const auto format = static_cast<Util::OutputFormat>(ui->comboBox_format->currentIndex());
+    const auto compression = static_cast<Util::Compression>(ui->comboBox_compression->currentIndex());
     auto savePath = Gui::GetSavePath();
     if (savePath.isEmpty()) return;
-    if (savePath.right(4) != ".png") savePath += ".png";
+    if (savePath.right(4) != Png::FileExtension(format)) savePath += Png::FileExtension(format);
     setParameters();
+    const auto start = std::chrono::steady_clock::now();
 
     auto io = ImageConverter();
     connect(&io, &ImageConverter::sendProgress, this, &NewGeoPackageWindow::receiveProgressUpdate, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressError, this, &NewGeoPackageWindow::receiveProgressError, Qt::DirectConnection);
     connect(&io, &ImageConverter::sendProgressReset, this, &NewGeoPackageWindow::receiveProgressReset, Qt::DirectConnection);
     auto img = io.CreateRGB_GeoPackage(parameters);
-    Png::SavePng(img, savePath);
+    auto saved = !img.is_empty() && Png::SaveImage(img, savePath, format, compression);
     hideProgressBar();
+    if (saved) Gui::PrintExportSummary({savePath}, start, Png::DescribeOutput(format, compression));
+    else if (!img.is_empty()) Gui::ThrowError("Error creating the image.");
 }
 
+void NewGeoPackageWindow::on_comboBox_format_currentIndexChanged(int index)
+{
+    // only PNG is compressed
+    ui->comboBox_compression->setEnabled(static_cast<Util::OutputFormat>(index) == Util::OutputFormat::Png);
+}
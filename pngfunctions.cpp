@@ -0,0 +1,448 @@
+#include "pngfunctions.h"
+#include "consts.h"
+#include <algorithm>
+#include <csetjmp>
+#include <cstdlib>
+
+int Png::CompressionLevel(Util::Compression compression)
+{
+    switch (compression) {
+        case Util::Compression::Fastest:
+            return 1;
+        case Util::Compression::Smallest:
+            return 9;
+        default:
+            return Z_DEFAULT_COMPRESSION;
+    }
+}
+
+Png::PngSink::PngSink(const QString &path, std::uint32_t width, std::uint32_t height, Util::PixelSize pixelSize, Util::Compression compression)
+    : width(width), height(height), pixelSize(pixelSize)
+{
+    file = std::fopen(path.toStdString().data(), "wb");
+    if (!file) return;
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!png) return;
+    info = png_create_info_struct(png);
+    if (!info || setjmp(png_jmpbuf(png))) {
+        failed = true;
+        return;
+    }
+    png_init_io(png, file);
+    if (pixelSize == Util::PixelSize::ThirtyTwoBit) {
+        png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    }
+    else {
+        png_set_IHDR(png, info, width, height, 16, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    }
+    png_set_compression_level(png, CompressionLevel(compression));
+    if (compression == Util::Compression::Fastest) png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+    if (compression == Util::Compression::Smallest) png_set_compression_mem_level(png, 9);
+    png_write_info(png, info);
+    // png samples are big endian, libpng swaps them on its own copy of each row
+    const std::uint16_t probe = 1;
+    if (pixelSize == Util::PixelSize::SixteenBit && *reinterpret_cast<const std::uint8_t*>(&probe) == 1) png_set_swap(png);
+}
+
+Png::PngSink::~PngSink()
+{
+    if (png) png_destroy_write_struct(&png, info ? &info : nullptr);
+    if (file) std::fclose(file);
+}
+
+bool Png::PngSink::writeRows(const std::uint8_t *rgba, std::uint32_t rows)
+{
+    if (!isOpen() || pixelSize != Util::PixelSize::ThirtyTwoBit || rowsWritten+rows > height) return false;
+    if (setjmp(png_jmpbuf(png))) {
+        failed = true;
+        return false;
+    }
+    for (std::uint32_t y = 0; y < rows; ++y) png_write_row(png, rgba+(size_t)y*width*4);
+    rowsWritten += rows;
+    return true;
+}
+
+bool Png::PngSink::writeRows(const std::uint16_t *gray, std::uint32_t rows)
+{
+    if (!isOpen() || pixelSize != Util::PixelSize::SixteenBit || rowsWritten+rows > height) return false;
+    if (setjmp(png_jmpbuf(png))) {
+        failed = true;
+        return false;
+    }
+    for (std::uint32_t y = 0; y < rows; ++y) png_write_row(png, reinterpret_cast<png_const_bytep>(gray+(size_t)y*width));
+    rowsWritten += rows;
+    return true;
+}
+
+bool Png::PngSink::finish()
+{
+    if (!isOpen() || rowsWritten != height) return false;
+    if (finished) return true;
+    if (setjmp(png_jmpbuf(png))) {
+        failed = true;
+        return false;
+    }
+    png_write_end(png, info);
+    finished = true;
+    return std::fflush(file) == 0;
+}
+
+namespace {
+void PutBigEndian(std::uint8_t* out, std::uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+std::uint8_t Paeth(int a, int b, int c)
+{
+    const int p = a+b-c;
+    const int pa = std::abs(p-a), pb = std::abs(p-b), pc = std::abs(p-c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// picks the filter with the smallest sum of the filtered bytes read as signed, which is what libpng does by default
+void FilterRow(const std::uint8_t* row, const std::uint8_t* previous, size_t stride, size_t bpp, std::uint8_t* out, std::vector<std::uint8_t>& scratch)
+{
+    scratch.resize(stride*5);
+    std::uint8_t* filtered[5] = { out+1, scratch.data()+stride, scratch.data()+stride*2, scratch.data()+stride*3, scratch.data()+stride*4 };
+    std::uint64_t sums[5] = {};
+    for (size_t i = 0; i < stride; ++i) {
+        const int a = i >= bpp ? row[i-bpp] : 0;
+        const int b = previous ? previous[i] : 0;
+        const int c = previous && i >= bpp ? previous[i-bpp] : 0;
+        const std::uint8_t x = row[i];
+        const std::uint8_t values[5] = {
+            x,
+            static_cast<std::uint8_t>(x-a),
+            static_cast<std::uint8_t>(x-b),
+            static_cast<std::uint8_t>(x-((a+b)>>1)),
+            static_cast<std::uint8_t>(x-Paeth(a, b, c))
+        };
+        for (int f = 0; f < 5; ++f) {
+            filtered[f][i] = values[f];
+            sums[f] += std::abs(static_cast<int>(static_cast<std::int8_t>(values[f])));
+        }
+    }
+    const int best = std::min_element(sums, sums+5)-sums;
+    out[0] = best;
+    if (best != 0) std::memcpy(out+1, filtered[best], stride);
+}
+
+void SubFilterRow(const std::uint8_t* row, size_t stride, size_t bpp, std::uint8_t* out)
+{
+    out[0] = 1;
+    std::memcpy(out+1, row, std::min(bpp, stride));
+    for (size_t i = bpp; i < stride; ++i) out[i+1] = row[i]-row[i-bpp];
+}
+}
+
+Png::ParallelPngSink::ParallelPngSink(const QString &path, std::uint32_t width, std::uint32_t height, Util::PixelSize pixelSize, Util::Compression compression)
+    : width(width), height(height), pixelSize(pixelSize), compression(compression), level(CompressionLevel(compression)), adler(adler32(0L, Z_NULL, 0))
+{
+    bytesPerPixel = pixelSize == Util::PixelSize::ThirtyTwoBit ? 4 : 2;
+    stride = (size_t)width*bytesPerPixel;
+    rowsPerGroup = std::max<size_t>(1, ParallelPng::groupBytes/(stride+1));
+    historyRows = (ParallelPng::dictionaryBytes+stride)/(stride+1)+1;
+    file = std::fopen(path.toStdString().data(), "wb");
+    if (!file) return;
+
+    static const std::uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    std::uint8_t header[13];
+    PutBigEndian(header, width);
+    PutBigEndian(header+4, height);
+    header[8] = pixelSize == Util::PixelSize::ThirtyTwoBit ? 8 : 16;
+    header[9] = pixelSize == Util::PixelSize::ThirtyTwoBit ? 6 : 0;
+    header[10] = header[11] = header[12] = 0;
+    if (std::fwrite(signature, 1, sizeof(signature), file) != sizeof(signature) || !writeChunk("IHDR", header, sizeof(header))) {
+        failed = true;
+        return;
+    }
+
+    const unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int t = 0; t < threadCount; ++t) workers.emplace_back(&ParallelPngSink::work, this);
+}
+
+Png::ParallelPngSink::~ParallelPngSink()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        jobs.clear();
+    }
+    changed.notify_all();
+    for (auto& worker : workers) worker.join();
+    if (file) std::fclose(file);
+}
+
+bool Png::ParallelPngSink::writeRows(const std::uint8_t *rgba, std::uint32_t rows)
+{
+    if (!isOpen() || pixelSize != Util::PixelSize::ThirtyTwoBit || rowsAdded+rows > height) return false;
+    for (std::uint32_t y = 0; y < rows; ++y) {
+        if (!addRow(rgba+(size_t)y*stride)) return false;
+    }
+    return true;
+}
+
+bool Png::ParallelPngSink::writeRows(const std::uint16_t *gray, std::uint32_t rows)
+{
+    if (!isOpen() || pixelSize != Util::PixelSize::SixteenBit || rowsAdded+rows > height) return false;
+    swappedRow.resize(stride);
+    for (std::uint32_t y = 0; y < rows; ++y) {
+        auto row = gray+(size_t)y*width;
+        for (std::uint32_t x = 0; x < width; ++x) {
+            swappedRow[x*2] = row[x] >> 8;
+            swappedRow[x*2+1] = row[x] & 0xff;
+        }
+        if (!addRow(swappedRow.data())) return false;
+    }
+    return true;
+}
+
+bool Png::ParallelPngSink::finish()
+{
+    if (!isOpen() || rowsAdded != height) return false;
+    if (finished) return true;
+    if (!drain(submitted) || !writeChunk("IEND", nullptr, 0)) return false;
+    finished = true;
+    return std::fflush(file) == 0;
+}
+
+bool Png::ParallelPngSink::addRow(const std::uint8_t *row)
+{
+    // rows are filtered by the workers, this thread only collects them
+    group.insert(group.end(), row, row+stride);
+    ++rowsAdded;
+    if (rowsAdded == height) return submit(true);
+    if (group.size() >= rowsPerGroup*stride) return submit(false);
+    return true;
+}
+
+bool Png::ParallelPngSink::submit(bool last)
+{
+    // no more than two groups per worker are kept, finished or not
+    const size_t maxInFlight = workers.size()*2;
+    if (submitted-written >= maxInFlight && !drain(submitted-maxInFlight+1)) return false;
+
+    const std::uint32_t rows = group.size()/stride;
+    Group job{submitted++, std::move(group), history, rowsAdded-rows, last};
+    group.clear();
+    const size_t kept = std::min(historyRows*stride, history.size()+job.rows.size());
+    if (job.rows.size() >= kept) {
+        history.assign(job.rows.end()-kept, job.rows.end());
+    }
+    else {
+        history.erase(history.begin(), history.end()-(kept-job.rows.size()));
+        history.insert(history.end(), job.rows.begin(), job.rows.end());
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    changed.notify_all();
+    return drain(written);
+}
+
+bool Png::ParallelPngSink::drain(size_t count)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        auto next = results.find(written);
+        if (next == results.end()) {
+            if (written >= count) return true;
+            changed.wait(lock, [this]() { return results.count(written) > 0; });
+            continue;
+        }
+        auto deflated = std::move(next->second);
+        results.erase(next);
+        lock.unlock();
+        if (!deflated.ok) {
+            failed = true;
+            return false;
+        }
+        adler = adler32_combine(adler, deflated.adler, deflated.length);
+        if (written == 0) {
+            // the zlib header, a 32 KiB window and the flag bits of the level
+            const int flags = level == Z_DEFAULT_COMPRESSION || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+            const std::uint8_t cmf = 0x78;
+            std::uint8_t flg = flags << 6;
+            flg += (31-(cmf*256+flg)%31)%31;
+            deflated.data.insert(deflated.data.begin(), { cmf, flg });
+        }
+        if (deflated.last) {
+            std::uint8_t checksum[4];
+            PutBigEndian(checksum, adler);
+            deflated.data.insert(deflated.data.end(), checksum, checksum+4);
+        }
+        if (!writeChunk("IDAT", deflated.data.data(), deflated.data.size())) {
+            failed = true;
+            return false;
+        }
+        lock.lock();
+        ++written;
+    }
+}
+
+bool Png::ParallelPngSink::writeChunk(const char *type, const std::uint8_t *data, size_t size)
+{
+    std::uint8_t length[4], crc[4];
+    PutBigEndian(length, size);
+    uLong sum = crc32(0L, reinterpret_cast<const Bytef*>(type), 4);
+    if (size > 0) sum = crc32(sum, data, size);
+    PutBigEndian(crc, sum);
+    return std::fwrite(length, 1, 4, file) == 4 && std::fwrite(type, 1, 4, file) == 4
+        && (size == 0 || std::fwrite(data, 1, size, file) == size) && std::fwrite(crc, 1, 4, file) == 4;
+}
+
+void Png::ParallelPngSink::work()
+{
+    std::vector<std::uint8_t> scratch, data, dictionary;
+    auto filter = [this, &scratch](const std::uint8_t* row, const std::uint8_t* previous, std::uint8_t* out) {
+        if (compression == Util::Compression::Fastest) SubFilterRow(row, stride, bytesPerPixel, out);
+        else FilterRow(row, previous, stride, bytesPerPixel, out, scratch);
+    };
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        changed.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        if (stopping) return;
+        auto job = std::move(jobs.front());
+        jobs.pop_front();
+        lock.unlock();
+
+        // the rows before the group are filtered again, the last 32 KiB of them are the dictionary
+        const size_t rowCount = job.rows.size()/stride, historyCount = job.history.size()/stride;
+        const size_t historyStart = historyCount == job.firstRow ? 0 : 1;
+        data.resize((historyCount-std::min(historyStart, historyCount))*(stride+1));
+        for (size_t r = historyStart; r < historyCount; ++r) {
+            filter(&job.history[r*stride], r > 0 ? &job.history[(r-1)*stride] : nullptr, &data[(r-historyStart)*(stride+1)]);
+        }
+        dictionary.assign(data.end()-std::min(ParallelPng::dictionaryBytes, data.size()), data.end());
+
+        data.resize(rowCount*(stride+1));
+        for (size_t r = 0; r < rowCount; ++r) {
+            const std::uint8_t* previous = r > 0 ? &job.rows[(r-1)*stride] : historyCount > 0 ? &job.history[(historyCount-1)*stride] : nullptr;
+            filter(&job.rows[r*stride], previous, &data[r*(stride+1)]);
+        }
+
+        // raw deflate, the header and checksum of the whole stream are written by drain()
+        Deflated result{{}, adler32(adler32(0L, Z_NULL, 0), data.data(), data.size()), data.size(), job.last, false};
+        z_stream stream{};
+        if (deflateInit2(&stream, level, Z_DEFLATED, -15, compression == Util::Compression::Smallest ? 9 : 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            if (!dictionary.empty()) deflateSetDictionary(&stream, dictionary.data(), dictionary.size());
+            // room for the empty stored block a sync flush ends with
+            result.data.resize(deflateBound(&stream, data.size())+16);
+            stream.next_in = data.data();
+            stream.avail_in = data.size();
+            stream.next_out = result.data.data();
+            stream.avail_out = result.data.size();
+            const int rv = deflate(&stream, job.last ? Z_FINISH : Z_SYNC_FLUSH);
+            result.ok = (job.last ? rv == Z_STREAM_END : rv == Z_OK && stream.avail_out > 0) && stream.avail_in == 0;
+            result.data.resize(stream.total_out);
+            deflateEnd(&stream);
+        }
+
+        lock.lock();
+        results.emplace(job.index, std::move(result));
+        changed.notify_all();
+    }
+}
+
+std::unique_ptr<Png::ImageSink> Png::OpenPngSink(const QString &path, std::uint32_t width, std::uint32_t height, Util::PixelSize pixelSize, Util::Compression compression)
+{
+    const std::uint64_t bytes = (std::uint64_t)width*height*(pixelSize == Util::PixelSize::ThirtyTwoBit ? 4 : 2);
+    if (bytes >= ParallelPng::minBytes && std::thread::hardware_concurrency() > 1) {
+        return std::make_unique<ParallelPngSink>(path, width, height, pixelSize, compression);
+    }
+    return std::make_unique<PngSink>(path, width, height, pixelSize, compression);
+}
+
+bool Png::CanHold(Util::OutputFormat format, Util::PixelSize pixelSize)
+{
+    switch (format) {
+        case Util::OutputFormat::Qoi:
+            return pixelSize == Util::PixelSize::ThirtyTwoBit;
+        case Util::OutputFormat::Pgm:
+            return pixelSize == Util::PixelSize::SixteenBit;
+        default:
+            return pixelSize != Util::PixelSize::No;
+    }
+}
+
+QString Png::FileExtension(Util::OutputFormat format)
+{
+    switch (format) {
+        case Util::OutputFormat::Raw:
+            return ".raw";
+        case Util::OutputFormat::Qoi:
+            return ".qoi";
+        case Util::OutputFormat::Pgm:
+            return ".pgm";
+        default:
+            return ".png";
+    }
+}
+
+QString Png::DescribeOutput(Util::OutputFormat format, Util::Compression compression)
+{
+    switch (format) {
+        case Util::OutputFormat::Raw:
+            return "raw";
+        case Util::OutputFormat::Qoi:
+            return "QOI";
+        case Util::OutputFormat::Pgm:
+            return "PGM";
+        default:
+            break;
+    }
+    switch (compression) {
+        case Util::Compression::Fastest:
+            return "PNG, fastest compression";
+        case Util::Compression::Smallest:
+            return "PNG, smallest compression";
+        default:
+            return "PNG, balanced compression";
+    }
+}
+
+std::unique_ptr<Png::ImageSink> Png::OpenImageSink(const QString &path, std::uint32_t width, std::uint32_t height, Util::PixelSize pixelSize,
+                                                   Util::OutputFormat format, Util::Compression compression)
+{
+    if (!CanHold(format, pixelSize)) return nullptr;
+    const bool rgba = pixelSize == Util::PixelSize::ThirtyTwoBit;
+    switch (format) {
+        case Util::OutputFormat::Raw:
+            return std::make_unique<RawSink>(path.toStdString(), width, height, rgba ? 4 : 1, rgba ? 8 : 16);
+        case Util::OutputFormat::Qoi:
+            return std::make_unique<QoiSink>(path.toStdString(), width, height);
+        case Util::OutputFormat::Pgm:
+            return std::make_unique<PgmSink>(path.toStdString(), width, height);
+        default:
+            return OpenPngSink(path, width, height, pixelSize, compression);
+    }
+}
+
+bool Png::SaveImage(const cimg_library::CImg<std::uint8_t> &img, const QString &path, Util::OutputFormat format, Util::Compression compression)
+{
+    if (img.is_empty() || img.spectrum() != 4) return false;
+    const std::uint32_t width = img.width(), height = img.height();
+    auto writer = OpenImageSink(path, width, height, Util::PixelSize::ThirtyTwoBit, format, compression);
+    if (!writer || !writer->isOpen()) return false;
+    const std::uint32_t bandRows = std::clamp<std::uint64_t>(Stream::bandBytes/((std::uint64_t)width*4), 1, height);
+    Rgba8 band(width, bandRows);
+    for (std::uint32_t firstRow = 0; firstRow < height; firstRow += bandRows) {
+        const std::uint32_t rows = std::min(bandRows, height-firstRow);
+        for (std::uint32_t y = 0; y < rows; ++y) {
+            auto row = band.row(y);
+            for (int c = 0; c < 4; ++c) {
+                auto plane = img.data(0, firstRow+y, 0, c);
+                for (std::uint32_t x = 0; x < width; ++x) row[x*4+c] = plane[x];
+            }
+        }
+        if (!writer->writeRows(band.data(), rows)) return false;
+    }
+    return writer->finish();
+}
@@ -15,28 +15,148 @@
 #include <QtDebug>
 #include <map>
 #include "commonfunctions.h"
+#include "imagebuffer.h"
+#include "imagesink.h"
 #include <CImg.h>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <png.h>
+#include <zlib.h>
 
 
 namespace Png {
-template<typename T>
-cimg_library::CImg<T> CreatePngData(T* img, std::pair<uint32_t,uint32_t> widthAndHeight, Util::PixelSize pixelSize, bool flipY = false) {
-    if (pixelSize == Util::PixelSize::ThirtyTwoBit) {
-        cimg_library::CImg<uint8_t> rv(img, widthAndHeight.first, widthAndHeight.second, 1, 4);
-        if (flipY) rv.mirror('y');
-        return rv;
+// the planar copy CImg needs to display an image, only made for previews
+template<typename T, unsigned int Channels>
+cimg_library::CImg<T> CreatePngData(const ImageBuffer<T,Channels>& img, bool flipY = false) {
+    if (!img) return {};
+    cimg_library::CImg<T> rv(img.width(), img.height(), 1, Channels);
+    for (std::uint32_t y = 0; y < img.height(); ++y) {
+        auto row = img.row(flipY ? img.height()-1-y : y);
+        for (unsigned int c = 0; c < Channels; ++c) {
+            auto plane = rv.data(0, y, 0, c);
+            for (std::uint32_t x = 0; x < img.width(); ++x) plane[x] = row[x*Channels+c];
+        }
     }
-    else if (pixelSize == Util::PixelSize::SixteenBit) {
-        cimg_library::CImg<uint16_t> rv(img, widthAndHeight.first, widthAndHeight.second, 1, 1);
-        if (flipY) rv.mirror('y');
-        return rv;
-    }
-    else throw std::invalid_argument("unreachable code");
+    return rv;
 }
-template<typename T>
-void SavePng(cimg_library::CImg<T>& img, const QString& path) {
-    img.save_png(path.toStdString().data());
+// fastest: level 1 and the sub filter only, for files that are read again soon. balanced: libpng's defaults,
+// level 6 and the filter picked row by row. smallest: level 9 and the most memory zlib can use
+int CompressionLevel(Util::Compression compression);
+
+// writes a png through libpng as the rows come. they go to libpng without being copied
+class PngSink : public ImageSink {
+public:
+    PngSink(const QString& path, std::uint32_t width, std::uint32_t height, Util::PixelSize pixelSize, Util::Compression compression = Util::Compression::Balanced);
+    ~PngSink() override;
+    PngSink(const PngSink&) = delete;
+    PngSink& operator=(const PngSink&) = delete;
+
+    bool isOpen() const override { return png != nullptr && !failed; }
+    bool writeRows(const std::uint8_t* rgba, std::uint32_t rows) override;
+    bool writeRows(const std::uint16_t* gray, std::uint32_t rows) override;
+    bool finish() override;
+
+private:
+    std::FILE* file = nullptr;
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+    std::uint32_t width, height, rowsWritten = 0;
+    Util::PixelSize pixelSize;
+    bool failed = false;
+    bool finished = false;
+};
+
+// writes a png whose rows are filtered and deflated in groups on every core, pigz-style: a group is primed with the
+// 32 KiB of filtered data before it and ends on a byte boundary, so the groups join into one zlib stream, and their
+// adler32 checksums are combined. the chunks are written here, libpng isn't involved
+class ParallelPngSink : public ImageSink {
+public:
+    ParallelPngSink(const QString& path, std::uint32_t width, std::uint32_t height, Util::PixelSize pixelSize, Util::Compression compression = Util::Compression::Balanced);
+    ~ParallelPngSink() override;
+    ParallelPngSink(const ParallelPngSink&) = delete;
+    ParallelPngSink& operator=(const ParallelPngSink&) = delete;
+
+    bool isOpen() const override { return file != nullptr && !failed; }
+    bool writeRows(const std::uint8_t* rgba, std::uint32_t rows) override;
+    bool writeRows(const std::uint16_t* gray, std::uint32_t rows) override;
+    bool finish() override;
+
+private:
+    // unfiltered rows; history holds the ones before the group that are filtered again for its dictionary,
+    // and the row before those, unless they start at the top of the image
+    struct Group {
+        size_t index;
+        std::vector<std::uint8_t> rows;
+        std::vector<std::uint8_t> history;
+        std::uint32_t firstRow;
+        bool last;
+    };
+    struct Deflated {
+        std::vector<std::uint8_t> data;
+        uLong adler;
+        size_t length;
+        bool last;
+        bool ok;
+    };
+
+    // row holds the samples in png byte order
+    bool addRow(const std::uint8_t* row);
+    bool submit(bool last);
+    // writes finished groups in order until count of them are written, then whatever else is ready
+    bool drain(size_t count);
+    bool writeChunk(const char* type, const std::uint8_t* data, size_t size);
+    void work();
+
+    std::FILE* file = nullptr;
+    std::uint32_t width, height, rowsAdded = 0;
+    Util::PixelSize pixelSize;
+    Util::Compression compression;
+    int level;
+    size_t bytesPerPixel, stride, rowsPerGroup, historyRows;
+    std::vector<std::uint8_t> swappedRow, group, history;
+    size_t submitted = 0, written = 0;
+    uLong adler;
+    bool failed = false;
+    bool finished = false;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Group> jobs;
+    std::map<size_t, Deflated> results;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+// the parallel writer for images big enough to be worth it, libpng for the rest
+std::unique_ptr<ImageSink> OpenPngSink(const QString& path, std::uint32_t width, std::uint32_t height, Util::PixelSize pixelSize,
+                                       Util::Compression compression = Util::Compression::Balanced);
+// qoi holds rgba only and pgm 16-bit grayscale only
+bool CanHold(Util::OutputFormat format, Util::PixelSize pixelSize);
+QString FileExtension(Util::OutputFormat format);
+// the format, and the compression for png, as the export summary shows them
+QString DescribeOutput(Util::OutputFormat format, Util::Compression compression);
+// nothing when the format can't hold the pixels. the compression is only used by png
+std::unique_ptr<ImageSink> OpenImageSink(const QString& path, std::uint32_t width, std::uint32_t height, Util::PixelSize pixelSize,
+                                         Util::OutputFormat format, Util::Compression compression = Util::Compression::Balanced);
+
+// writes the rows of an image from the top, or from the bottom with flipY
+template<typename T, unsigned int Channels>
+bool SaveImage(const ImageBuffer<T,Channels>& img, const QString& path, Util::OutputFormat format, Util::Compression compression, bool flipY = false) {
+    if (!img) return false;
+    auto writer = OpenImageSink(path, img.width(), img.height(), Channels == 4 ? Util::PixelSize::ThirtyTwoBit : Util::PixelSize::SixteenBit, format, compression);
+    if (!writer || !writer->isOpen()) return false;
+    if (!flipY) return writer->writeRows(img.data(), img.height()) && writer->finish();
+    for (std::uint32_t y = img.height(); y > 0; --y) {
+        if (!writer->writeRows(img.row(y-1), 1)) return false;
+    }
+    return writer->finish();
 }
+// the rgba planes of the vector shape images, interleaved a band at a time on the way to the sink
+bool SaveImage(const cimg_library::CImg<std::uint8_t>& img, const QString& path, Util::OutputFormat format, Util::Compression compression);
 
 
 }
@@ -0,0 +1,315 @@
+#include "pyramidfunctions.h"
+#include "commonfunctions.h"
+#include "consts.h"
+#include "statsfunctions.h"
+#include "tilecache.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <QDir>
+#include <QFile>
+
+namespace {
+struct LevelWriter {
+    TIFF* tif = nullptr;
+    QString path;
+    std::uint32_t width, height, row = 0;
+    std::vector<float> carry; // a row of the previous band that had no pair yet
+};
+
+QString PyramidDirectory(const QString& path)
+{
+    return Util::getCacheDirectory("pyramids")+QDir::separator()+Util::getFileCacheKey(path);
+}
+
+QString LevelPath(const QString& directory, unsigned int factor)
+{
+    return directory+QDir::separator()+"level_"+QString::number(factor)+".tif";
+}
+
+// rewriting the marker updates the pyramid's modification time, which orders the eviction of the cache
+void MarkUsed(const QString& directory)
+{
+    QFile marker(directory+QDir::separator()+"last_used");
+    marker.open(QIODevice::WriteOnly);
+}
+
+std::mutex buildingMutex;
+std::set<QString> building; // directories of the pyramids being built
+
+// marks a pyramid as being built for as long as it lives, unless another build of it already runs
+class BuildLock {
+public:
+    explicit BuildLock(const QString& directory) : directory(directory) {
+        std::lock_guard<std::mutex> lock(buildingMutex);
+        acquired = building.insert(directory).second;
+    }
+    ~BuildLock() {
+        std::lock_guard<std::mutex> lock(buildingMutex);
+        if (acquired) building.erase(directory);
+    }
+    bool isAcquired() const { return acquired; }
+
+private:
+    QString directory;
+    bool acquired;
+};
+
+// the float levels of a raster, down to minLevelSize
+std::uint64_t LevelBytes(std::uint32_t width, std::uint32_t height)
+{
+    std::uint64_t rv = 0;
+    while (std::max(width, height) > Pyramid::minLevelSize) {
+        width = (width+1)/2;
+        height = (height+1)/2;
+        rv += (std::uint64_t)width*height*sizeof(float);
+    }
+    return rv;
+}
+
+// cells without a single valid value get the source's nodata value, or NaN when it has none or a float can't hold it
+float LevelNoData(const std::optional<double>& noData)
+{
+    if (noData.has_value() && (double)(float)*noData == *noData) return *noData;
+    return std::numeric_limits<float>::quiet_NaN();
+}
+
+// the tag extender registered by Tiff::GetProperties has to be in place, so that the nodata tag is written
+TIFF* CreateLevelFile(const QString& path, std::uint32_t width, std::uint32_t height, float noData)
+{
+    // levels of very large rasters don't fit in a classic tiff
+    bool bigTiff = (std::uint64_t)width*height*sizeof(float) > 0xF0000000ull;
+    TIFF* tif = TIFFOpen(path.toStdString().data(), bigTiff ? "w8" : "w");
+    if (!tif) return nullptr;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    // uncompressed, so that reading a level goes through the memory-mapped path
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, Pyramid::rowsPerStrip);
+    auto noDataText = std::isnan(noData) ? QString("nan") : QString::number(noData, 'g', 9);
+    TIFFSetField(tif, Tiff::TIFFTAG_GDAL_NODATA, noDataText.toStdString().data());
+    return tif;
+}
+
+// averages pairs of rows and columns into rows of the next level; a row or column without a pair is averaged alone.
+// nodata and NaN values are left out of the average, a cell that covers nothing else gets the level's nodata value
+void ReduceRows(const std::vector<const float*>& rows, std::uint32_t width, std::vector<float>& out, std::uint32_t outWidth, const std::optional<double>& noData)
+{
+    auto fill = LevelNoData(noData);
+    auto outHeight = (rows.size()+1)/2;
+    out.resize(outHeight*outWidth);
+
+    auto threadCount = std::thread::hardware_concurrency();
+    std::vector<std::thread> threads; threads.reserve(threadCount);
+    for (auto t = 0; t < threadCount; ++t) {
+        threads.emplace_back([t, threadCount, width, outWidth, outHeight, fill, &noData, &rows, &out]() {
+            // the rows hold the source's values as floats
+            float skip = noData.has_value() ? (float)*noData : std::numeric_limits<float>::quiet_NaN();
+            double sum;
+            unsigned int count;
+            auto add = [&sum, &count, skip](float value) {
+                if (std::isnan(value) || value == skip) return;
+                sum += value;
+                ++count;
+            };
+            size_t threadBegin = (float)t/threadCount*outHeight;
+            size_t threadEnd = (float)(t+1)/threadCount*outHeight;
+            for (size_t y = threadBegin; y < threadEnd; ++y) {
+                const float* top = rows[2*y];
+                const float* bottom = 2*y+1 < rows.size() ? rows[2*y+1] : nullptr;
+                for (std::uint32_t x = 0; x < outWidth; ++x) {
+                    auto x0 = 2*x;
+                    bool pair = x0+1 < width;
+                    sum = 0;
+                    count = 0;
+                    add(top[x0]);
+                    if (pair) add(top[x0+1]);
+                    if (bottom) {
+                        add(bottom[x0]);
+                        if (pair) add(bottom[x0+1]);
+                    }
+                    out[y*outWidth+x] = count ? sum/count : fill;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+}
+
+// reduces rows of the level above into writers[level] and passes what it wrote on to the levels below
+bool WriteLevels(std::vector<LevelWriter>& writers, size_t level, const std::vector<const float*>& rows, std::uint32_t width, bool last, const std::optional<double>& noData)
+{
+    auto& writer = writers[level];
+    std::vector<const float*> input;
+    input.reserve(rows.size()+1);
+    if (!writer.carry.empty()) input.push_back(writer.carry.data());
+    input.insert(input.end(), rows.begin(), rows.end());
+
+    std::vector<float> nextCarry;
+    if (input.size() % 2 == 1 && !last) {
+        nextCarry.assign(input.back(), input.back()+width);
+        input.pop_back();
+    }
+    std::vector<float> out;
+    ReduceRows(input, width, out, writer.width, noData);
+    writer.carry = std::move(nextCarry);
+
+    std::vector<const float*> outRows;
+    for (size_t y = 0; y*writer.width < out.size(); ++y) {
+        if (writer.row >= writer.height || TIFFWriteScanline(writer.tif, &out[y*writer.width], writer.row++, 0) == -1) return false;
+        outRows.push_back(&out[y*writer.width]);
+    }
+    if (level+1 < writers.size()) return WriteLevels(writers, level+1, outRows, writer.width, last, noData);
+    return true;
+}
+}
+
+std::vector<Pyramid::Level> Pyramid::GetLevels(const QString &path)
+{
+    std::vector<Level> rv;
+    auto directory = PyramidDirectory(path);
+    for (unsigned int factor = 2; QFile::exists(LevelPath(directory, factor)); factor *= 2) {
+        auto levelPath = LevelPath(directory, factor);
+        auto widthAndHeight = Tiff::GetWidthAndHeight(levelPath);
+        if (widthAndHeight.first == 0 || widthAndHeight.second == 0) break;
+        rv.push_back({levelPath, factor, widthAndHeight.first, widthAndHeight.second});
+    }
+    return rv;
+}
+
+std::optional<Pyramid::Level> Pyramid::FindBestLevel(const QString &path, unsigned int scale)
+{
+    std::optional<Level> rv;
+    for (const auto& level : GetLevels(path)) {
+        if (scale % level.factor == 0) rv = level;
+    }
+    if (rv.has_value()) MarkUsed(PyramidDirectory(path));
+    return rv;
+}
+
+bool Pyramid::ShouldBuild(const QString &path, std::uint64_t windowPixels)
+{
+    auto widthAndHeight = Tiff::GetWidthAndHeight(path);
+    auto pixels = (std::uint64_t)widthAndHeight.first*widthAndHeight.second;
+    if (pixels < minPixels || windowPixels < minWindowShare*pixels) return false;
+    if (LevelBytes(widthAndHeight.first, widthAndHeight.second) > maxCacheBytes) return false;
+    {
+        std::lock_guard<std::mutex> lock(buildingMutex);
+        if (building.count(PyramidDirectory(path))) return false;
+    }
+    return Tiff::GetOverviews(path).empty() && GetLevels(path).empty();
+}
+
+bool Pyramid::Build(const QString &path, const Tiff::ProgressUpdateFunc_t &progressFunc, const std::atomic<bool>* cancel)
+{
+    auto directory = PyramidDirectory(path);
+    BuildLock buildLock(directory);
+    if (!buildLock.isAcquired()) return false;
+
+    Tiff::TiffProperties properties;
+    if (!Tiff::GetProperties(path, properties)) return false;
+
+    // older versions of the file's pyramid go, and the least recently used pyramids of other files make room for this one
+    Util::trimCacheDirectory("pyramids", path, maxCacheBytes-std::min(LevelBytes(properties.width, properties.height), maxCacheBytes));
+    QDir().mkpath(directory);
+
+    // levels are written next to their final names and only renamed once all of them are complete
+    std::vector<LevelWriter> writers;
+    bool ok = true;
+    std::uint32_t width = properties.width, height = properties.height;
+    for (unsigned int factor = 2; ok && std::max(width, height) > minLevelSize; factor *= 2) {
+        width = (width+1)/2;
+        height = (height+1)/2;
+        LevelWriter writer;
+        writer.path = LevelPath(directory, factor);
+        writer.width = width;
+        writer.height = height;
+        writer.tif = CreateLevelFile(writer.path+".part", width, height, LevelNoData(properties.noData));
+        ok = writer.tif != nullptr;
+        if (ok) writers.push_back(std::move(writer));
+    }
+    ok = ok && !writers.empty();
+
+    // the source is read in bands of whole strips or tiles, so that none of them is decoded twice
+    auto unit = properties.tiled ? properties.tileHeight : properties.rowsPerStrip;
+    std::uint64_t rowBytes = (std::uint64_t)properties.width*sizeof(float);
+    std::uint32_t bandRows = (minBandRows+unit-1)/unit*unit;
+    if (bandRows*rowBytes > maxBandBytes) bandRows = maxBandBytes/rowBytes/unit*unit;
+
+    // a strip or row of tiles larger than a band is decoded once and kept for the bands that follow;
+    // a band reaches into at most two of them
+    std::unique_ptr<Tiff::TileCache> stripCache;
+    Tiff::ReadOptions options;
+    options.cancel = cancel;
+    if (bandRows == 0) {
+        bandRows = minBandRows;
+        std::uint64_t unitWidth = properties.tiled ? (properties.width+properties.tileWidth-1)/properties.tileWidth*properties.tileWidth : properties.width;
+        stripCache = std::make_unique<Tiff::TileCache>(2*unitWidth*unit*properties.bitsPerSample/8);
+        options.tileCache = stripCache.get();
+    }
+    std::vector<float> band(ok ? (size_t)bandRows*properties.width : 0);
+
+    // every value of the raster goes through the build, so its statistics come for free
+    Stats::Collector collector(properties.noData);
+
+    for (std::uint32_t startY = 0; ok && startY < properties.height; startY += bandRows) {
+        std::uint32_t endY = std::min(startY+bandRows, properties.height)-1;
+        ok = Tiff::LoadTiffView(path, [&band, &collector, &properties, startY](const auto& view, unsigned int threadIndex) {
+            collector.add(view, threadIndex);
+            for (std::uint32_t _y = 0; _y < view.height; ++_y) {
+                std::copy(view.row(_y), view.row(_y)+view.width, &band[(size_t)(view.y+_y-startY)*properties.width+view.x]);
+            }
+        },
+        [](uint32_t) {},
+        startY, endY, 0, -1, options);
+        ok = ok && !(cancel && *cancel);
+        if (!ok) break;
+
+        std::vector<const float*> rows;
+        for (std::uint32_t y = startY; y <= endY; ++y) rows.push_back(&band[(size_t)(y-startY)*properties.width]);
+        ok = WriteLevels(writers, 0, rows, properties.width, endY == properties.height-1, properties.noData);
+        progressFunc((float)(endY+1)/properties.height*100);
+    }
+
+    for (auto& writer : writers) {
+        ok = ok && writer.row == writer.height;
+        TIFFClose(writer.tif);
+    }
+    for (auto& writer : writers) {
+        if (ok) {
+            QFile::remove(writer.path);
+            ok = QFile::rename(writer.path+".part", writer.path);
+        }
+        else QFile::remove(writer.path+".part");
+    }
+    if (!ok) {
+        QDir(directory).removeRecursively();
+        return false;
+    }
+
+    MarkUsed(directory);
+    Stats::Save(path, collector.finish());
+    return true;
+}
+
+Pyramid::Builder::Builder(const QString &path) : sourcePath(path)
+{
+    thread = std::thread([this]() {
+        Build(sourcePath, [](uint32_t) {}, &cancel);
+    });
+}
+
+Pyramid::Builder::~Builder()
+{
+    cancel = true;
+    thread.join();
+}
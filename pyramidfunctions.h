@@ -0,0 +1,41 @@
+#ifndef PYRAMIDFUNCTIONS_H
+#define PYRAMIDFUNCTIONS_H
+
+#include "tifffunctions.h"
+#include <atomic>
+#include <optional>
+#include <thread>
+#include <vector>
+#include <QString>
+
+// reduced-resolution copies of a raster, kept in the cache directory and keyed by the source file's identity.
+// every level halves the previous one, each of its cells is the average of the cells it covers.
+// the cache holds at most Pyramid::maxCacheBytes, a raster whose levels need more doesn't get them
+namespace Pyramid {
+struct Level {
+    QString path;
+    unsigned int factor;
+    std::uint32_t width, height;
+};
+
+std::vector<Level> GetLevels(const QString& path);
+std::optional<Level> FindBestLevel(const QString& path, unsigned int scale);
+bool ShouldBuild(const QString& path, std::uint64_t windowPixels);
+// only one build of a file's pyramid runs at a time, another one returns false right away
+bool Build(const QString& path, const Tiff::ProgressUpdateFunc_t& progressFunc, const std::atomic<bool>* cancel = nullptr);
+
+// builds a file's pyramid on a thread of its own; destroying the builder cancels the build and waits for it
+class Builder {
+public:
+    explicit Builder(const QString& path);
+    ~Builder();
+    const QString& path() const { return sourcePath; }
+
+private:
+    QString sourcePath;
+    std::atomic<bool> cancel = false;
+    std::thread thread;
+};
+}
+
+#endif // PYRAMIDFUNCTIONS_H
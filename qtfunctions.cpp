@@ -3,9 +3,18 @@
 #include <QFileDialog>
 #include <QDir>
 #include <QInputDialog>
+#include <QFileInfo>
+#include <QLocale>
+#include <QCoreApplication>
+#include <QThread>
 
 void Gui::ThrowError(const QString& msg)
 {
+    // widgets only live on the gui thread, errors of background work are shown from there
+    if (QThread::currentThread() != QCoreApplication::instance()->thread()) {
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [msg]() { Gui::ThrowError(msg); }, Qt::QueuedConnection);
+        return;
+    }
     QMessageBox messageBox;
     messageBox.critical(nullptr, "Error",msg);
     messageBox.setFixedSize(500,200);
@@ -60,3 +69,18 @@ double Gui::GetNumberValueFromInputDialog(const QString &title, const QString &d
     return rv;
 }
 
+
+void Gui::PrintExportSummary(const QStringList &paths, std::chrono::steady_clock::time_point start, const QString &output, const QString &details)
+{
+    qint64 bytes = 0;
+    for (const auto& path : paths) bytes += QFileInfo(path).size();
+    PrintExportSummary(paths.size() == 1 ? QFileInfo(paths.front()).fileName() : QString::number(paths.size())+" images", bytes, start, output, details);
+}
+
+void Gui::PrintExportSummary(const QString &saved, qint64 bytes, std::chrono::steady_clock::time_point start, const QString &output, const QString &details)
+{
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    auto message = saved+" saved in "+QString::number(seconds, 'f', 2)+" s, "+QLocale().formattedDataSize(bytes)+" ("+output+").";
+    if (!details.isEmpty()) message += "\n"+details;
+    PrintMessage("Export finished", message);
+}
@@ -2,6 +2,8 @@
 #define QTFUNCTIONS_H
 
 #include <QString>
+#include <QStringList>
+#include <chrono>
 
 namespace Gui {
 QString GetSavePath();
@@ -11,6 +13,9 @@ double GetNumberValueFromInputDialog(const QString& title, const QString& desc);
 void ThrowError(const QString& msg);
 void PrintMessage(const QString& title, const QString& msg);
 bool GiveQuestion(const QString& question);
+// how long an export took, and the size of the files it wrote; details go on a line of their own
+void PrintExportSummary(const QStringList& paths, std::chrono::steady_clock::time_point start, const QString& output, const QString& details = {});
+void PrintExportSummary(const QString& saved, qint64 bytes, std::chrono::steady_clock::time_point start, const QString& output, const QString& details = {});
 }
 
 #endif // QTFUNCTIONS_H
@@ -0,0 +1,189 @@
+#include "simdkernels.h"
+#include <climits>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// gcc and clang only emit instructions of the targets a function is compiled for, msvc emits any intrinsic
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+namespace {
+using Simd::G16Transform;
+
+template <typename T>
+void ToG16Scalar(const T* src, size_t count, std::uint16_t* dst, const G16Transform& transform)
+{
+    for (size_t i = 0; i < count; ++i) dst[i] = transform.apply(src[i]);
+}
+
+#ifdef SIMD_X86
+// sse4.1: samples are widened to 2 doubles at a time
+SIMD_TARGET("sse4.1") inline __m128d Load2(const float* p) { return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)p))); }
+SIMD_TARGET("sse4.1") inline __m128d Load2(const double* p) { return _mm_loadu_pd(p); }
+SIMD_TARGET("sse4.1") inline __m128d Load2(const std::int32_t* p) { return _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)p)); }
+SIMD_TARGET("sse4.1") inline __m128d Load2(const std::uint32_t* p) {
+    auto v = _mm_xor_si128(_mm_loadl_epi64((const __m128i*)p), _mm_set1_epi32(INT_MIN));
+    return _mm_add_pd(_mm_cvtepi32_pd(v), _mm_set1_pd(2147483648.0));
+}
+SIMD_TARGET("sse4.1") inline __m128d Load2(const std::int16_t* p) { std::int32_t v; std::memcpy(&v, p, 4); return _mm_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_cvtsi32_si128(v))); }
+SIMD_TARGET("sse4.1") inline __m128d Load2(const std::uint16_t* p) { std::int32_t v; std::memcpy(&v, p, 4); return _mm_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_cvtsi32_si128(v))); }
+SIMD_TARGET("sse4.1") inline __m128d Load2(const std::int8_t* p) { std::int16_t v; std::memcpy(&v, p, 2); return _mm_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(v))); }
+SIMD_TARGET("sse4.1") inline __m128d Load2(const std::uint8_t* p) { std::uint16_t v; std::memcpy(&v, p, 2); return _mm_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v))); }
+
+SIMD_TARGET("sse4.1") inline __m128i Transform2(__m128d v, __m128d shift, __m128d scale, __m128d bias)
+{
+    auto y = _mm_mul_pd(_mm_sub_pd(v, shift), scale);
+    // max returns its second operand when the first is NaN
+    y = _mm_min_pd(_mm_max_pd(y, _mm_setzero_pd()), _mm_set1_pd(65535.0));
+    return _mm_cvttpd_epi32(_mm_add_pd(y, bias));
+}
+
+template <typename T>
+SIMD_TARGET("sse4.1") void ToG16SSE41(const T* src, size_t count, std::uint16_t* dst, const G16Transform& transform)
+{
+    const auto shift = _mm_set1_pd(transform.shift), scale = _mm_set1_pd(transform.scale), bias = _mm_set1_pd(transform.bias);
+    size_t i = 0;
+    for (; i+8 <= count; i += 8) {
+        auto a = _mm_unpacklo_epi64(Transform2(Load2(src+i), shift, scale, bias), Transform2(Load2(src+i+2), shift, scale, bias));
+        auto b = _mm_unpacklo_epi64(Transform2(Load2(src+i+4), shift, scale, bias), Transform2(Load2(src+i+6), shift, scale, bias));
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi32(a, b));
+    }
+    ToG16Scalar(src+i, count-i, dst+i, transform);
+}
+
+// avx2: 4 doubles at a time
+SIMD_TARGET("avx2") inline __m256d Load4(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+SIMD_TARGET("avx2") inline __m256d Load4(const double* p) { return _mm256_loadu_pd(p); }
+SIMD_TARGET("avx2") inline __m256d Load4(const std::int32_t* p) { return _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)p)); }
+SIMD_TARGET("avx2") inline __m256d Load4(const std::uint32_t* p) {
+    auto v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi32(INT_MIN));
+    return _mm256_add_pd(_mm256_cvtepi32_pd(v), _mm256_set1_pd(2147483648.0));
+}
+SIMD_TARGET("avx2") inline __m256d Load4(const std::int16_t* p) { return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*)p))); }
+SIMD_TARGET("avx2") inline __m256d Load4(const std::uint16_t* p) { return _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)p))); }
+SIMD_TARGET("avx2") inline __m256d Load4(const std::int8_t* p) { std::int32_t v; std::memcpy(&v, p, 4); return _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(v))); }
+SIMD_TARGET("avx2") inline __m256d Load4(const std::uint8_t* p) { std::int32_t v; std::memcpy(&v, p, 4); return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v))); }
+
+SIMD_TARGET("avx2") inline __m128i Transform4(__m256d v, __m256d shift, __m256d scale, __m256d bias)
+{
+    auto y = _mm256_mul_pd(_mm256_sub_pd(v, shift), scale);
+    y = _mm256_min_pd(_mm256_max_pd(y, _mm256_setzero_pd()), _mm256_set1_pd(65535.0));
+    return _mm256_cvttpd_epi32(_mm256_add_pd(y, bias));
+}
+
+template <typename T>
+SIMD_TARGET("avx2") void ToG16AVX2(const T* src, size_t count, std::uint16_t* dst, const G16Transform& transform)
+{
+    const auto shift = _mm256_set1_pd(transform.shift), scale = _mm256_set1_pd(transform.scale), bias = _mm256_set1_pd(transform.bias);
+    size_t i = 0;
+    for (; i+8 <= count; i += 8) {
+        auto a = Transform4(Load4(src+i), shift, scale, bias);
+        auto b = Transform4(Load4(src+i+4), shift, scale, bias);
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi32(a, b));
+    }
+    ToG16Scalar(src+i, count-i, dst+i, transform);
+}
+
+// avx-512: 8 doubles at a time
+SIMD_TARGET("avx512f") inline __m512d Load8(const float* p) { return _mm512_cvtps_pd(_mm256_loadu_ps(p)); }
+SIMD_TARGET("avx512f") inline __m512d Load8(const double* p) { return _mm512_loadu_pd(p); }
+SIMD_TARGET("avx512f") inline __m512d Load8(const std::int32_t* p) { return _mm512_cvtepi32_pd(_mm256_loadu_si256((const __m256i*)p)); }
+SIMD_TARGET("avx512f") inline __m512d Load8(const std::uint32_t* p) { return _mm512_cvtepu32_pd(_mm256_loadu_si256((const __m256i*)p)); }
+SIMD_TARGET("avx512f") inline __m512d Load8(const std::int16_t* p) { return _mm512_cvtepi32_pd(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)p))); }
+SIMD_TARGET("avx512f") inline __m512d Load8(const std::uint16_t* p) { return _mm512_cvtepi32_pd(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p))); }
+SIMD_TARGET("avx512f") inline __m512d Load8(const std::int8_t* p) { return _mm512_cvtepi32_pd(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)p))); }
+SIMD_TARGET("avx512f") inline __m512d Load8(const std::uint8_t* p) { return _mm512_cvtepi32_pd(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p))); }
+
+SIMD_TARGET("avx512f") inline __m256i Transform8(__m512d v, __m512d shift, __m512d scale, __m512d bias)
+{
+    auto y = _mm512_mul_pd(_mm512_sub_pd(v, shift), scale);
+    y = _mm512_min_pd(_mm512_max_pd(y, _mm512_setzero_pd()), _mm512_set1_pd(65535.0));
+    return _mm512_cvttpd_epi32(_mm512_add_pd(y, bias));
+}
+
+template <typename T>
+SIMD_TARGET("avx512f") void ToG16AVX512(const T* src, size_t count, std::uint16_t* dst, const G16Transform& transform)
+{
+    const auto shift = _mm512_set1_pd(transform.shift), scale = _mm512_set1_pd(transform.scale), bias = _mm512_set1_pd(transform.bias);
+    size_t i = 0;
+    for (; i+16 <= count; i += 16) {
+        auto a = Transform8(Load8(src+i), shift, scale, bias);
+        auto b = Transform8(Load8(src+i+8), shift, scale, bias);
+        // values are already clamped to 0..65535, so truncating to 16 bits keeps them whole
+        auto packed = _mm512_cvtepi32_epi16(_mm512_inserti64x4(_mm512_castsi256_si512(a), b, 1));
+        _mm256_storeu_si256((__m256i*)(dst+i), packed);
+    }
+    ToG16Scalar(src+i, count-i, dst+i, transform);
+}
+#endif
+
+Simd::Level Detect()
+{
+#ifdef SIMD_X86
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return Simd::Level::AVX512;
+    if (__builtin_cpu_supports("avx2")) return Simd::Level::AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return Simd::Level::SSE41;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool sse41 = info[2] & (1 << 19);
+    bool osxsave = info[2] & (1 << 27);
+    // the os has to save the wider registers on context switches too
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        if ((xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16))) return Simd::Level::AVX512;
+        if ((xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5))) return Simd::Level::AVX2;
+    }
+    if (sse41) return Simd::Level::SSE41;
+#endif
+#endif
+    return Simd::Level::Scalar;
+}
+
+template <typename T>
+void Dispatch(const T* src, size_t count, std::uint16_t* dst, const G16Transform& transform)
+{
+#ifdef SIMD_X86
+    switch (Simd::DetectedLevel()) {
+        case Simd::Level::AVX512: return ToG16AVX512(src, count, dst, transform);
+        case Simd::Level::AVX2: return ToG16AVX2(src, count, dst, transform);
+        case Simd::Level::SSE41: return ToG16SSE41(src, count, dst, transform);
+        case Simd::Level::Scalar: break;
+    }
+#endif
+    ToG16Scalar(src, count, dst, transform);
+}
+}
+
+Simd::Level Simd::DetectedLevel()
+{
+    static const Level level = Detect();
+    return level;
+}
+
+void Simd::ToG16(const std::uint8_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { Dispatch(src, count, dst, transform); }
+void Simd::ToG16(const std::int8_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { Dispatch(src, count, dst, transform); }
+void Simd::ToG16(const std::uint16_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { Dispatch(src, count, dst, transform); }
+void Simd::ToG16(const std::int16_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { Dispatch(src, count, dst, transform); }
+void Simd::ToG16(const std::uint32_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { Dispatch(src, count, dst, transform); }
+void Simd::ToG16(const std::int32_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { Dispatch(src, count, dst, transform); }
+void Simd::ToG16(const float* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { Dispatch(src, count, dst, transform); }
+void Simd::ToG16(const double* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { Dispatch(src, count, dst, transform); }
+// 64 bit integers have no packed conversion to double below avx-512dq, and rasters of them are rare
+void Simd::ToG16(const std::uint64_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { ToG16Scalar(src, count, dst, transform); }
+void Simd::ToG16(const std::int64_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform) { ToG16Scalar(src, count, dst, transform); }
@@ -0,0 +1,49 @@
+#ifndef SIMDKERNELS_H
+#define SIMDKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Simd {
+enum class Level {
+    Scalar,
+    SSE41,
+    AVX2,
+    AVX512
+};
+
+// the widest instruction set both the build and the cpu support, detected once
+Level DetectedLevel();
+
+// the affine map of the grayscale16 modes: clamp((x-shift)*scale, 0, 65535), plus bias, truncated.
+// NaN becomes 0
+struct G16Transform {
+    double shift, scale, bias;
+
+    static G16Transform MinToMax(double min, double max) {
+        return {min, max > min ? 65535.0/(max-min) : 0.0, 0.5};
+    }
+    static G16Transform TrueValue(double offset) {
+        return {-offset, 1.0, 0.0};
+    }
+    std::uint16_t apply(double x) const {
+        double y = (x-shift)*scale;
+        if (!(y > 0)) y = 0;
+        if (y > 65535) y = 65535;
+        return (std::uint16_t)(y+bias);
+    }
+};
+
+void ToG16(const std::uint8_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const std::int8_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const std::uint16_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const std::int16_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const std::uint32_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const std::int32_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const std::uint64_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const std::int64_t* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const float* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+void ToG16(const double* src, size_t count, std::uint16_t* dst, const G16Transform& transform);
+}
+
+#endif // SIMDKERNELS_H
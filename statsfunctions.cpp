@@ -0,0 +1,191 @@
+#include "statsfunctions.h"
+#include "commonfunctions.h"
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+namespace {
+QString SidecarPath(const QString& path, std::uint16_t directory)
+{
+    return Util::getCacheDirectory("stats")+QDir::separator()+Util::getFileCacheKey(path)+"_"+QString::number(directory)+".json";
+}
+
+// statistics of windows, most recently used first
+class WindowCache {
+public:
+    bool get(const QString& key, Stats::RasterStats& stats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = std::find_if(entries.begin(), entries.end(), [&key](const auto& entry) { return entry.first == key; });
+        if (found == entries.end()) return false;
+        entries.splice(entries.begin(), entries, found);
+        stats = found->second;
+        return true;
+    }
+    void put(const QString& key, const Stats::RasterStats& stats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.emplace_front(key, stats);
+        if (entries.size() > Stats::maxWindowEntries) entries.pop_back();
+    }
+
+private:
+    std::mutex mutex;
+    std::list<std::pair<QString, Stats::RasterStats>> entries;
+};
+
+WindowCache& SessionWindows()
+{
+    static WindowCache cache;
+    return cache;
+}
+}
+
+double Stats::RasterStats::percentile(double p) const
+{
+    if (percentiles.empty()) return min;
+    p = std::clamp(p, 0.0, 100.0);
+    auto lower = (size_t)p;
+    if (lower+1 >= percentiles.size()) return percentiles.back();
+    auto fraction = p-lower;
+    return percentiles[lower]+(percentiles[lower+1]-percentiles[lower])*fraction;
+}
+
+Stats::Collector::Collector(std::optional<double> noData) : noData(noData), accumulators(std::thread::hardware_concurrency())
+{
+}
+
+Stats::RasterStats Stats::Collector::finish() const
+{
+    RasterStats rv;
+    rv.min = std::numeric_limits<double>::max();
+    rv.max = std::numeric_limits<double>::lowest();
+    std::vector<std::uint64_t> keyHistogram(65536);
+    double mean = 0, m2 = 0;
+    for (const auto& acc : accumulators) {
+        rv.noDataCount += acc.noDataCount;
+        if (acc.count == 0) continue;
+        rv.min = std::min(rv.min, acc.min);
+        rv.max = std::max(rv.max, acc.max);
+        for (size_t i = 0; i < keyHistogram.size(); ++i) keyHistogram[i] += acc.histogram[i];
+
+        // partial means and squared deviations are merged pairwise (Chan et al.)
+        double n = acc.count;
+        double accMean = acc.shift+acc.sum/n;
+        double accM2 = std::max(acc.sumSquares-acc.sum*acc.sum/n, 0.0);
+        double total = rv.count+n;
+        double delta = accMean-mean;
+        mean += delta*n/total;
+        m2 += accM2+delta*delta*rv.count*n/total;
+        rv.count += acc.count;
+    }
+    if (rv.count == 0) {
+        rv.min = rv.max = 0;
+        return rv;
+    }
+    rv.mean = mean;
+    rv.stddev = std::sqrt(m2/rv.count);
+
+    // percentiles are interpolated inside the key bin they fall in
+    rv.percentiles.resize(percentileCount);
+    std::uint64_t before = 0;
+    std::uint32_t bin = 0;
+    for (unsigned int p = 0; p < percentileCount; ++p) {
+        double rank = (double)p/(percentileCount-1)*(rv.count-1);
+        while (bin < keyHistogram.size()-1 && before+keyHistogram[bin] <= rank) before += keyHistogram[bin++];
+        double lower = FromOrderedKey(bin << 16);
+        double upper = FromOrderedKey((bin << 16) | 0xFFFF);
+        double fraction = keyHistogram[bin] == 0 ? 0 : (rank-before+0.5)/keyHistogram[bin];
+        rv.percentiles[p] = std::clamp(lower+(upper-lower)*fraction, rv.min, rv.max);
+    }
+    rv.percentiles.front() = rv.min;
+    rv.percentiles.back() = rv.max;
+
+    rv.histogram.resize(histogramBins);
+    for (std::uint32_t i = 0; i < keyHistogram.size(); ++i) {
+        if (keyHistogram[i] == 0) continue;
+        double value = std::clamp<double>(FromOrderedKey((i << 16) | 0x8000), rv.min, rv.max);
+        auto index = rv.max > rv.min ? (size_t)((value-rv.min)/(rv.max-rv.min)*histogramBins) : 0;
+        rv.histogram[std::min<size_t>(index, histogramBins-1)] += keyHistogram[i];
+    }
+    return rv;
+}
+
+bool Stats::Compute(const QString &path, RasterStats &stats, const Tiff::ProgressUpdateFunc_t &progressFunc, int startX, int endX, int startY, int endY, const Tiff::ReadOptions &options)
+{
+    Tiff::TiffProperties properties;
+    if (!Tiff::GetProperties(path, properties, options.directory)) return false;
+    Collector collector(properties.noData);
+    if (!Tiff::LoadTiffView(path, [&collector](const auto& view, unsigned int threadIndex) {
+        collector.add(view, threadIndex);
+    }, progressFunc, startY, endY, startX, endX, options)) return false;
+    stats = collector.finish();
+    return true;
+}
+
+bool Stats::Load(const QString &path, RasterStats &stats, std::uint16_t directory)
+{
+    QFile file(SidecarPath(path, directory));
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    auto json = QJsonDocument::fromJson(file.readAll()).object();
+    if (!json.contains("count") || !json.contains("percentiles") || !json.contains("histogram")) return false;
+
+    stats = {};
+    stats.min = json["min"].toDouble();
+    stats.max = json["max"].toDouble();
+    stats.mean = json["mean"].toDouble();
+    stats.stddev = json["stddev"].toDouble();
+    stats.count = json["count"].toDouble();
+    stats.noDataCount = json["noDataCount"].toDouble();
+    for (const auto& value : json["percentiles"].toArray()) stats.percentiles.push_back(value.toDouble());
+    for (const auto& value : json["histogram"].toArray()) stats.histogram.push_back(value.toDouble());
+    return true;
+}
+
+void Stats::Save(const QString &path, const RasterStats &stats, std::uint16_t directory)
+{
+    QJsonObject json;
+    json["min"] = stats.min;
+    json["max"] = stats.max;
+    json["mean"] = stats.mean;
+    json["stddev"] = stats.stddev;
+    json["count"] = (double)stats.count;
+    json["noDataCount"] = (double)stats.noDataCount;
+    QJsonArray percentiles, histogram;
+    for (auto value : stats.percentiles) percentiles.append(value);
+    for (auto value : stats.histogram) histogram.append((double)value);
+    json["percentiles"] = percentiles;
+    json["histogram"] = histogram;
+
+    // sidecars of older versions of the file go, and the least recently written ones once there are too many
+    Util::trimCacheDirectory("stats", path, maxSidecarBytes);
+    QSaveFile file(SidecarPath(path, directory));
+    if (!file.open(QIODevice::WriteOnly)) return;
+    file.write(QJsonDocument(json).toJson(QJsonDocument::Compact));
+    file.commit();
+}
+
+bool Stats::Get(const QString &path, RasterStats &stats, const Tiff::ProgressUpdateFunc_t &progressFunc, int startX, int endX, int startY, int endY, const Tiff::ReadOptions &options)
+{
+    Tiff::TiffProperties properties;
+    if (!Tiff::GetProperties(path, properties, options.directory)) return false;
+    if (endX == -1) endX = properties.width-1;
+    if (endY == -1) endY = properties.height-1;
+
+    if (startX == 0 && startY == 0 && endX == properties.width-1 && endY == properties.height-1) {
+        if (Load(path, stats, options.directory)) return true;
+        if (!Compute(path, stats, progressFunc, startX, endX, startY, endY, options)) return false;
+        Save(path, stats, options.directory);
+        return true;
+    }
+    auto key = Util::getFileCacheKey(path)+"_"+QString::number(options.directory)+"_"+QString::number(startX)+"_"+QString::number(endX)+"_"+QString::number(startY)+"_"+QString::number(endY);
+    if (SessionWindows().get(key, stats)) return true;
+    if (!Compute(path, stats, progressFunc, startX, endX, startY, endY, options)) return false;
+    SessionWindows().put(key, stats);
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef STATSFUNCTIONS_H
+#define STATSFUNCTIONS_H
+
+#include "tifffunctions.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <vector>
+#include <QString>
+
+namespace Stats {
+constexpr unsigned int percentileCount = 101;
+constexpr unsigned int histogramBins = 256;
+// statistics of windows smaller than the image are kept for the session only, this many of them
+constexpr size_t maxWindowEntries = 256;
+// the sidecars of the full images of all files together
+constexpr std::uint64_t maxSidecarBytes = 64ull*1024*1024;
+
+struct RasterStats {
+    double min = 0, max = 0, mean = 0, stddev = 0;
+    std::uint64_t count = 0, noDataCount = 0;
+    // percentiles[p] for p = 0..100, approximate to about 1% of a value
+    std::vector<double> percentiles;
+    // bins of equal width between min and max
+    std::vector<std::uint64_t> histogram;
+
+    double percentile(double p) const;
+};
+
+// maps a float to an unsigned key that sorts the same way, so that a histogram over the key's top bits
+// needs no range up front and has bins that are finer close to zero, like the values themselves
+inline std::uint32_t OrderedKey(float value) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+inline float FromOrderedKey(std::uint32_t key) {
+    std::uint32_t bits = key & 0x80000000u ? key & 0x7FFFFFFFu : ~key;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// collects statistics of the views passed to it by LoadTiffView's threads, every thread into its own accumulator
+class Collector {
+public:
+    explicit Collector(std::optional<double> noData);
+
+    template <typename T>
+    void add(const Tiff::SampleView<T>& view, unsigned int threadIndex) {
+        auto& acc = accumulators[threadIndex];
+        for (std::uint32_t _y = 0; _y < view.height; ++_y) {
+            auto pixels = view.row(_y);
+            for (std::uint32_t _x = 0; _x < view.width; ++_x) {
+                double v = pixels[_x];
+                if (std::isnan(v) || (noData.has_value() && v == noData.value())) {
+                    ++acc.noDataCount;
+                    continue;
+                }
+                // sums are taken around the first value, which keeps the variance accurate for values far from zero
+                if (acc.count == 0) acc.shift = v;
+                ++acc.count;
+                acc.sum += v-acc.shift;
+                acc.sumSquares += (v-acc.shift)*(v-acc.shift);
+                if (v < acc.min) acc.min = v;
+                if (v > acc.max) acc.max = v;
+                ++acc.histogram[OrderedKey(v) >> 16];
+            }
+        }
+    }
+    RasterStats finish() const;
+
+private:
+    struct alignas(64) Accumulator {
+        std::uint64_t count = 0, noDataCount = 0;
+        double shift = 0, sum = 0, sumSquares = 0;
+        double min = std::numeric_limits<double>::max(), max = std::numeric_limits<double>::lowest();
+        std::vector<std::uint64_t> histogram = std::vector<std::uint64_t>(65536);
+    };
+    std::optional<double> noData;
+    std::vector<Accumulator> accumulators;
+};
+
+bool Compute(const QString& path, RasterStats& stats, const Tiff::ProgressUpdateFunc_t& progressFunc, int startX = 0, int endX = -1, int startY = 0, int endY = -1, const Tiff::ReadOptions& options = {});
+// a sidecar of the statistics of a whole image file directory, keyed by the file's path, size and modification time
+bool Load(const QString& path, RasterStats& stats, std::uint16_t directory = 0);
+void Save(const QString& path, const RasterStats& stats, std::uint16_t directory = 0);
+// cached statistics of the window, computed and cached if there are none yet.
+// the whole image's go to the sidecar, a smaller window's are kept in memory
+bool Get(const QString& path, RasterStats& stats, const Tiff::ProgressUpdateFunc_t& progressFunc, int startX = 0, int endX = -1, int startY = 0, int endY = -1, const Tiff::ReadOptions& options = {});
+}
+
+#endif // STATSFUNCTIONS_H
@@ -2,11 +2,18 @@
 #include "qtfunctions.h"
 #include "tifffunctions.h"
 #include "float.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <thread>
 #include <tiff.h>
 #include <tiffio.h>
 #include <cstdint>
+#include <mutex>
 #include <sol/sol.hpp>
+#include <QFile>
+#include <QFileInfo>
 
 std::pair<unsigned int, unsigned int> Tiff::GetWidthAndHeight(const QString &path)
 {
@@ -23,102 +30,374 @@ std::pair<unsigned int, unsigned int> Tiff::GetWidthAndHeight(const QString &pat
     return rv;
 }
 
-bool Tiff::LoadTiff(const QString &path,
-                    const Tiff::TileFunc_t& tileFunc, const StripFunc_t& stripFunc, const ProgressUpdateFunc_t& progressFunc,
-                    int startY, int endY, int startX, int endX)
+namespace {
+TIFFExtendProc parentExtender = nullptr;
+
+void TagExtender(TIFF* tif)
+{
+    static const TIFFFieldInfo fieldInfo[] = {
+        {Tiff::TIFFTAG_GDAL_NODATA, TIFF_VARIABLE, TIFF_VARIABLE, TIFF_ASCII, FIELD_CUSTOM, true, false, const_cast<char*>("GDALNoDataValue")}
+    };
+    TIFFMergeFieldInfo(tif, fieldInfo, 1);
+    if (parentExtender) parentExtender(tif);
+}
+}
+
+bool Tiff::GetProperties(const QString &path, TiffProperties &properties, std::uint16_t directory)
 {
+    // libtiff only reads tags it knows about, and the extender has to be in place before the file is opened
+    static std::once_flag extenderFlag;
+    std::call_once(extenderFlag, []() { parentExtender = TIFFSetTagExtender(TagExtender); });
+
     TIFF* tif = TIFFOpen(path.toStdString().data(),"r");
     if (!tif) {
         Gui::ThrowError("Error loading image.");
+        return false;
+    }
+    if (directory != 0 && !TIFFSetDirectory(tif, directory)) {
         TIFFClose(tif);
+        Gui::ThrowError("Error loading image.");
         return false;
     }
 
-    TiffProperties properties {};
+    properties = {};
+    std::uint16_t bitsPerSample = 0, sampleFormat = 0;
     TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &properties.width);
     TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &properties.height);
-    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &properties.bitsPerSample);
-    TIFFGetField(tif, TIFFTAG_SAMPLEFORMAT, &properties.sampleFormat);
+    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &sampleFormat);
+    properties.bitsPerSample = bitsPerSample;
+    properties.sampleFormat = sampleFormat;
+    properties.tiled = TIFFIsTiled(tif) != 0;
+    if (properties.tiled) {
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &properties.tileWidth);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &properties.tileHeight);
+    }
+    else {
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &properties.rowsPerStrip);
+        properties.rowsPerStrip = std::clamp<std::uint32_t>(properties.rowsPerStrip, 1, properties.height);
+    }
+    char* noData = nullptr;
+    if (TIFFGetField(tif, TIFFTAG_GDAL_NODATA, &noData) && noData != nullptr) {
+        bool ok;
+        auto value = QString(noData).trimmed().toDouble(&ok);
+        if (ok) properties.noData = value;
+    }
+    TIFFClose(tif);
 
-    if (properties.width == 0 || properties.height == 0) {
+    if (properties.width == 0 || properties.height == 0 || (properties.tiled && (properties.tileWidth == 0 || properties.tileHeight == 0))) {
         Gui::ThrowError("Error. Image is invalid.");
-        TIFFClose(tif);
         return false;
     }
-    if (!(properties.bitsPerSample == 8 || properties.bitsPerSample == 16 || properties.bitsPerSample == 32 ||
-          properties.bitsPerSample == 64) || properties.sampleFormat > SAMPLEFORMAT_IEEEFP) {
+    if (!DispatchSampleType(properties, [](auto) { return true; })) {
         Gui::ThrowError("Unsupported file");
+        return false;
+    }
+    return true;
+}
+
+std::vector<Tiff::Overview> Tiff::GetOverviews(const QString &path)
+{
+    std::vector<Overview> rv;
+    TIFF* tif = TIFFOpen(path.toStdString().data(),"r");
+    if (!tif) return rv;
+
+    std::uint32_t fullWidth = 0, fullHeight = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &fullWidth);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &fullHeight);
+    for (std::uint16_t directory = 1; fullWidth != 0 && TIFFSetDirectory(tif, directory); ++directory) {
+        std::uint32_t subfileType = 0, width = 0, height = 0;
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SUBFILETYPE, &subfileType);
+        // masks are also stored as reduced images, but they don't hold raster values
+        if (!(subfileType & FILETYPE_REDUCEDIMAGE) || (subfileType & FILETYPE_MASK)) continue;
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+        if (width == 0 || height == 0) continue;
+        unsigned int factor = std::round((double)fullWidth/width);
+        // only levels that are a whole-number reduction of the full image can stand in for it
+        if (factor < 2 || std::abs((long long)width*factor-fullWidth) >= factor || std::abs((long long)height*factor-fullHeight) >= factor) continue;
+        rv.push_back({directory, width, height, factor});
+    }
+    TIFFClose(tif);
+    std::sort(rv.begin(), rv.end(), [](const Overview& a, const Overview& b) { return a.factor < b.factor; });
+    return rv;
+}
+
+std::optional<Tiff::Overview> Tiff::FindBestOverview(const QString &path, unsigned int scale)
+{
+    // the coarsest level whose factor divides the scale, so what's left of it can still be done by averaging cells
+    std::optional<Overview> rv;
+    for (const auto& overview : GetOverviews(path)) {
+        if (scale % overview.factor == 0) rv = overview;
+    }
+    return rv;
+}
+
+bool Tiff::LoadTiff(const QString &path,
+                    const Tiff::TileFunc_t& tileFunc, const StripFunc_t& stripFunc, const ProgressUpdateFunc_t& progressFunc,
+                    int startY, int endY, int startX, int endX)
+{
+    TiffProperties properties;
+    if (!GetProperties(path, properties)) return false;
+
+    return DispatchSampleType(properties, [&](auto sample) {
+        using T = decltype(sample);
+        return LoadTiffBlocks(path, properties, [&properties, &tileFunc, &stripFunc](const RawBlock& block, unsigned int) {
+            auto view = block.view<T>();
+            if (properties.tiled) {
+                std::vector<std::vector<double>> pixels(view.height);
+                for (std::uint32_t y = 0; y < view.height; ++y) pixels[y].assign(view.row(y), view.row(y)+view.width);
+                tileFunc(std::move(pixels), view.x, view.y);
+            }
+            else {
+                for (std::uint32_t y = 0; y < view.height; ++y) {
+                    stripFunc(std::vector<double>(view.row(y), view.row(y)+view.width), view.y+y);
+                }
+            }
+        }, progressFunc, startY, endY, startX, endX);
+    });
+}
+
+bool Tiff::ReadMappedLayout(const QString &path, const TiffProperties &properties, MappedLayout &layout, std::uint16_t directory)
+{
+    TIFF* tif = TIFFOpen(path.toStdString().data(),"r");
+    if (!tif) return false;
+    if (directory != 0 && !TIFFSetDirectory(tif, directory)) {
         TIFFClose(tif);
         return false;
     }
+
+    std::uint16_t compression = 0, samplesPerPixel = 1;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+    bool eligible = compression == COMPRESSION_NONE && samplesPerPixel == 1 && TIFFIsByteSwapped(tif) == 0;
+    if (eligible) {
+        std::uint64_t* offsets = nullptr;
+        std::uint64_t* byteCounts = nullptr;
+        auto count = properties.tiled ? TIFFNumberOfTiles(tif) : TIFFNumberOfStrips(tif);
+        eligible = TIFFGetField(tif, properties.tiled ? TIFFTAG_TILEOFFSETS : TIFFTAG_STRIPOFFSETS, &offsets) &&
+                   TIFFGetField(tif, properties.tiled ? TIFFTAG_TILEBYTECOUNTS : TIFFTAG_STRIPBYTECOUNTS, &byteCounts) &&
+                   offsets != nullptr && byteCounts != nullptr;
+        if (eligible) {
+            layout.offsets.assign(offsets, offsets+count);
+            layout.byteCounts.assign(byteCounts, byteCounts+count);
+        }
+    }
+    TIFFClose(tif);
+    if (!eligible) return false;
+
+    const auto bytesPerSample = properties.bitsPerSample/8;
+    auto fileSize = (std::uint64_t)QFileInfo(path).size();
+    for (size_t i = 0; i < layout.offsets.size(); ++i) {
+        std::uint64_t expectedSize;
+        if (properties.tiled) expectedSize = (std::uint64_t)properties.tileWidth*properties.tileHeight*bytesPerSample;
+        else expectedSize = (std::uint64_t)std::min<std::uint64_t>(properties.rowsPerStrip, properties.height-i*properties.rowsPerStrip)*properties.width*bytesPerSample;
+        // samples are read in place, so they must be complete and aligned to their own size
+        if (layout.offsets[i] % bytesPerSample != 0 || layout.byteCounts[i] < expectedSize || layout.offsets[i]+expectedSize > fileSize) return false;
+    }
+    return true;
+}
+
+bool Tiff::LoadMappedTiffBlocks(const uchar *mapping, const MappedLayout &layout, const TiffProperties &properties,
+                                const BlockFunc_t &blockFunc, const ProgressUpdateFunc_t &progressFunc,
+                                int startY, int endY, int startX, int endX, const std::atomic<bool>* cancel)
+{
+    auto cancelled = [cancel]() { return cancel != nullptr && cancel->load(std::memory_order_relaxed); };
+    const auto bytesPerSample = properties.bitsPerSample/8;
+    // a strip of an uncompressed file is often the whole image, so work is split by rows and blocks never span more than a few of them
+    constexpr std::uint32_t maxRowsPerBlock = 64;
+
+    auto threadCount = std::thread::hardware_concurrency();
+    std::vector<std::thread> threads; threads.reserve(threadCount);
+
+    for (auto i = 0; i < threadCount; ++i) {
+        threads.emplace_back([i, threadCount, bytesPerSample, mapping, &layout, &properties, &blockFunc, &progressFunc, &cancelled, startX, endX, startY, endY]() {
+            if (properties.tiled) {
+                const auto tileWidth = properties.tileWidth, tileHeight = properties.tileHeight;
+                const auto tilesAcross = (properties.width+tileWidth-1)/tileWidth;
+                size_t firstTileY = startY/tileHeight;
+                size_t numberOfTiles_y = endY/tileHeight-firstTileY+1;
+                size_t counter = 1;
+                size_t threadBegin = firstTileY+(float)(i)/threadCount*numberOfTiles_y;
+                size_t threadEnd = firstTileY+(float)(i+1)/threadCount*numberOfTiles_y;
+
+                for (std::size_t tileY = threadBegin; tileY < threadEnd && !cancelled(); ++tileY) {
+                    std::uint32_t currY = tileY*tileHeight;
+                    std::uint32_t blockStartY = std::max<std::uint32_t>(currY, startY);
+                    std::uint32_t blockEndY = std::min<std::uint32_t>(currY+tileHeight-1, endY);
+                    for (std::uint32_t currX = startX/tileWidth*tileWidth; currX <= endX; currX += tileWidth) {
+                        auto tile = mapping+layout.offsets[tileY*tilesAcross+currX/tileWidth];
+                        std::uint32_t blockStartX = std::max<std::uint32_t>(currX, startX);
+                        std::uint32_t blockEndX = std::min<std::uint32_t>(currX+tileWidth-1, endX);
+                        auto offset = ((size_t)(blockStartY-currY)*tileWidth+blockStartX-currX)*bytesPerSample;
+                        blockFunc({tile+offset, blockStartX, blockStartY, blockEndX-blockStartX+1, blockEndY-blockStartY+1, tileWidth}, i);
+                    }
+                    if (i == 0) {
+                        float br = counter++;
+                        float nz = (float)numberOfTiles_y/threadCount;
+                        progressFunc(br/nz*100);
+                    }
+                }
+            }
+            else {
+                const auto rowsPerStrip = properties.rowsPerStrip;
+                std::uint32_t threadBegin = startY+(float)(i)/threadCount*(endY-startY+1);
+                std::uint32_t threadEnd = startY+(float)(i+1)/threadCount*(endY-startY+1);
+
+                for (auto row = threadBegin; row < threadEnd && !cancelled();) {
+                    auto strip = row/rowsPerStrip;
+                    std::uint32_t stripEnd = std::min<std::uint32_t>((strip+1)*rowsPerStrip, threadEnd);
+                    std::uint32_t blockEnd = std::min(stripEnd, row+maxRowsPerBlock);
+                    auto offset = ((size_t)(row-strip*rowsPerStrip)*properties.width+startX)*bytesPerSample;
+                    blockFunc({mapping+layout.offsets[strip]+offset, (std::uint32_t)startX, row, (std::uint32_t)(endX-startX+1), blockEnd-row, properties.width}, i);
+                    row = blockEnd;
+                    if (i == 0) {
+                        float br = row-threadBegin;
+                        float nz = (float)(endY-startY+1)/threadCount;
+                        progressFunc(br/nz*100);
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    return true;
+}
+
+bool Tiff::LoadTiffBlocks(const QString &path, const TiffProperties& properties,
+                          const BlockFunc_t& blockFunc, const ProgressUpdateFunc_t& progressFunc,
+                          int startY, int endY, int startX, int endX, const ReadOptions& options)
+{
     if (endY == -1) endY = properties.height-1;
     if (endX == -1) endX = properties.width-1;
+    const auto bytesPerSample = properties.bitsPerSample/8;
 
+    // uncompressed samples are read straight out of the mapped file, so only the pages of the requested window are ever touched;
+    // those stay in the page cache, so the tile cache isn't used for them
+    if (options.useMemoryMapping) {
+        MappedLayout layout;
+        if (ReadMappedLayout(path, properties, layout, options.directory)) {
+            QFile file(path);
+            uchar* mapping = file.open(QIODevice::ReadOnly) ? file.map(0, file.size()) : nullptr;
+            if (mapping != nullptr) {
+                auto ok = LoadMappedTiffBlocks(mapping, layout, properties, blockFunc, progressFunc, startY, endY, startX, endX, options.cancel);
+                file.unmap(mapping);
+                return ok;
+            }
+        }
+    }
+
+    // libtiff handles are not thread-safe, so every worker decodes through its own handle instead of sharing one behind a lock
     auto threadCount = std::thread::hardware_concurrency();
     std::vector<std::thread> threads; threads.reserve(threadCount);
-    std::mutex mtx;
+    std::atomic<bool> failed = false;
+    auto pathString = path.toStdString();
+    const auto directory = options.directory;
+    const auto file = options.tileCache ? options.tileCache->fileId(path) : 0;
+    auto cancelled = [cancel = options.cancel]() { return cancel != nullptr && cancel->load(std::memory_order_relaxed); };
 
     for (auto i = 0; i < threadCount; ++i) {
-        threads.emplace_back([i, threadCount, &mtx, &tif, &properties, &tileFunc, &stripFunc, &progressFunc, startX, endX, startY, endY]() {
-            void* buf;
-            if (TIFFIsTiled(tif) != 0) {
-                const auto tileSize = TIFFTileSize(tif);
-                buf = _TIFFmalloc(tileSize);
+        threads.emplace_back([i, threadCount, bytesPerSample, directory, file, cache = options.tileCache, &failed, &cancelled, &pathString, &properties, &blockFunc, &progressFunc, startX, endX, startY, endY]() {
+            TIFF* threadTif = TIFFOpen(pathString.data(), "r");
+            if (!threadTif) {
+                failed = true;
+                return;
+            }
+            if (directory != 0 && !TIFFSetDirectory(threadTif, directory)) {
+                failed = true;
+                TIFFClose(threadTif);
+                return;
+            }
+            auto bufSize = properties.tiled ? TIFFTileSize(threadTif) : TIFFStripSize(threadTif);
+            void* buf = _TIFFmalloc(bufSize);
+            // decodes a strip or tile, or takes it from the cache if an earlier read already did;
+            // held keeps a cached one alive until the next strip or tile, even if the cache drops it meanwhile
+            TileCache::Data_t held;
+            auto decode = [&](std::uint32_t strile) -> const std::uint8_t* {
+                auto read = [&](void* dst) {
+                    return properties.tiled ? TIFFReadEncodedTile(threadTif, strile, dst, -1) : TIFFReadEncodedStrip(threadTif, strile, dst, -1);
+                };
+                if (cache != nullptr) {
+                    held = cache->get(file, directory, strile);
+                    if (held) return held->data();
+                }
+                if (read(buf) == -1) return nullptr;
+                auto decoded = static_cast<const std::uint8_t*>(buf);
+                // the thread's buffer is decoded into either way, the cache gets a copy
+                if (cache != nullptr) cache->put(file, directory, strile, std::make_shared<const std::vector<std::uint8_t>>(decoded, decoded+bufSize));
+                return decoded;
+            };
 
-                std::uint32_t tileWidth, tileHeight;
-                TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tileWidth);
-                TIFFGetField(tif, TIFFTAG_TILELENGTH, &tileHeight);
+            if (properties.tiled) {
+                const auto tileWidth = properties.tileWidth, tileHeight = properties.tileHeight;
 
-                size_t totalNumberOfTiles_y = std::ceil((float)properties.height/tileHeight);
+                size_t firstTileY = startY/tileHeight;
+                size_t numberOfTiles_y = endY/tileHeight-firstTileY+1;
                 size_t counter = 1;
-                size_t threadBegin = (float)(i)/threadCount*totalNumberOfTiles_y*tileHeight;
-                size_t threadEnd = (float)(i+1)/threadCount*totalNumberOfTiles_y*tileHeight;
-
-                for (std::size_t currY = threadBegin; currY < threadEnd; currY += tileHeight) {
-                    if (currY+tileHeight < startY || currY > endY) continue;
-                    for (std::size_t currX = 0; currX < properties.width; currX += tileWidth) {
-                        if (currX+tileWidth < startX || currX > endX) continue;
-                        {
-                            std::lock_guard lk (mtx);
-                            TIFFReadTile(tif, buf, currX, currY, 0, 0);
+                size_t threadBegin = firstTileY+(float)(i)/threadCount*numberOfTiles_y;
+                size_t threadEnd = firstTileY+(float)(i+1)/threadCount*numberOfTiles_y;
+
+                for (std::size_t tileY = threadBegin; tileY < threadEnd && !failed && !cancelled(); ++tileY) {
+                    std::uint32_t currY = tileY*tileHeight;
+                    std::uint32_t blockStartY = std::max<std::uint32_t>(currY, startY);
+                    std::uint32_t blockEndY = std::min<std::uint32_t>(currY+tileHeight-1, endY);
+                    for (std::uint32_t currX = startX/tileWidth*tileWidth; currX <= endX; currX += tileWidth) {
+                        auto tile = decode(TIFFComputeTile(threadTif, currX, currY, 0, 0));
+                        if (tile == nullptr) {
+                            failed = true;
+                            break;
                         }
-                        auto pixels = GetVectorsFromTile(buf, properties, tileWidth, tileHeight);
-                        tileFunc(std::move(pixels), currX, currY);
+                        std::uint32_t blockStartX = std::max<std::uint32_t>(currX, startX);
+                        std::uint32_t blockEndX = std::min<std::uint32_t>(currX+tileWidth-1, endX);
+                        auto offset = ((size_t)(blockStartY-currY)*tileWidth+blockStartX-currX)*bytesPerSample;
+                        blockFunc({tile+offset, blockStartX, blockStartY, blockEndX-blockStartX+1, blockEndY-blockStartY+1, tileWidth}, i);
                     }
                     if (i == 0) {
                         float br = counter++;
-                        float nz = (float)totalNumberOfTiles_y/threadCount;
+                        float nz = (float)numberOfTiles_y/threadCount;
                         progressFunc(br/nz*100);
                     }
                 }
             }
             else {
-                buf = _TIFFmalloc(TIFFScanlineSize(tif));
-                auto counter = 1;
-                size_t threadBegin = startY+(float)(i)/threadCount*(endY-startY+1);
-                size_t threadEnd = startY+(float)(i+1)/threadCount*(endY-startY+1);
-
-                for (auto row = threadBegin; row < threadEnd; ++row) {
-                    if (row < startY || row > endY) continue;
-                    {
-                        std::lock_guard lk (mtx);
-                        TIFFReadScanline(tif, buf, row);
+                // whole strips are decoded at once; reading them scanline by scanline makes libtiff restart
+                // decompression from the strip's beginning whenever rows are requested out of order
+                const auto rowsPerStrip = properties.rowsPerStrip;
+
+                size_t firstStrip = startY/rowsPerStrip;
+                size_t numberOfStrips = endY/rowsPerStrip-firstStrip+1;
+                size_t counter = 1;
+                size_t threadBegin = firstStrip+(float)(i)/threadCount*numberOfStrips;
+                size_t threadEnd = firstStrip+(float)(i+1)/threadCount*numberOfStrips;
+
+                for (std::size_t strip = threadBegin; strip < threadEnd && !failed && !cancelled(); ++strip) {
+                    auto data = decode(strip);
+                    if (data == nullptr) {
+                        failed = true;
+                        break;
                     }
-                    auto pixels = GetVectorFromScanline(buf,properties, startX, endX);
-                    stripFunc(std::move(pixels), row);
+                    std::uint32_t currY = strip*rowsPerStrip;
+                    std::uint32_t blockStartY = std::max<std::uint32_t>(currY, startY);
+                    std::uint32_t blockEndY = std::min<std::uint32_t>(currY+rowsPerStrip-1, endY);
+                    auto offset = ((size_t)(blockStartY-currY)*properties.width+startX)*bytesPerSample;
+                    blockFunc({data+offset, (std::uint32_t)startX, blockStartY, (std::uint32_t)(endX-startX+1), blockEndY-blockStartY+1, properties.width}, i);
                     if (i == 0) {
                         float br = counter++;
-                        float nz = (float)(endY-startY+1)/threadCount;
+                        float nz = (float)numberOfStrips/threadCount;
                         progressFunc(br/nz*100);
                     }
                 }
             }
             _TIFFfree(buf);
+            TIFFClose(threadTif);
         });
     }
     for (auto& thread : threads) thread.join();
 
-    TIFFClose(tif);
+    if (failed) {
+        Gui::ThrowError("Error while decoding image.");
+        return false;
+    }
     return true;
 }
 
@@ -126,188 +405,24 @@ std::vector<double> Tiff::GetVectorFromScanline(void *data, const TiffProperties
 {
     if (endX == -1) endX = properties.width-1;
     std::vector<double> rv(endX-startX+1);
-        if (properties.sampleFormat == SAMPLEFORMAT_UINT) {
-            if (properties.bitsPerSample == 8) {
-                auto _data = (uint8_t*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-            else if (properties.bitsPerSample == 16) {
-                auto _data = (uint16_t*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-            else if (properties.bitsPerSample == 32) {
-                auto _data = (uint32_t*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-            else if (properties.bitsPerSample == 64) {
-                auto _data = (uint64_t*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-        }
-        else if (properties.sampleFormat == SAMPLEFORMAT_INT) {
-            if (properties.bitsPerSample == 8) {
-                auto _data = (int8_t*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-            else if (properties.bitsPerSample == 16) {
-                auto _data = (int16_t*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-            else if (properties.bitsPerSample == 32) {
-                auto _data = (int32_t*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-            else if (properties.bitsPerSample == 64) {
-                auto _data = (int64_t*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-        }
-        else if (properties.sampleFormat == SAMPLEFORMAT_IEEEFP) {
-            if (properties.bitsPerSample == 32) {
-                auto _data = (float*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-            else if (properties.bitsPerSample == 64) {
-                auto _data = (double*)data;
-                auto counter = 0;
-                for (auto i = startX; i <= endX; ++i) rv[counter++] = _data[i];
-            }
-        }
-        return rv;
+    DispatchSampleType(properties, [&](auto sample) {
+        auto _data = static_cast<const decltype(sample)*>(data);
+        std::copy(_data+startX, _data+endX+1, rv.begin());
+        return true;
+    });
+    return rv;
 }
 
 std::vector<std::vector<double>> Tiff::GetVectorsFromTile(void *data, const TiffProperties& properties, unsigned int tileWidth, unsigned int tileHeight)
 {
     std::vector<std::vector<double>> rv;
     rv.reserve(tileHeight);
-
-    if (properties.sampleFormat == SAMPLEFORMAT_UINT) {
-        if (properties.bitsPerSample == 8) {
-            auto _data = (uint8_t*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-        else if (properties.bitsPerSample == 16) {
-            auto _data = (uint16_t*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-        else if (properties.bitsPerSample == 32) {
-            auto _data = (uint32_t*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-        else if (properties.bitsPerSample == 64) {
-            auto _data = (uint64_t*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-    }
-
-    else if (properties.sampleFormat == SAMPLEFORMAT_INT) {
-        if (properties.bitsPerSample == 8) {
-            auto _data = (int8_t*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
+    DispatchSampleType(properties, [&](auto sample) {
+        auto _data = static_cast<const decltype(sample)*>(data);
+        for (auto y = 0; y < tileHeight; ++y) {
+            rv.emplace_back(_data+(size_t)y*tileWidth, _data+(size_t)(y+1)*tileWidth);
         }
-        else if (properties.bitsPerSample == 16) {
-            auto _data = (int16_t*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-        else if (properties.bitsPerSample == 32) {
-            auto _data = (int32_t*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-        else if (properties.bitsPerSample == 64) {
-            auto _data = (int64_t*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-    }
-    else if (properties.sampleFormat == SAMPLEFORMAT_IEEEFP) {
-        if (properties.bitsPerSample == 32) {
-            auto _data = (float*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-        else if (properties.bitsPerSample == 64) {
-            auto _data = (double*)data;
-            auto counter = 0;
-            for (auto y = 0; y < tileHeight; ++y) {
-                auto row = std::vector<double>(tileWidth);
-                for (auto x = 0; x < tileWidth; ++x) {
-                    row[x] = _data[counter++];
-                }
-                rv.push_back(row);
-            }
-        }
-    }
-
+        return true;
+    });
     return rv;
-
 }
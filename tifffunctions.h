@@ -1,6 +1,7 @@
 #ifndef TIFFFUNCTIONS_H
 #define TIFFFUNCTIONS_H
 
+#include <atomic>
 #include <vector>
 #include <QString>
 #include <queue>
@@ -8,27 +9,129 @@
 #include <tiff.h>
 #include <tiffio.h>
 #include <memory>
+#include <optional>
 #include <mutex>
 #include <QThreadPool>
 #include <QDebug>
 #include <QProgressBar>
+#include "tilecache.h"
 
 
 namespace Tiff {
+// gdal stores the value of cells without data in this ascii tag
+constexpr std::uint32_t TIFFTAG_GDAL_NODATA = 42113;
+
 struct TiffProperties {
     unsigned int width, height, bitsPerSample, sampleFormat;
+    bool tiled;
+    std::uint32_t tileWidth, tileHeight;
+    std::uint32_t rowsPerStrip;
+    std::optional<double> noData;
+};
+
+// a window of decoded samples that is still in the file's native type; rows are stride samples apart
+template <typename T>
+struct SampleView {
+    using value_type = T;
+    const T* data;
+    std::uint32_t x, y, width, height;
+    std::size_t stride;
+
+    const T* row(std::uint32_t r) const { return data + r*stride; }
+    T operator()(std::uint32_t col, std::uint32_t r) const { return data[r*stride+col]; }
+};
+
+struct RawBlock {
+    const void* data;
+    std::uint32_t x, y, width, height;
+    std::size_t stride;
+
+    template <typename T> SampleView<T> view() const { return {static_cast<const T*>(data), x, y, width, height, stride}; }
+};
+
+struct ReadOptions {
+    bool useMemoryMapping = true;
+    // image file directory to read, 0 is the full resolution image
+    std::uint16_t directory = 0;
+    // once set, the remaining blocks are skipped and the read returns early
+    const std::atomic<bool>* cancel = nullptr;
+    // decoded strips or tiles are looked up here before decoding, and added to it after
+    TileCache* tileCache = nullptr;
+};
+
+// a reduced-resolution copy of the image stored in the same file
+struct Overview {
+    std::uint16_t directory;
+    std::uint32_t width, height;
+    unsigned int factor;
+};
+
+// file positions of an uncompressed raster's strips or tiles
+struct MappedLayout {
+    std::vector<std::uint64_t> offsets, byteCounts;
 };
 
 using TileFunc_t = std::function<void (std::vector<std::vector<double>>&&, std::uint32_t, std::uint32_t)>;
 using StripFunc_t = std::function<void (std::vector<double>&&, std::uint32_t)>;
+using BlockFunc_t = std::function<void (const RawBlock&, unsigned int)>;
 using ProgressUpdateFunc_t = std::function<void (uint32_t)>;
 
 std::pair<unsigned int, unsigned int> GetWidthAndHeight(const QString& path);
+bool GetProperties(const QString& path, TiffProperties& properties, std::uint16_t directory = 0);
+std::vector<Overview> GetOverviews(const QString& path);
+std::optional<Overview> FindBestOverview(const QString& path, unsigned int scale);
 bool LoadTiff(const QString& path, const TileFunc_t& tileFunc, const StripFunc_t& stripFunc, const ProgressUpdateFunc_t& progressFunc, int startY = 0, int endY = -1, int startX = 0, int endX = -1);
+bool LoadTiffBlocks(const QString& path, const TiffProperties& properties, const BlockFunc_t& blockFunc, const ProgressUpdateFunc_t& progressFunc, int startY = 0, int endY = -1, int startX = 0, int endX = -1, const ReadOptions& options = {});
+bool ReadMappedLayout(const QString& path, const TiffProperties& properties, MappedLayout& layout, std::uint16_t directory = 0);
+bool LoadMappedTiffBlocks(const uchar* mapping, const MappedLayout& layout, const TiffProperties& properties, const BlockFunc_t& blockFunc, const ProgressUpdateFunc_t& progressFunc, int startY, int endY, int startX, int endX, const std::atomic<bool>* cancel = nullptr);
 //bool LoadTiffWithLua(const QString& path,  const std::string& luaFunc, int startY = 0, int endY = -1, int startX = 0, int endX = -1);
 std::vector<double> GetVectorFromScanline(void* data, const TiffProperties& properties, int startX = 0, int endX = -1);
 std::vector<std::vector<double>> GetVectorsFromTile(void* data, const TiffProperties& properties, unsigned int tileWidth, unsigned int tileHeight);
 
+// calls func with a value of the C++ type matching the raster's samples, so that it gets instantiated once per sample type
+template <typename F>
+bool DispatchSampleType(const TiffProperties& properties, F&& func) {
+    switch (properties.sampleFormat) {
+        case SAMPLEFORMAT_UINT:
+            switch (properties.bitsPerSample) {
+                case 8: return func(std::uint8_t{});
+                case 16: return func(std::uint16_t{});
+                case 32: return func(std::uint32_t{});
+                case 64: return func(std::uint64_t{});
+                default: return false;
+            }
+        case SAMPLEFORMAT_INT:
+            switch (properties.bitsPerSample) {
+                case 8: return func(std::int8_t{});
+                case 16: return func(std::int16_t{});
+                case 32: return func(std::int32_t{});
+                case 64: return func(std::int64_t{});
+                default: return false;
+            }
+        case SAMPLEFORMAT_IEEEFP:
+            switch (properties.bitsPerSample) {
+                case 32: return func(float{});
+                case 64: return func(double{});
+                default: return false;
+            }
+        default: return false;
+    }
+}
+
+// visitor is called as visitor(const SampleView<T>&, unsigned int threadIndex) from the decoding threads,
+// with views already clipped to the requested window
+template <typename F>
+bool LoadTiffView(const QString& path, F&& visitor, const ProgressUpdateFunc_t& progressFunc, int startY = 0, int endY = -1, int startX = 0, int endX = -1, const ReadOptions& options = {}) {
+    TiffProperties properties;
+    if (!GetProperties(path, properties, options.directory)) return false;
+    return DispatchSampleType(properties, [&](auto sample) {
+        using T = decltype(sample);
+        return LoadTiffBlocks(path, properties, [&visitor](const RawBlock& block, unsigned int threadIndex) {
+            visitor(block.view<T>(), threadIndex);
+        }, progressFunc, startY, endY, startX, endX, options);
+    });
+}
+
 }
 
 #endif // TIFFFUNCTIONS_H
@@ -0,0 +1,67 @@
+#include "tilecache.h"
+#include "consts.h"
+#include <QDateTime>
+#include <QFileInfo>
+
+Tiff::TileCache::TileCache(size_t maxBytes) : maxBytes(maxBytes)
+{
+}
+
+Tiff::TileCache &Tiff::TileCache::session()
+{
+    static TileCache cache(TileCacheSize::sessionBytes);
+    return cache;
+}
+
+std::uint32_t Tiff::TileCache::fileId(const QString &path)
+{
+    QFileInfo info(path);
+    auto identity = (info.absoluteFilePath()+"|"+QString::number(info.size())+"|"+QString::number(info.lastModified().toMSecsSinceEpoch())).toStdString();
+    std::lock_guard<std::mutex> lock(mutex);
+    return fileIds.emplace(identity, fileIds.size()).first->second;
+}
+
+Tiff::TileCache::Data_t Tiff::TileCache::get(std::uint32_t file, std::uint16_t directory, std::uint32_t strile)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find({file, directory, strile});
+    if (it == index.end()) return nullptr;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+void Tiff::TileCache::put(std::uint32_t file, std::uint16_t directory, std::uint32_t strile, Data_t data)
+{
+    if (!data || data->size() > maxBytes) return;
+    Key key{file, directory, strile};
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it != index.end()) {
+        bytes -= it->second->second->size();
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    bytes += data->size();
+    entries.emplace_front(key, std::move(data));
+    index[key] = entries.begin();
+    while (bytes > maxBytes) {
+        auto& last = entries.back();
+        bytes -= last.second->size();
+        index.erase(last.first);
+        entries.pop_back();
+    }
+}
+
+void Tiff::TileCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    bytes = 0;
+}
+
+size_t Tiff::TileCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytes;
+}
@@ -0,0 +1,50 @@
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <QString>
+
+namespace Tiff {
+// decoded strips or tiles, least recently used ones are dropped once the cache is over its size.
+// entries are handed out as shared pointers, so dropping one never pulls data from under a reader
+class TileCache {
+public:
+    using Data_t = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+    explicit TileCache(size_t maxBytes);
+    // the cache that lives for the whole session, so that repeated previews of a file don't decode it again
+    static TileCache& session();
+
+    // a modified or replaced file gets a new id, so entries of its old contents are never returned
+    std::uint32_t fileId(const QString& path);
+    Data_t get(std::uint32_t file, std::uint16_t directory, std::uint32_t strile);
+    void put(std::uint32_t file, std::uint16_t directory, std::uint32_t strile, Data_t data);
+    void clear();
+    size_t size() const;
+
+private:
+    struct Key {
+        std::uint32_t file;
+        std::uint16_t directory;
+        std::uint32_t strile;
+        bool operator==(const Key& other) const { return file == other.file && directory == other.directory && strile == other.strile; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return std::hash<std::uint64_t>()((std::uint64_t)key.file << 48 ^ (std::uint64_t)key.directory << 32 ^ key.strile); }
+    };
+
+    mutable std::mutex mutex;
+    std::list<std::pair<Key, Data_t>> entries; // most recently used first
+    std::unordered_map<Key, std::list<std::pair<Key, Data_t>>::iterator, KeyHash> index;
+    std::unordered_map<std::string, std::uint32_t> fileIds;
+    size_t bytes = 0;
+    size_t maxBytes;
+};
+}
+
+#endif // TILECACHE_H
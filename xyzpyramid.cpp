@@ -0,0 +1,170 @@
+#include "xyzpyramid.h"
+#include "consts.h"
+#include "pngfunctions.h"
+#include <QDir>
+#include <QFileInfo>
+#include <algorithm>
+#include <cstring>
+
+unsigned int Xyz::MaxZoom(std::uint32_t width, std::uint32_t height)
+{
+    unsigned int zoom = 0;
+    for (std::uint64_t covered = XyzTiles::tileSize; covered < std::max(width, height); covered *= 2) ++zoom;
+    return zoom;
+}
+
+namespace {
+// halves the first rows of a strip into the rows of to, which is half as wide, rounded up. a cell is the average of
+// the cells it covers inside the image, weighted by alpha for rgba so that transparent cells don't darken their neighbours
+template <typename Buffer>
+void Halve(const Buffer& from, std::uint32_t rows, Buffer& to)
+{
+    constexpr unsigned int channels = Buffer::channels;
+    for (std::uint32_t y = 0; y < (rows+1)/2; ++y) {
+        const typename Buffer::Sample_t* sourceRows[2] = { from.row(y*2), y*2+1 < rows ? from.row(y*2+1) : nullptr };
+        auto out = to.row(y);
+        for (std::uint32_t x = 0; x < to.width(); ++x) {
+            const typename Buffer::Sample_t* cells[4];
+            unsigned int count = 0;
+            for (auto row : sourceRows) {
+                if (!row) continue;
+                cells[count++] = row+(size_t)x*2*channels;
+                if (x*2+1 < from.width()) cells[count++] = row+(size_t)(x*2+1)*channels;
+            }
+            auto pixel = out+(size_t)x*channels;
+            if constexpr (channels == 4) {
+                std::uint32_t alpha = 0, sums[3] = {};
+                for (unsigned int i = 0; i < count; ++i) {
+                    alpha += cells[i][3];
+                    for (unsigned int c = 0; c < 3; ++c) sums[c] += cells[i][c]*cells[i][3];
+                }
+                if (alpha == 0) {
+                    std::fill(pixel, pixel+4, 0);
+                    continue;
+                }
+                for (unsigned int c = 0; c < 3; ++c) pixel[c] = (sums[c]+alpha/2)/alpha;
+                pixel[3] = (alpha+count/2)/count;
+            }
+            else {
+                std::uint32_t sum = 0;
+                for (unsigned int i = 0; i < count; ++i) sum += cells[i][0];
+                pixel[0] = (sum+count/2)/count;
+            }
+        }
+    }
+}
+}
+
+template <typename Buffer>
+Xyz::PyramidWriter<Buffer>::PyramidWriter(const QString &directory, std::uint32_t width, std::uint32_t height, Util::OutputFormat format, Util::Compression compression)
+    : directory(directory), format(format), compression(compression)
+{
+    const unsigned int zoom = MaxZoom(width, height);
+    levels.resize(zoom+1);
+    for (int z = zoom; z >= 0; --z) {
+        auto& level = levels[z];
+        level.width = z == (int)zoom ? width : (levels[z+1].width+1)/2;
+        level.height = z == (int)zoom ? height : (levels[z+1].height+1)/2;
+        level.strip = Buffer(level.width, XyzTiles::tileSize);
+        const std::uint32_t columns = (level.width+XyzTiles::tileSize-1)/XyzTiles::tileSize;
+        for (std::uint32_t x = 0; x < columns; ++x) {
+            if (!QDir().mkpath(directory+"/"+QString::number(z)+"/"+QString::number(x))) failed = true;
+        }
+    }
+}
+
+template <typename Buffer>
+Xyz::PyramidWriter<Buffer>::~PyramidWriter()
+{
+    // the tasks still queued write into this object
+    pool.waitForDone();
+}
+
+template <typename Buffer>
+bool Xyz::PyramidWriter<Buffer>::put(const Buffer &rows)
+{
+    if (failed || !rows || rows.width() != levels.back().width) return false;
+    append(maxZoom(), rows.data(), rows.height());
+    return !failed;
+}
+
+template <typename Buffer>
+bool Xyz::PyramidWriter<Buffer>::finish()
+{
+    // a partial strip only ever adds rows to the levels above it, so they're flushed from the most detailed one up
+    for (int z = maxZoom(); z >= 0; --z) flush(z);
+    pool.waitForDone();
+    return !failed;
+}
+
+template <typename Buffer>
+void Xyz::PyramidWriter<Buffer>::append(unsigned int zoom, const Sample_t *rows, std::uint32_t count)
+{
+    auto& level = levels[zoom];
+    const size_t rowSize = level.strip.rowSize();
+    while (count > 0) {
+        const std::uint32_t taken = std::min(count, XyzTiles::tileSize-level.filled);
+        std::memcpy(level.strip.row(level.filled), rows, taken*rowSize*sizeof(Sample_t));
+        level.filled += taken;
+        rows += taken*rowSize;
+        count -= taken;
+        if (level.filled == XyzTiles::tileSize) flush(zoom);
+    }
+}
+
+template <typename Buffer>
+void Xyz::PyramidWriter<Buffer>::flush(unsigned int zoom)
+{
+    auto& level = levels[zoom];
+    if (level.filled == 0) return;
+    constexpr unsigned int channels = Buffer::channels;
+    const std::uint32_t columns = (level.width+XyzTiles::tileSize-1)/XyzTiles::tileSize;
+    for (std::uint32_t x = 0; x < columns; ++x) {
+        Buffer tile(XyzTiles::tileSize, XyzTiles::tileSize, true);
+        const std::uint32_t tileWidth = std::min(XyzTiles::tileSize, level.width-x*XyzTiles::tileSize);
+        for (std::uint32_t y = 0; y < level.filled; ++y) {
+            std::memcpy(tile.row(y), level.strip.row(y)+(size_t)x*XyzTiles::tileSize*channels, (size_t)tileWidth*channels*sizeof(Sample_t));
+        }
+        writeTile(zoom, x, level.tileRow, std::move(tile));
+    }
+
+    const std::uint32_t rows = level.filled;
+    level.filled = 0;
+    ++level.tileRow;
+    if (zoom == 0) return;
+    Buffer halved(levels[zoom-1].width, (rows+1)/2);
+    Halve(level.strip, rows, halved);
+    append(zoom-1, halved.data(), halved.height());
+}
+
+template <typename Buffer>
+void Xyz::PyramidWriter<Buffer>::writeTile(unsigned int zoom, std::uint32_t x, std::uint32_t y, Buffer tile)
+{
+    {
+        // tiles are made faster than they're compressed, this keeps the waiting ones from piling up
+        std::unique_lock<std::mutex> lock(mutex);
+        const size_t maxPending = std::max(1, pool.maxThreadCount())*XyzTiles::pendingPerThread;
+        changed.wait(lock, [this, maxPending]() { return pending < maxPending; });
+        ++pending;
+    }
+    const QString path = directory+"/"+QString::number(zoom)+"/"+QString::number(x)+"/"+QString::number(y)+Png::FileExtension(format);
+    // the pool takes copyable functions only
+    auto shared = std::make_shared<Buffer>(std::move(tile));
+    pool.start([this, path, shared]() {
+        if (Png::SaveImage(*shared, path, format, compression)) {
+            ++tiles;
+            bytes += QFileInfo(path).size();
+        }
+        else {
+            failed = true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --pending;
+        }
+        changed.notify_all();
+    });
+}
+
+template class Xyz::PyramidWriter<Png::Rgba8>;
+template class Xyz::PyramidWriter<Png::Gray16>;
@@ -0,0 +1,69 @@
+#ifndef XYZPYRAMID_H
+#define XYZPYRAMID_H
+
+#include "commonfunctions.h"
+#include "imagebuffer.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <QString>
+#include <QThreadPool>
+
+// z/x/y tiles of every zoom level of an image, in the image's own pixels: the most detailed level has the image's
+// resolution, every level above it is half of the one below, and level 0 fits in a single tile. tiles are counted
+// from the top left, edge tiles are padded with zeros, which is transparent for rgba
+namespace Xyz {
+unsigned int MaxZoom(std::uint32_t width, std::uint32_t height);
+
+// takes the rows of the most detailed level from the top, a band at a time, and keeps a strip of one tile row for
+// each level. a full strip is cut into tiles that are written on the pool, and halved into the strip of the level
+// above, so the source is read once and memory depends on the width of the image only
+template <typename Buffer>
+class PyramidWriter {
+public:
+    PyramidWriter(const QString& directory, std::uint32_t width, std::uint32_t height, Util::OutputFormat format, Util::Compression compression);
+    ~PyramidWriter();
+    PyramidWriter(const PyramidWriter&) = delete;
+    PyramidWriter& operator=(const PyramidWriter&) = delete;
+
+    // false once a directory couldn't be made or a tile couldn't be written
+    bool put(const Buffer& rows);
+    // writes the strips that aren't full and waits for the tiles
+    bool finish();
+    unsigned int maxZoom() const { return static_cast<unsigned int>(levels.size())-1; }
+    size_t tileCount() const { return tiles; }
+    std::uint64_t byteCount() const { return bytes; }
+
+private:
+    using Sample_t = typename Buffer::Sample_t;
+
+    struct Level {
+        std::uint32_t width, height;
+        Buffer strip;
+        std::uint32_t filled = 0;
+        std::uint32_t tileRow = 0;
+    };
+
+    void append(unsigned int zoom, const Sample_t* rows, std::uint32_t count);
+    void flush(unsigned int zoom);
+    void writeTile(unsigned int zoom, std::uint32_t x, std::uint32_t y, Buffer tile);
+
+    QString directory;
+    Util::OutputFormat format;
+    Util::Compression compression;
+    std::vector<Level> levels;
+
+    // the tiles of every level share this pool. the global one isn't used, preview windows hold its threads while they're open
+    QThreadPool pool;
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t pending = 0;
+    std::atomic<size_t> tiles = 0;
+    std::atomic<std::uint64_t> bytes = 0;
+    std::atomic<bool> failed = false;
+};
+}
+
+#endif // XYZPYRAMID_H